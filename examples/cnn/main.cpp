@@ -41,17 +41,19 @@ void initialize_input_and_weights(graph_state &state, nz::render_graph &graph)
   std::mt19937 gen(rd());
   std::uniform_real_distribution<float> dis(0.0f, 1.0f);
 
-  nz::memory_mapping input_map = graph.get_buffer(state.input_data).map();
-  float *input_data = (float *)input_map.data();
+  nz::gpu_buffer &input = graph.get_buffer(state.input_data);
 
-  for (int i = 0; i < collapse_shape(state.input_shape, 3); ++i)
-    input_data[i] = dis(gen);
+  for (float &value : input.view<float>())
+    value = dis(gen);
 
-  nz::memory_mapping weight_map = graph.get_buffer(state.weight_data).map();
-  float *weight_data = (float *)weight_map.data();
+  input.flush();
 
-  for (int i = 0; i < collapse_shape(state.weights_shape, 4); ++i)
-    weight_data[i] = dis(gen);
+  nz::gpu_buffer &weights = graph.get_buffer(state.weight_data);
+
+  for (float &value : weights.view<float>())
+    value = dis(gen);
+
+  weights.flush();
 }
 
 nz::job record_cnn(graph_state &state, nz::render_graph &graph)
@@ -81,8 +83,8 @@ nz::job record_cnn(graph_state &state, nz::render_graph &graph)
 
     graph.add_compute_pass()
       .set_kernel(state.cnn_kernel)
-      .add_storage_buffer(state.input_data)
-      .add_storage_buffer(state.weight_data)
+      .add_storage_buffer_readonly(state.input_data)
+      .add_storage_buffer_readonly(state.weight_data)
       .add_storage_buffer(state.output_data)
       .dispatch(640 * 640, 32, 1)
       .send_data(sd);
@@ -113,7 +115,7 @@ int main(int argc, char **argv)
 
   state.output_data = graph.register_buffer(
     { .size = (uint32_t)sizeof(float) * collapse_shape(state.output_shape, 3),
-      .host_visible = true });
+      .memory = nz::memory_usage::gpu_to_cpu });
 
   state.cnn_kernel = graph.register_compute_kernel("kernel_cnn_mn");
 
@@ -128,8 +130,10 @@ int main(int argc, char **argv)
 
   nz::log_info("Work finished in %f seconds", nz::time_difference(end, start));
 
-  nz::memory_mapping output_map = graph.get_buffer(state.output_data).map();
-  float *output_data = (float *)output_map.data();
+  nz::gpu_buffer &output = graph.get_buffer(state.output_data);
+  output.invalidate();
+
+  nz::buffer_view<float> output_data = output.view<float>();
 
   for (int i = 0; i < 20; ++i)
   {
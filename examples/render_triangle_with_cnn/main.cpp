@@ -67,6 +67,13 @@ int main(int argc, char **argv)
     graph.placeholder_job()
   };
 
+  /* The CNN workloads. These only contain compute passes, so they go to the
+   * async compute queue (if the GPU has one) and overlap with rendering. */
+  nz::job cnn_jobs[MAX_FRAMES_IN_FLIGHT] = {
+    graph.placeholder_job(),
+    graph.placeholder_job()
+  };
+
   nz::compute_kernel kernel = graph.register_compute_kernel("kernel_matmul_4x_threads");
   nz::gpu_buffer_ref mat_a = graph.register_buffer(
     { .size = SHAPE_M * SHAPE_K * sizeof(float), .host_visible = true, .type = nz::binding::type::storage_buffer });
@@ -98,12 +105,13 @@ int main(int argc, char **argv)
 
     /* Wait for the previous workload to finish. */
     frame_jobs[current_frame].wait();
+    cnn_jobs[current_frame].wait();
 
     /* Update the swapchain. */
     uint32_t image_idx = 0;
     nz::job acquire_job = surface.acquire_next_swapchain_image(graph, image_idx);
 
-    /* Record frame rendering commands. */
+    /* Record the CNN commands. Nothing in the frame depends on them. */
     graph.begin();
     {
       graph.add_compute_pass()
@@ -112,7 +120,14 @@ int main(int argc, char **argv)
         .add_storage_buffer(mat_b)
         .add_storage_buffer(mat_out)
         .dispatch(BLOCK_COUNT_N, BLOCK_COUNT_M, 1);
+    }
+    cnn_jobs[current_frame] = graph.end();
+
+    graph.submit(cnn_jobs[current_frame]);
 
+    /* Record frame rendering commands. */
+    graph.begin();
+    {
       /* Start recording commands for this frame. */
       graph.add_render_pass()
         .add_color_attachment(state.backbuffer[image_idx], {0.0f})
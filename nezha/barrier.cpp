@@ -0,0 +1,711 @@
+#include <nezha/barrier.hpp>
+#include <nezha/bump_alloc.hpp>
+#include <nezha/gpu_context.hpp>
+
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+
+namespace nz
+{
+
+static constexpr VkAccessFlags write_access_mask =
+  VK_ACCESS_SHADER_WRITE_BIT |
+  VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+  VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+  VK_ACCESS_TRANSFER_WRITE_BIT |
+  VK_ACCESS_HOST_WRITE_BIT |
+  VK_ACCESS_MEMORY_WRITE_BIT;
+
+bool is_write_access(VkAccessFlags access)
+{
+  return (access & write_access_mask) != 0;
+}
+
+hazard classify_hazard(
+  VkAccessFlags prev_access, VkPipelineStageFlags prev_stage,
+  VkAccessFlags next_access, VkPipelineStageFlags next_stage,
+  bool layout_transition)
+{
+  bool prev_write = is_write_access(prev_access);
+  bool next_write = is_write_access(next_access) || layout_transition;
+
+  if (prev_write)
+    return next_write ? hazard::write_after_write : hazard::read_after_write;
+
+  if (next_write)
+    return prev_access ? hazard::write_after_read : hazard::write_after_write;
+
+  // Read after read: nothing to do if the resource was never accessed, or if
+  // the previous barrier already made memory visible to this stage / access.
+  if (prev_access == 0)
+    return hazard::none;
+
+  if ((next_access & ~prev_access) == 0 && (next_stage & ~prev_stage) == 0)
+    return hazard::none;
+
+  return hazard::read_after_read;
+}
+
+barrier_batch::barrier_batch(
+  u32 max_image_barriers, u32 max_buffer_barriers, barrier_stats *stats)
+: img_barriers_(bump_mem_alloc<VkImageMemoryBarrier2>(max_image_barriers)),
+  buf_barriers_(bump_mem_alloc<VkBufferMemoryBarrier2>(max_buffer_barriers)),
+  img_barrier_count_(0), max_img_barriers_(max_image_barriers),
+  buf_barrier_count_(0), max_buf_barriers_(max_buffer_barriers),
+  evt_img_barriers_(bump_mem_alloc<VkImageMemoryBarrier2>(max_image_barriers)),
+  evt_buf_barriers_(bump_mem_alloc<VkBufferMemoryBarrier2>(max_buffer_barriers)),
+  events_(bump_mem_alloc<VkEvent>(max_image_barriers + max_buffer_barriers)),
+  evt_img_barrier_count_(0), evt_buf_barrier_count_(0), event_count_(0),
+  stats_(stats), queue_family_(-1), releases_(nullptr)
+{
+}
+
+// Replays a saved batch (see SAVE())
+barrier_batch::barrier_batch(
+  saved_barrier_batches &storage, u32 idx, const VkEvent *events,
+  barrier_stats *stats)
+: stats_(stats), queue_family_(-1), releases_(nullptr)
+{
+  saved_barrier_batches::batch &b = storage.batches[idx];
+
+  img_barriers_ = storage.img_barriers.data() + b.img_offset;
+  buf_barriers_ = storage.buf_barriers.data() + b.buf_offset;
+  evt_img_barriers_ = storage.evt_img_barriers.data() + b.evt_img_offset;
+  evt_buf_barriers_ = storage.evt_buf_barriers.data() + b.evt_buf_offset;
+
+  img_barrier_count_ = max_img_barriers_ = b.img_count;
+  buf_barrier_count_ = max_buf_barriers_ = b.buf_count;
+  evt_img_barrier_count_ = b.evt_img_count;
+  evt_buf_barrier_count_ = b.evt_buf_count;
+
+  event_count_ = b.event_count;
+  events_ = bump_mem_alloc<VkEvent>(event_count_);
+  for (u32 i = 0; i < event_count_; ++i)
+    events_[i] = events[storage.events[b.event_offset + i]];
+}
+
+void barrier_batch::save(saved_barrier_batches &storage,
+  const std::vector<VkEvent> &events) const
+{
+  saved_barrier_batches::batch b = {
+    (u32)storage.img_barriers.size(), img_barrier_count_,
+    (u32)storage.buf_barriers.size(), buf_barrier_count_,
+    (u32)storage.evt_img_barriers.size(), evt_img_barrier_count_,
+    (u32)storage.evt_buf_barriers.size(), evt_buf_barrier_count_,
+    (u32)storage.events.size(), event_count_
+  };
+
+  storage.img_barriers.insert(storage.img_barriers.end(),
+    img_barriers_, img_barriers_ + img_barrier_count_);
+  storage.buf_barriers.insert(storage.buf_barriers.end(),
+    buf_barriers_, buf_barriers_ + buf_barrier_count_);
+  storage.evt_img_barriers.insert(storage.evt_img_barriers.end(),
+    evt_img_barriers_, evt_img_barriers_ + evt_img_barrier_count_);
+  storage.evt_buf_barriers.insert(storage.evt_buf_barriers.end(),
+    evt_buf_barriers_, evt_buf_barriers_ + evt_buf_barrier_count_);
+
+  for (u32 i = 0; i < event_count_; ++i)
+  {
+    auto event = std::find(events.begin(), events.end(), events_[i]);
+    assert(event != events.end());
+
+    storage.events.push_back(event - events.begin());
+  }
+
+  storage.batches.push_back(b);
+}
+
+void saved_barrier_batches::clear()
+{
+  batches.clear();
+  img_barriers.clear();
+  buf_barriers.clear();
+  evt_img_barriers.clear();
+  evt_buf_barriers.clear();
+  events.clear();
+}
+
+/* Only barriers which already cover the range get widened. The state of that
+ * range was set by the pending barrier, so the new access just needs to be
+ * added to its destination. */
+static bool widen_buffer_barrier(
+  VkBufferMemoryBarrier2 *barriers, u32 count, VkBuffer buffer,
+  VkAccessFlags access, VkPipelineStageFlags stage,
+  VkDeviceSize begin, VkDeviceSize end)
+{
+  for (u32 i = 0; i < count; ++i)
+  {
+    VkBufferMemoryBarrier2 &pending = barriers[i];
+
+    if (pending.buffer == buffer && pending.offset <= begin &&
+        end <= pending.offset + pending.size)
+    {
+      pending.dstAccessMask |= access;
+      pending.dstStageMask |= stage;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static bool widen_image_barrier(
+  VkImageMemoryBarrier2 *barriers, u32 count, VkImage image,
+  VkImageLayout layout, VkAccessFlags access, VkPipelineStageFlags stage)
+{
+  for (u32 i = 0; i < count; ++i)
+  {
+    VkImageMemoryBarrier2 &pending = barriers[i];
+
+    if (pending.image == image && pending.newLayout == layout)
+    {
+      pending.dstAccessMask |= access;
+      pending.dstStageMask |= stage;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void barrier_batch::add_buffer(gpu_buffer &buf,
+  VkAccessFlags access, VkPipelineStageFlags stage,
+  VkDeviceSize offset, VkDeviceSize size)
+{
+  buf.job_stages_ |= stage;
+  buf.job_writes_ |= is_write_access(access);
+
+  if (queue_family_ >= 0)
+  {
+    if (buf.owner_family_ >= 0 && buf.owner_family_ != queue_family_)
+    {
+      transfer_buffer_(buf, access, stage);
+      return;
+    }
+
+    buf.owner_family_ = queue_family_;
+  }
+
+  VkDeviceSize end = (size == VK_WHOLE_SIZE ?
+    buf.size_ : glm::min(offset + size, (VkDeviceSize)buf.size_));
+
+  // Whatever happens, the event only needs to be waited on once
+  VkEvent event = buf.pending_event_;
+  VkPipelineStageFlags event_stage = buf.pending_event_stage_;
+  buf.pending_event_ = VK_NULL_HANDLE;
+
+  if (offset >= end)
+    return;
+
+  // Every range of the buffer with a different state gets looked at on its
+  // own, so that stages accessing disjoint parts don't wait on each other
+  u32 first = buf.split_range_states_(offset, end);
+  auto &states = buf.range_states_;
+
+  for (u32 i = first; i < states.size() && states[i].begin < end; ++i)
+  {
+    gpu_buffer::range_state &state = states[i];
+
+    hazard h = classify_hazard(state.access, state.stage, access, stage);
+
+    if (h == hazard::none)
+    {
+      // A range which was never accessed didn't need a barrier to begin with
+      if (stats_ && state.access)
+        ++stats_->elided_barriers;
+
+      // Readers accumulate so that the next write waits on all of them
+      state.access |= access;
+      state.stage |= stage;
+
+      continue;
+    }
+
+    // If there already is a pending barrier for this range (several stages of
+    // a wave reading it, or a stage binding it twice), just widen it
+    if (widen_buffer_barrier(buf_barriers_, buf_barrier_count_,
+          buf.buffer_, access, stage, state.begin, state.end) ||
+        widen_buffer_barrier(evt_buf_barriers_, evt_buf_barrier_count_,
+          buf.buffer_, access, stage, state.begin, state.end))
+    {
+      state.access |= access;
+      state.stage |= stage;
+
+      continue;
+    }
+
+    // The event only covers work which happened in the stages it was
+    // signaled with
+    bool use_event = (event != VK_NULL_HANDLE &&
+      (state.stage & ~event_stage) == 0);
+
+    VkBufferMemoryBarrier2 barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2;
+    barrier.buffer = buf.buffer_;
+    barrier.offset = state.begin;
+    barrier.size = state.end - state.begin;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.srcStageMask = (use_event ? event_stage : state.stage);
+    barrier.dstStageMask = stage;
+    // Write after read only needs an execution dependency
+    barrier.srcAccessMask = (h == hazard::write_after_read ?
+      0 : state.access);
+    barrier.dstAccessMask = access;
+
+    push_(barrier, use_event ? event : VK_NULL_HANDLE);
+
+    state.access = access;
+    state.stage = stage;
+  }
+
+  buf.merge_range_states_();
+}
+
+void barrier_batch::add_image(gpu_image &img, VkImageLayout layout,
+  VkAccessFlags access, VkPipelineStageFlags stage)
+{
+  gpu_image &state = img.get_();
+
+  // Layout transitions count as writes
+  state.job_stages_ |= stage;
+  state.job_writes_ |= (is_write_access(access) || state.current_layout_ != layout);
+
+  if (queue_family_ >= 0)
+  {
+    // Undefined contents don't need to be transferred
+    if (state.owner_family_ >= 0 && state.owner_family_ != queue_family_ &&
+        state.current_layout_ != VK_IMAGE_LAYOUT_UNDEFINED)
+    {
+      transfer_image_(state, layout, access, stage);
+      return;
+    }
+
+    state.owner_family_ = queue_family_;
+  }
+
+  hazard h = classify_hazard(
+    state.current_access_, state.last_used_, access, stage,
+    state.current_layout_ != layout);
+
+  VkEvent event = state.pending_event_;
+  VkPipelineStageFlags event_stage = state.pending_event_stage_;
+  state.pending_event_ = VK_NULL_HANDLE;
+
+  if (h == hazard::none)
+  {
+    if (stats_ && state.current_access_)
+      ++stats_->elided_barriers;
+
+    state.current_access_ |= access;
+    state.last_used_ |= stage;
+
+    return;
+  }
+
+  if (widen_image_barrier(img_barriers_, img_barrier_count_,
+        state.image_, layout, access, stage) ||
+      widen_image_barrier(evt_img_barriers_, evt_img_barrier_count_,
+        state.image_, layout, access, stage))
+  {
+    state.current_access_ |= access;
+    state.last_used_ |= stage;
+
+    return;
+  }
+
+  VkImageMemoryBarrier2 barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+  barrier.image = state.image_;
+  barrier.oldLayout = state.current_layout_;
+  barrier.newLayout = layout;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.srcStageMask = (event != VK_NULL_HANDLE ?
+    event_stage : state.last_used_);
+  barrier.dstStageMask = stage;
+  barrier.srcAccessMask = (h == hazard::write_after_read ?
+    0 : state.current_access_);
+  barrier.dstAccessMask = access;
+  barrier.subresourceRange.aspectMask = state.aspect_;
+  // TODO: Support non-hardcoded values for this
+  barrier.subresourceRange.baseArrayLayer = 0;
+  barrier.subresourceRange.baseMipLevel = 0;
+  barrier.subresourceRange.layerCount = 1;
+  barrier.subresourceRange.levelCount = 1;
+
+  push_(barrier, event);
+
+  state.current_layout_ = layout;
+  state.current_access_ = access;
+  state.last_used_ = stage;
+}
+
+void barrier_batch::set_queue_family(s32 family, ownership_releases *releases)
+{
+  queue_family_ = family;
+  releases_ = releases;
+}
+
+/* The release makes the writes of the previous family available, the acquire
+ * makes them visible to the new access. The submission of the release is
+ * waited on with a semaphore, which is what orders the two halves. */
+void barrier_batch::transfer_buffer_(gpu_buffer &buf,
+  VkAccessFlags access, VkPipelineStageFlags stage)
+{
+  buf.pending_event_ = VK_NULL_HANDLE;
+
+  auto &states = buf.get_range_states_();
+
+  VkAccessFlags prev_access = 0;
+  VkPipelineStageFlags prev_stage = 0;
+  for (auto &state : states)
+    (prev_access |= state.access), (prev_stage |= state.stage);
+
+  VkBufferMemoryBarrier2 barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2;
+  barrier.buffer = buf.buffer_;
+  barrier.offset = 0;
+  barrier.size = VK_WHOLE_SIZE;
+  barrier.srcQueueFamilyIndex = buf.owner_family_;
+  barrier.dstQueueFamilyIndex = queue_family_;
+
+  VkBufferMemoryBarrier2 release = barrier;
+  release.srcStageMask = prev_stage;
+  release.srcAccessMask = prev_access & write_access_mask;
+  release.dstStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+  releases_->buf_barriers.push_back(release);
+
+  barrier.srcStageMask = stage;
+  barrier.dstStageMask = stage;
+  barrier.dstAccessMask = access;
+  push_(barrier, VK_NULL_HANDLE);
+
+  states.resize(1);
+  states[0] = { 0, buf.size_, access, stage };
+
+  buf.owner_family_ = queue_family_;
+}
+
+void barrier_batch::transfer_image_(gpu_image &state, VkImageLayout layout,
+  VkAccessFlags access, VkPipelineStageFlags stage)
+{
+  state.pending_event_ = VK_NULL_HANDLE;
+
+  VkImageMemoryBarrier2 barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+  barrier.image = state.image_;
+  barrier.oldLayout = state.current_layout_;
+  barrier.newLayout = layout;
+  barrier.srcQueueFamilyIndex = state.owner_family_;
+  barrier.dstQueueFamilyIndex = queue_family_;
+  barrier.subresourceRange.aspectMask = state.aspect_;
+  barrier.subresourceRange.baseArrayLayer = 0;
+  barrier.subresourceRange.baseMipLevel = 0;
+  barrier.subresourceRange.layerCount = 1;
+  barrier.subresourceRange.levelCount = 1;
+
+  VkImageMemoryBarrier2 release = barrier;
+  release.srcStageMask = state.last_used_;
+  release.srcAccessMask = state.current_access_ & write_access_mask;
+  release.dstStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+  releases_->img_barriers.push_back(release);
+
+  barrier.srcStageMask = stage;
+  barrier.dstStageMask = stage;
+  barrier.dstAccessMask = access;
+  push_(barrier, VK_NULL_HANDLE);
+
+  state.current_layout_ = layout;
+  state.current_access_ = access;
+  state.last_used_ = stage;
+  state.owner_family_ = queue_family_;
+}
+
+void barrier_batch::push_(const VkImageMemoryBarrier2 &barrier, VkEvent event)
+{
+  if (event != VK_NULL_HANDLE)
+  {
+    assert(evt_img_barrier_count_ < max_img_barriers_);
+
+    evt_img_barriers_[evt_img_barrier_count_++] = barrier;
+    add_event_(event);
+  }
+  else
+  {
+    assert(img_barrier_count_ < max_img_barriers_);
+
+    img_barriers_[img_barrier_count_++] = barrier;
+  }
+}
+
+void barrier_batch::push_(const VkBufferMemoryBarrier2 &barrier, VkEvent event)
+{
+  if (event != VK_NULL_HANDLE)
+  {
+    if (evt_buf_barrier_count_ == max_buf_barriers_)
+      grow_buffer_barriers_();
+
+    evt_buf_barriers_[evt_buf_barrier_count_++] = barrier;
+    add_event_(event);
+  }
+  else
+  {
+    if (buf_barrier_count_ == max_buf_barriers_)
+      grow_buffer_barriers_();
+
+    buf_barriers_[buf_barrier_count_++] = barrier;
+  }
+}
+
+void barrier_batch::grow_buffer_barriers_()
+{
+  // A buffer binding may need several barriers if the tracked ranges of the
+  // buffer are split up, so the initial size is only an estimate
+  u32 max = glm::max(max_buf_barriers_ * 2, 4u);
+
+  auto *buf_barriers = bump_mem_alloc<VkBufferMemoryBarrier2>(max);
+  auto *evt_buf_barriers = bump_mem_alloc<VkBufferMemoryBarrier2>(max);
+  auto *events = bump_mem_alloc<VkEvent>(max_img_barriers_ + max);
+
+  memcpy(buf_barriers, buf_barriers_,
+    sizeof(VkBufferMemoryBarrier2) * buf_barrier_count_);
+  memcpy(evt_buf_barriers, evt_buf_barriers_,
+    sizeof(VkBufferMemoryBarrier2) * evt_buf_barrier_count_);
+  memcpy(events, events_, sizeof(VkEvent) * event_count_);
+
+  buf_barriers_ = buf_barriers;
+  evt_buf_barriers_ = evt_buf_barriers;
+  events_ = events;
+  max_buf_barriers_ = max;
+}
+
+void barrier_batch::add_event_(VkEvent event)
+{
+  // One producer stage signals a single event for all its resources
+  for (u32 i = 0; i < event_count_; ++i)
+    if (events_[i] == event)
+      return;
+
+  events_[event_count_++] = event;
+}
+
+static VkImageMemoryBarrier to_legacy_barrier(const VkImageMemoryBarrier2 &b)
+{
+  VkImageMemoryBarrier ret = {};
+  ret.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  ret.srcAccessMask = (VkAccessFlags)b.srcAccessMask;
+  ret.dstAccessMask = (VkAccessFlags)b.dstAccessMask;
+  ret.oldLayout = b.oldLayout;
+  ret.newLayout = b.newLayout;
+  ret.srcQueueFamilyIndex = b.srcQueueFamilyIndex;
+  ret.dstQueueFamilyIndex = b.dstQueueFamilyIndex;
+  ret.image = b.image;
+  ret.subresourceRange = b.subresourceRange;
+  return ret;
+}
+
+static VkBufferMemoryBarrier to_legacy_barrier(const VkBufferMemoryBarrier2 &b)
+{
+  VkBufferMemoryBarrier ret = {};
+  ret.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  ret.srcAccessMask = (VkAccessFlags)b.srcAccessMask;
+  ret.dstAccessMask = (VkAccessFlags)b.dstAccessMask;
+  ret.srcQueueFamilyIndex = b.srcQueueFamilyIndex;
+  ret.dstQueueFamilyIndex = b.dstQueueFamilyIndex;
+  ret.buffer = b.buffer;
+  ret.offset = b.offset;
+  ret.size = b.size;
+  return ret;
+}
+
+/* Legacy barriers only have one stage pair for the whole call. Converts and
+ * merges the stages of COUNT barriers into SRC / DST. */
+template <typename T, typename U>
+static T *to_legacy_barriers(const U *barriers, u32 count,
+  VkPipelineStageFlags &src, VkPipelineStageFlags &dst)
+{
+  T *ret = bump_mem_alloc<T>(count);
+
+  for (u32 i = 0; i < count; ++i)
+  {
+    ret[i] = to_legacy_barrier(barriers[i]);
+    src |= (VkPipelineStageFlags)barriers[i].srcStageMask;
+    dst |= (VkPipelineStageFlags)barriers[i].dstStageMask;
+  }
+
+  return ret;
+}
+
+/* Stage / access bits of the legacy flags have the same values in the 64-bit
+ * flags. TOP_OF_PIPE as a source and BOTTOM_OF_PIPE as a destination just
+ * mean "no stage", which synchronization2 can say exactly. */
+template <typename T>
+static void make_stages_exact(T *barriers, u32 count)
+{
+  for (u32 i = 0; i < count; ++i)
+  {
+    barriers[i].srcStageMask &= ~(VkPipelineStageFlags2)
+      VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT;
+    barriers[i].dstStageMask &= ~(VkPipelineStageFlags2)
+      VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT;
+  }
+}
+
+void barrier_batch::issue_legacy_(VkCommandBuffer cmdbuf)
+{
+  VkPipelineStageFlags src = 0, dst = 0;
+
+  auto *img = to_legacy_barriers<VkImageMemoryBarrier>(
+    img_barriers_, img_barrier_count_, src, dst);
+  auto *buf = to_legacy_barriers<VkBufferMemoryBarrier>(
+    buf_barriers_, buf_barrier_count_, src, dst);
+
+  // A zero stage mask isn't valid - resources which haven't been used yet
+  // just wait on the top of the pipe.
+  if (!src)
+    src = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+  if (!dst)
+    dst = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+
+  vkCmdPipelineBarrier(cmdbuf, src, dst, 0, 0, nullptr,
+    buf_barrier_count_, buf, img_barrier_count_, img);
+}
+
+void barrier_batch::issue_sync2_(VkCommandBuffer cmdbuf)
+{
+  make_stages_exact(img_barriers_, img_barrier_count_);
+  make_stages_exact(buf_barriers_, buf_barrier_count_);
+
+  VkDependencyInfo dependency = {};
+  dependency.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+  dependency.bufferMemoryBarrierCount = buf_barrier_count_;
+  dependency.pBufferMemoryBarriers = buf_barriers_;
+  dependency.imageMemoryBarrierCount = img_barrier_count_;
+  dependency.pImageMemoryBarriers = img_barriers_;
+
+  vkCmdPipelineBarrier2_proc(cmdbuf, &dependency);
+}
+
+void barrier_batch::issue_events_(VkCommandBuffer cmdbuf)
+{
+  // The events are set with vkCmdSetEvent, so they have to be waited on with
+  // the legacy command. The source stage mask is the union of the masks the
+  // events were signaled with.
+  VkPipelineStageFlags src = 0, dst = 0;
+
+  auto *img = to_legacy_barriers<VkImageMemoryBarrier>(
+    evt_img_barriers_, evt_img_barrier_count_, src, dst);
+  auto *buf = to_legacy_barriers<VkBufferMemoryBarrier>(
+    evt_buf_barriers_, evt_buf_barrier_count_, src, dst);
+
+  if (!dst)
+    dst = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+
+  vkCmdWaitEvents(cmdbuf, event_count_, events_, src, dst,
+    0, nullptr,
+    evt_buf_barrier_count_, buf,
+    evt_img_barrier_count_, img);
+}
+
+void barrier_batch::issue(VkCommandBuffer cmdbuf)
+{
+  if (empty())
+    return;
+
+  if (img_barrier_count_ || buf_barrier_count_)
+  {
+    if (gctx->is_sync2_enabled)
+      issue_sync2_(cmdbuf);
+    else
+      issue_legacy_(cmdbuf);
+
+    if (stats_)
+      ++stats_->pipeline_barrier_calls;
+  }
+
+  if (event_count_)
+    issue_events_(cmdbuf);
+
+  if (stats_)
+  {
+    u32 split = evt_img_barrier_count_ + evt_buf_barrier_count_;
+    stats_->issued_barriers += img_barrier_count_ + buf_barrier_count_ + split;
+    stats_->split_barriers += split;
+  }
+
+  img_barrier_count_ = buf_barrier_count_ = 0;
+  evt_img_barrier_count_ = evt_buf_barrier_count_ = event_count_ = 0;
+}
+
+void ownership_releases::clear()
+{
+  img_barriers.clear();
+  buf_barriers.clear();
+}
+
+bool ownership_releases::has_family(s32 family) const
+{
+  for (auto &b : img_barriers)
+    if (b.srcQueueFamilyIndex == (u32)family)
+      return true;
+
+  for (auto &b : buf_barriers)
+    if (b.srcQueueFamilyIndex == (u32)family)
+      return true;
+
+  return false;
+}
+
+template <typename T>
+static T *filter_releases(const std::vector<T> &barriers, s32 family, u32 &count)
+{
+  T *ret = bump_mem_alloc<T>(barriers.size());
+  count = 0;
+
+  for (auto &b : barriers)
+    if (b.srcQueueFamilyIndex == (u32)family)
+      ret[count++] = b;
+
+  return ret;
+}
+
+void ownership_releases::issue(VkCommandBuffer cmdbuf, s32 family)
+{
+  u32 img_count, buf_count;
+  auto *img_releases = filter_releases(img_barriers, family, img_count);
+  auto *buf_releases = filter_releases(buf_barriers, family, buf_count);
+
+  if (gctx->is_sync2_enabled)
+  {
+    make_stages_exact(img_releases, img_count);
+    make_stages_exact(buf_releases, buf_count);
+
+    VkDependencyInfo dependency = {};
+    dependency.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+    dependency.bufferMemoryBarrierCount = buf_count;
+    dependency.pBufferMemoryBarriers = buf_releases;
+    dependency.imageMemoryBarrierCount = img_count;
+    dependency.pImageMemoryBarriers = img_releases;
+
+    vkCmdPipelineBarrier2_proc(cmdbuf, &dependency);
+  }
+  else
+  {
+    VkPipelineStageFlags src = 0, dst = 0;
+
+    auto *img = to_legacy_barriers<VkImageMemoryBarrier>(
+      img_releases, img_count, src, dst);
+    auto *buf = to_legacy_barriers<VkBufferMemoryBarrier>(
+      buf_releases, buf_count, src, dst);
+
+    if (!src)
+      src = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+
+    vkCmdPipelineBarrier(cmdbuf, src, dst, 0, 0, nullptr,
+      buf_count, buf, img_count, img);
+  }
+}
+
+}
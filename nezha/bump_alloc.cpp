@@ -1,29 +1,32 @@
 #include <nezha/bump_alloc.hpp>
 
+#include <atomic>
+
 namespace nz
 {
 
-static void *bump_start_;
-static void *bump_current_;
+static uint8_t *bump_start_;
+// Atomic so that threads recording in parallel can allocate too
+static std::atomic<uint32_t> bump_offset_;
 static uint32_t bump_max_size_;
 
 void init_bump_allocator(u32 max_size) 
 {
   bump_max_size_ = max_size;
-  bump_start_ = bump_current_ = malloc(max_size);
+  bump_start_ = (uint8_t *)malloc(max_size);
+  bump_offset_ = 0;
 }
 
 void *bump_alloc(u32 size) 
 {
-  void *p = bump_current_;
-  assert(bump_current_ < (uint8_t *)bump_start_ + bump_max_size_);
-  bump_current_ = (void *)((uint8_t *)(bump_current_) + size);
-  return p;
+  uint32_t offset = bump_offset_.fetch_add(size, std::memory_order_relaxed);
+  assert(offset < bump_max_size_);
+  return bump_start_ + offset;
 }
 
 void bump_clear() 
 {
-  bump_current_ = bump_start_;
+  bump_offset_ = 0;
 }
 
 }
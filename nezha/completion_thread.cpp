@@ -0,0 +1,156 @@
+#include <nezha/log.hpp>
+#include <nezha/gpu_context.hpp>
+#include <nezha/completion_thread.hpp>
+
+#include <algorithm>
+
+namespace nz
+{
+
+completion_thread::completion_thread()
+: wake_semaphore_(VK_NULL_HANDLE),
+  wake_value_(0),
+  quit_(false)
+{
+}
+
+completion_thread::~completion_thread()
+{
+  if (!thread_.joinable())
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+    wake_();
+  }
+
+  thread_.join();
+
+  vkDestroySemaphore(gctx->device, wake_semaphore_, nullptr);
+}
+
+void completion_thread::add(
+  VkSemaphore semaphore, u64 value, std::function<void()> proc)
+{
+  if (!thread_.joinable())
+    spawn_();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  added_.push_back({ semaphore, value, std::move(proc) });
+  wake_();
+}
+
+void completion_thread::spawn_()
+{
+  VkSemaphoreTypeCreateInfo type_info = {
+    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+    .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+    .initialValue = 0
+  };
+
+  VkSemaphoreCreateInfo semaphore_info = {
+    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+    .pNext = &type_info
+  };
+
+  VK_CHECK(vkCreateSemaphore(
+    gctx->device, &semaphore_info, nullptr, &wake_semaphore_));
+
+  thread_ = std::thread(&completion_thread::loop_, this);
+
+  log_info("Spawned completion thread");
+}
+
+void completion_thread::wake_()
+{
+  // Signaled with the lock held so that the values always go up
+  VkSemaphoreSignalInfo signal_info = {
+    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SIGNAL_INFO,
+    .semaphore = wake_semaphore_,
+    .value = ++wake_value_
+  };
+
+  vkSignalSemaphore_proc(gctx->device, &signal_info);
+}
+
+void completion_thread::loop_()
+{
+  std::vector<callback> pending;
+  std::vector<VkSemaphore> semaphores;
+  std::vector<u64> values;
+
+  for (;;)
+  {
+    u64 wake_value;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+
+      if (quit_)
+        return;
+
+      for (auto &cb : added_)
+        pending.push_back(std::move(cb));
+
+      added_.clear();
+      wake_value = wake_value_;
+    }
+
+    // Anything added from now on signals WAKE_VALUE + 1. Every semaphore only
+    // needs to be waited on with the smallest value anything waits for.
+    semaphores.assign(1, wake_semaphore_);
+    values.assign(1, wake_value + 1);
+
+    for (auto &cb : pending)
+    {
+      auto found = std::find(semaphores.begin(), semaphores.end(), cb.semaphore);
+
+      if (found == semaphores.end())
+      {
+        semaphores.push_back(cb.semaphore);
+        values.push_back(cb.value);
+      }
+      else
+      {
+        u64 &value = values[found - semaphores.begin()];
+        value = std::min(value, cb.value);
+      }
+    }
+
+    VkSemaphoreWaitInfo wait_info = {
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+      .flags = VK_SEMAPHORE_WAIT_ANY_BIT,
+      .semaphoreCount = (u32)semaphores.size(),
+      .pSemaphores = semaphores.data(),
+      .pValues = values.data()
+    };
+
+    vkWaitSemaphores_proc(gctx->device, &wait_info, UINT64_MAX);
+
+    // Read every semaphore once (the wake semaphore is never in PENDING)
+    for (u32 i = 1; i < semaphores.size(); ++i)
+      vkGetSemaphoreCounterValue_proc(gctx->device, semaphores[i], &values[i]);
+
+    for (u32 i = 0; i < pending.size();)
+    {
+      u32 s = std::find(semaphores.begin(), semaphores.end(),
+        pending[i].semaphore) - semaphores.begin();
+
+      if (values[s] >= pending[i].value)
+      {
+        pending[i].proc();
+
+        pending[i] = std::move(pending.back());
+        pending.pop_back();
+      }
+      else
+      {
+        ++i;
+      }
+    }
+  }
+}
+
+}
@@ -1,18 +1,22 @@
 #include <nezha/file.hpp>
 #include <nezha/graph.hpp>
 #include <nezha/memory.hpp>
+#include <nezha/barrier.hpp>
 #include <nezha/gpu_context.hpp>
 #include <nezha/bump_alloc.hpp>
 #include <nezha/compute_pass.hpp>
 #include <nezha/descriptor_helper.hpp>
 
+#include <algorithm>
+
 namespace nz
 {
 
 compute_pass::compute_pass(render_graph *builder, const uid_string &uid) 
   : builder_(builder), uid_(uid),
   push_constant_(nullptr),
-  push_constant_size_(0)
+  push_constant_size_(0),
+  max_workgroups_per_chunk_(0)
 {
 }
 
@@ -64,13 +68,31 @@ compute_pass &compute_pass::add_storage_image(gpu_image_ref ref, const image_inf
   return *this;
 }
 
-compute_pass &compute_pass::add_storage_buffer(gpu_buffer_ref ref) 
+compute_pass &compute_pass::add_storage_buffer(
+  gpu_buffer_ref ref, const range &rng) 
+{
+  return add_storage_buffer_(ref, rng, binding::type::storage_buffer);
+}
+
+compute_pass &compute_pass::add_storage_buffer_readonly(
+  gpu_buffer_ref ref, const range &rng) 
+{
+  return add_storage_buffer_(ref, rng, binding::type::storage_buffer_readonly);
+}
+
+compute_pass &compute_pass::add_storage_buffer_writeonly(
+  gpu_buffer_ref ref, const range &rng) 
+{
+  return add_storage_buffer_(ref, rng, binding::type::storage_buffer_writeonly);
+}
+
+compute_pass &compute_pass::add_storage_buffer_(
+  gpu_buffer_ref ref, const range &rng, binding::type type) 
 {
   uint32_t binding_id = bindings_->size();
 
-  binding b = {
-    (uint32_t)bindings_->size(), binding::type::storage_buffer, ref
-  };
+  binding b = { binding_id, type, ref };
+  b.buffer_range = rng;
 
   bindings_->push_back(b);
 
@@ -80,13 +102,15 @@ compute_pass &compute_pass::add_storage_buffer(gpu_buffer_ref ref)
   return *this;
 }
 
-compute_pass &compute_pass::add_uniform_buffer(gpu_buffer_ref ref) 
+compute_pass &compute_pass::add_uniform_buffer(
+  gpu_buffer_ref ref, const range &rng) 
 {
   uint32_t binding_id = bindings_->size();
 
   binding b = {
     (uint32_t)bindings_->size(), binding::type::uniform_buffer, ref
   };
+  b.buffer_range = rng;
 
   bindings_->push_back(b);
 
@@ -132,6 +156,12 @@ compute_pass &compute_pass::dispatch_waves(
   return *this;
 }
 
+compute_pass &compute_pass::set_max_workgroups_per_chunk(uint32_t count)
+{
+  max_workgroups_per_chunk_ = count;
+  return *this;
+}
+
 void compute_pass::reset_() 
 {
   // Should keep capacity the same to no reallocs after the first time 
@@ -191,6 +221,8 @@ void compute_pass::create_(compute_kernel_state &state)
 
     VkComputePipelineCreateInfo compute_pipeline_info = {};
     compute_pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    // Needed for the chunks of split dispatches
+    compute_pipeline_info.flags = VK_PIPELINE_CREATE_DISPATCH_BASE_BIT;
     compute_pipeline_info.stage = module_info;
     compute_pipeline_info.layout = state.layout;
 
@@ -203,22 +235,38 @@ void compute_pass::create_(compute_kernel_state &state)
   }
 }
 
-// This also needs to issue all synchronization stuff that may be needed
-void compute_pass::issue_commands_(VkCommandBuffer cmdbuf, compute_kernel_state &state)
+void compute_pass::add_barriers_(barrier_batch &barriers)
 {
   // Loop through all bindings (make sure images and buffers have proper 
-  // barriers issued for them) This is a very rough estimate - TODO: Make sure 
-  // to have exact number of image bindings
-  auto *img_barriers = bump_mem_alloc<VkImageMemoryBarrier>(bindings_->size());
-  auto *buf_barriers = bump_mem_alloc<VkBufferMemoryBarrier>(bindings_->size());
+  // barriers issued for them)
+  for (auto &b : *bindings_)
+  {
+    auto &res = builder_->get_resource_(b.rref);
 
-  u32 img_barrier_count = 0, buf_barrier_count = 0;
+    switch (res.get_type()) 
+    {
+    case graph_resource::type::graph_image: 
+    {
+      // Also updates the tracked image data
+      barriers.add_image(res.get_image(), b.get_image_layout(),
+        b.get_image_access(), VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    } break;
 
-  VkDescriptorSet *descriptor_sets = bump_mem_alloc<VkDescriptorSet>(
-    bindings_->size());
+    case graph_resource::type::graph_buffer: 
+    {
+      barriers.add_buffer(res.get_buffer(), b.get_buffer_access(),
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, b.buffer_range.offset,
+        b.buffer_range.size ? b.buffer_range.size : VK_WHOLE_SIZE);
+    } break;
 
+    default: break;
+    }
+  }
+}
+
+void compute_pass::get_descriptor_sets_(VkDescriptorSet *descriptor_sets)
+{
   int i = 0;
-  // Once all barriers have been issued, we can dispatch the pipeline!
   for (auto &b : *bindings_)
   {
     auto &res = builder_->get_resource_(b.rref);
@@ -228,30 +276,6 @@ void compute_pass::issue_commands_(VkCommandBuffer cmdbuf, compute_kernel_state
     case graph_resource::type::graph_image: 
     {
       auto &img = res.get_image();
-      VkImageMemoryBarrier barrier = 
-      {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .image = img.get_().image_,
-        .oldLayout = img.get_().current_layout_,
-        .newLayout = b.get_image_layout(),
-        .srcAccessMask = img.get_().current_access_,
-        .dstAccessMask = b.get_image_access(),
-        .subresourceRange.aspectMask = img.get_().aspect_,
-        // TODO: Support non-hardcoded values for this
-        .subresourceRange.baseArrayLayer = 0,
-        .subresourceRange.baseMipLevel = 0,
-        .subresourceRange.layerCount = 1,
-        .subresourceRange.levelCount = 1
-      };
-
-      vkCmdPipelineBarrier(cmdbuf, img.get_().last_used_,
-        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
-
-      // Update image data
-      img.get_().current_layout_ = b.get_image_layout();
-      img.get_().current_access_ = b.get_image_access();
-      img.get_().last_used_ = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
-
       descriptor_sets[i] = img.get_().get_descriptor_set_(b.utype);
       assert(descriptor_sets[i] != VK_NULL_HANDLE);
     } break;
@@ -259,23 +283,6 @@ void compute_pass::issue_commands_(VkCommandBuffer cmdbuf, compute_kernel_state
     case graph_resource::type::graph_buffer: 
     {
       auto &buf = res.get_buffer();
-      VkBufferMemoryBarrier barrier = 
-      {
-        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
-        .size = buf.size_,
-        .buffer = buf.buffer_,
-        .offset = 0,
-        .srcAccessMask = buf.current_access_,
-        .dstAccessMask = b.get_buffer_access(),
-      };
-
-      vkCmdPipelineBarrier(cmdbuf, buf.last_used_, 
-        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 
-        0, 0, nullptr, 1, &barrier, 0, nullptr);
-
-      buf.current_access_ = b.get_buffer_access();
-      buf.last_used_ = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
-
       descriptor_sets[i] = buf.get_descriptor_set_(b.utype);
       assert(descriptor_sets[i] != VK_NULL_HANDLE);
     } break;
@@ -285,15 +292,10 @@ void compute_pass::issue_commands_(VkCommandBuffer cmdbuf, compute_kernel_state
 
     ++i;
   }
+}
 
-  vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, state.pipeline);
-  vkCmdBindDescriptorSets(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, state.layout, 
-    0, bindings_->size(), descriptor_sets, 0, nullptr);
-
-  if (push_constant_size_)
-    vkCmdPushConstants(cmdbuf, state.layout, VK_SHADER_STAGE_COMPUTE_BIT, 
-      0, push_constant_size_, push_constant_);
-
+void compute_pass::get_dispatch_size_(u32 group_count[3])
+{
   u32 gx = dispatch_params_.x, gy = dispatch_params_.y, gz = dispatch_params_.z;
   if (dispatch_params_.is_waves) 
   {
@@ -305,7 +307,82 @@ void compute_pass::issue_commands_(VkCommandBuffer cmdbuf, compute_kernel_state
     gz = (uint32_t)glm::ceil((float)extent.depth / (float)gz);
   }
 
-  vkCmdDispatch(cmdbuf, gx, gy, gz);
+  group_count[0] = gx;
+  group_count[1] = gy;
+  group_count[2] = gz;
+}
+
+void compute_pass::issue_commands_(
+  VkCommandBuffer cmdbuf, compute_kernel_state &state,
+  const VkDescriptorSet *descriptor_sets, const u32 group_count[3])
+{
+  // Barriers have already been issued, we can dispatch the pipeline!
+  bind_state_(cmdbuf, state, descriptor_sets);
+
+  u64 total = (u64)group_count[0] * group_count[1] * group_count[2];
+
+  if (max_workgroups_per_chunk_ && total > max_workgroups_per_chunk_)
+    issue_dispatch_chunks_(cmdbuf, state, descriptor_sets, group_count);
+  else
+    vkCmdDispatch(cmdbuf, group_count[0], group_count[1], group_count[2]);
+}
+
+void compute_pass::bind_state_(VkCommandBuffer cmdbuf,
+  compute_kernel_state &state, const VkDescriptorSet *descriptor_sets)
+{
+  vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, state.pipeline);
+  vkCmdBindDescriptorSets(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, state.layout, 
+    0, bindings_->size(), descriptor_sets, 0, nullptr);
+
+  if (push_constant_size_)
+    vkCmdPushConstants(cmdbuf, state.layout, VK_SHADER_STAGE_COMPUTE_BIT, 
+      0, push_constant_size_, push_constant_);
+}
+
+void compute_pass::issue_dispatch_chunks_(
+  VkCommandBuffer cmdbuf, compute_kernel_state &state,
+  const VkDescriptorSet *descriptor_sets, const u32 group_count[3])
+{
+  u32 gx = group_count[0], gy = group_count[1], gz = group_count[2];
+  u32 max = max_workgroups_per_chunk_;
+
+  // The chunks write different workgroups, so they don't need barriers in
+  // between. Pipeline barriers and events still apply across the command
+  // buffers, since they go to the same queue in order.
+  bool is_first = true;
+  auto dispatch = [&] (u32 x, u32 y, u32 z, u32 count_x, u32 count_y, u32 count_z)
+  {
+    if (!is_first)
+    {
+      cmdbuf = builder_->continue_command_buffer_();
+      bind_state_(cmdbuf, state, descriptor_sets);
+    }
+
+    is_first = false;
+    vkCmdDispatchBase(cmdbuf, x, y, z, count_x, count_y, count_z);
+  };
+
+  // Chunks are made of whole slices / rows where possible
+  if ((u64)gx * gy <= max)
+  {
+    u32 slices = max / (gx * gy);
+    for (u32 z = 0; z < gz; z += slices)
+      dispatch(0, 0, z, gx, gy, std::min(slices, gz - z));
+  }
+  else if (gx <= max)
+  {
+    u32 rows = max / gx;
+    for (u32 z = 0; z < gz; ++z)
+      for (u32 y = 0; y < gy; y += rows)
+        dispatch(0, y, z, gx, std::min(rows, gy - y), 1);
+  }
+  else
+  {
+    for (u32 z = 0; z < gz; ++z)
+      for (u32 y = 0; y < gy; ++y)
+        for (u32 x = 0; x < gx; x += max)
+          dispatch(x, y, z, std::min(max, gx - x), 1, 1);
+  }
 }
 
 }
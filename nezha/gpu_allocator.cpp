@@ -0,0 +1,306 @@
+#include <nezha/log.hpp>
+#include <nezha/gpu_context.hpp>
+#include <nezha/gpu_allocator.hpp>
+
+#include <algorithm>
+
+namespace nz
+{
+
+gpu_allocator::gpu_allocator()
+: dedicated_count_(0),
+  dedicated_bytes_(0),
+  allocation_count_(0),
+  bytes_in_use_(0)
+{
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(gctx->gpu, &properties);
+  non_coherent_atom_size_ = properties.limits.nonCoherentAtomSize;
+}
+
+gpu_allocator::~gpu_allocator()
+{
+  for (auto &p : pools_)
+  {
+    for (auto &b : p.blocks)
+    {
+      if (b.memory != VK_NULL_HANDLE)
+        vkFreeMemory(gctx->device, b.memory, nullptr);
+    }
+  }
+}
+
+gpu_allocation gpu_allocator::allocate(const VkMemoryRequirements &requirements,
+  memory_usage usage, bool linear)
+{
+  const VkMemoryRequirements &reqs = requirements;
+  u32 memory_type = find_memory_type(usage, reqs);
+
+  // Smallest power of two range which is big enough and aligned
+  VkDeviceSize range_size = min_size;
+  u32 order = 0;
+  while (range_size < reqs.size || range_size < reqs.alignment)
+  {
+    range_size <<= 1;
+    ++order;
+  }
+
+  ++allocation_count_;
+  bytes_in_use_ += reqs.size;
+
+  gpu_allocation ret = {};
+  ret.size = reqs.size;
+  ret.is_coherent = (gctx->memory_properties.memoryTypes[memory_type].propertyFlags &
+    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+  if (order >= order_count)
+  {
+    // Too big for the blocks
+    ret.memory = allocate_memory_(memory_type, reqs.size, &ret.mapped);
+    ret.block = -1;
+
+    ++dedicated_count_;
+    dedicated_bytes_ += reqs.size;
+
+    return ret;
+  }
+
+  ret.pool = get_pool_(memory_type, linear);
+  ret.block = get_block_(pools_[ret.pool], order);
+  ret.order = order;
+
+  block &b = pools_[ret.pool].blocks[ret.block];
+  ret.memory = b.memory;
+  ret.offset = split_(b, order);
+  ret.mapped = (b.mapped ? b.mapped + ret.offset : nullptr);
+
+  ++b.allocation_count;
+
+  return ret;
+}
+
+void gpu_allocator::free(const gpu_allocation &allocation)
+{
+  if (allocation.memory == VK_NULL_HANDLE)
+    return;
+
+  --allocation_count_;
+  bytes_in_use_ -= allocation.size;
+
+  if (allocation.block < 0)
+  {
+    vkFreeMemory(gctx->device, allocation.memory, nullptr);
+
+    --dedicated_count_;
+    dedicated_bytes_ -= allocation.size;
+
+    return;
+  }
+
+  block &b = pools_[allocation.pool].blocks[allocation.block];
+  merge_(b, allocation.offset, allocation.order);
+
+  // Keep the first block of every pool around, since it will likely be
+  // needed again
+  if (--b.allocation_count == 0 && allocation.block > 0)
+  {
+    vkFreeMemory(gctx->device, b.memory, nullptr);
+
+    b.memory = VK_NULL_HANDLE;
+    b.mapped = nullptr;
+    b.free_ranges.clear();
+
+    log_info("Freed memory block");
+  }
+}
+
+void gpu_allocator::flush(const gpu_allocation &allocation,
+  VkDeviceSize offset, VkDeviceSize size)
+{
+  if (allocation.is_coherent || !allocation.mapped)
+    return;
+
+  VkMappedMemoryRange range = get_mapped_range_(allocation, offset, size);
+  VK_CHECK(vkFlushMappedMemoryRanges(gctx->device, 1, &range));
+}
+
+void gpu_allocator::invalidate(const gpu_allocation &allocation,
+  VkDeviceSize offset, VkDeviceSize size)
+{
+  if (allocation.is_coherent || !allocation.mapped)
+    return;
+
+  VkMappedMemoryRange range = get_mapped_range_(allocation, offset, size);
+  VK_CHECK(vkInvalidateMappedMemoryRanges(gctx->device, 1, &range));
+}
+
+gpu_memory_stats gpu_allocator::get_stats() const
+{
+  gpu_memory_stats stats = {};
+  stats.dedicated_count = dedicated_count_;
+  stats.allocation_count = allocation_count_;
+  stats.bytes_reserved = dedicated_bytes_;
+  stats.bytes_in_use = bytes_in_use_;
+
+  VkDeviceSize free_bytes = 0;
+
+  for (auto &p : pools_)
+  {
+    for (auto &b : p.blocks)
+    {
+      if (b.memory == VK_NULL_HANDLE)
+        continue;
+
+      ++stats.block_count;
+      stats.bytes_reserved += block_size;
+
+      for (u32 o = 0; o < order_count; ++o)
+      {
+        if (b.free_ranges[o].empty())
+          continue;
+
+        VkDeviceSize range_size = min_size << o;
+        free_bytes += range_size * b.free_ranges[o].size();
+        stats.largest_free_range =
+          std::max(stats.largest_free_range, range_size);
+      }
+    }
+  }
+
+  stats.fragmentation = (free_bytes ?
+    1.0f - (f32)stats.largest_free_range / (f32)free_bytes : 0.0f);
+
+  return stats;
+}
+
+u32 gpu_allocator::get_pool_(u32 memory_type, bool linear)
+{
+  for (u32 i = 0; i < pools_.size(); ++i)
+  {
+    if (pools_[i].memory_type == memory_type && pools_[i].linear == linear)
+      return i;
+  }
+
+  pools_.push_back({ memory_type, linear });
+  return pools_.size() - 1;
+}
+
+s32 gpu_allocator::get_block_(pool &p, u32 order)
+{
+  s32 empty_slot = -1;
+
+  for (u32 i = 0; i < p.blocks.size(); ++i)
+  {
+    block &b = p.blocks[i];
+
+    if (b.memory == VK_NULL_HANDLE)
+    {
+      empty_slot = i;
+      continue;
+    }
+
+    for (u32 o = order; o < order_count; ++o)
+    {
+      if (!b.free_ranges[o].empty())
+        return i;
+    }
+  }
+
+  if (empty_slot < 0)
+  {
+    empty_slot = p.blocks.size();
+    p.blocks.emplace_back();
+  }
+
+  block &b = p.blocks[empty_slot];
+  b.memory = allocate_memory_(p.memory_type, block_size, (void **)&b.mapped);
+  b.free_ranges.resize(order_count);
+  b.free_ranges[order_count - 1].insert(0);
+  b.allocation_count = 0;
+
+  log_info("Allocated memory block (type %d)", p.memory_type);
+
+  return empty_slot;
+}
+
+VkDeviceSize gpu_allocator::split_(block &b, u32 order)
+{
+  u32 o = order;
+  while (b.free_ranges[o].empty())
+    ++o;
+
+  VkDeviceSize offset = *b.free_ranges[o].begin();
+  b.free_ranges[o].erase(b.free_ranges[o].begin());
+
+  // The upper halves stay free
+  while (o > order)
+  {
+    --o;
+    b.free_ranges[o].insert(offset + (min_size << o));
+  }
+
+  return offset;
+}
+
+void gpu_allocator::merge_(block &b, VkDeviceSize offset, u32 order)
+{
+  for (; order < order_count - 1; ++order)
+  {
+    VkDeviceSize buddy = offset ^ (min_size << order);
+
+    auto found = b.free_ranges[order].find(buddy);
+    if (found == b.free_ranges[order].end())
+      break;
+
+    b.free_ranges[order].erase(found);
+    offset = std::min(offset, buddy);
+  }
+
+  b.free_ranges[order].insert(offset);
+}
+
+VkDeviceMemory gpu_allocator::allocate_memory_(
+  u32 memory_type, VkDeviceSize size, void **mapped)
+{
+  VkMemoryAllocateInfo alloc_info = {};
+  alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  alloc_info.allocationSize = size;
+  alloc_info.memoryTypeIndex = memory_type;
+
+  VkDeviceMemory memory;
+  VK_CHECK(vkAllocateMemory(gctx->device, &alloc_info, nullptr, &memory));
+
+  // Host visible memory stays mapped, since memory can't be mapped more than
+  // once at a time and several resources share the blocks
+  *mapped = nullptr;
+  if (gctx->memory_properties.memoryTypes[memory_type].propertyFlags &
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+  {
+    VK_CHECK(vkMapMemory(gctx->device, memory, 0, VK_WHOLE_SIZE, 0, mapped));
+  }
+
+  return memory;
+}
+
+VkMappedMemoryRange gpu_allocator::get_mapped_range_(
+  const gpu_allocation &allocation, VkDeviceSize offset, VkDeviceSize size)
+{
+  VkDeviceSize atom = non_coherent_atom_size_;
+  VkDeviceSize begin = allocation.offset + offset;
+  VkDeviceSize end = begin + size;
+
+  VkMappedMemoryRange range = {};
+  range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+  range.memory = allocation.memory;
+  range.offset = begin / atom * atom;
+  range.size = (end + atom - 1) / atom * atom - range.offset;
+
+  // Ranges of the blocks are aligned to at least MIN_SIZE, which is as big as
+  // an atom can get. Dedicated allocations may end in the middle of one.
+  if (allocation.block < 0 && range.offset + range.size > allocation.size)
+    range.size = VK_WHOLE_SIZE;
+
+  return range;
+}
+
+}
@@ -9,10 +9,16 @@ namespace nz
 
 gpu_buffer::gpu_buffer(render_graph *graph) 
   : builder_(graph), size_(0), host_visible_(false),
+  memory_usage_(memory_usage::gpu_only),
   buffer_(VK_NULL_HANDLE),
+  buffer_memory_{},
   usage_(VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT),
   descriptor_sets_{},
-  current_access_(0), last_used_(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT)
+  pending_event_(VK_NULL_HANDLE), pending_event_stage_(0),
+  owner_family_(-1),
+  job_stages_(0), job_writes_(false),
+  history_{},
+  transient_(false), transient_slot_(-1)
 {
   tail_node_.invalidate();
   head_node_.invalidate();
@@ -32,6 +38,8 @@ void gpu_buffer::update_action_(const binding &b)
   switch (b.utype) 
   {
   case binding::type::storage_buffer: 
+  case binding::type::storage_buffer_readonly: 
+  case binding::type::storage_buffer_writeonly: 
     usage_ |= VK_BUFFER_USAGE_STORAGE_BUFFER_BIT; break;
   case binding::type::uniform_buffer: 
     usage_ |= VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT; break;
@@ -60,6 +68,8 @@ gpu_buffer &gpu_buffer::configure(const buffer_info &info)
   switch (info.type) 
   {
   case binding::type::storage_buffer: 
+  case binding::type::storage_buffer_readonly: 
+  case binding::type::storage_buffer_writeonly: 
     usage_ |= VK_BUFFER_USAGE_STORAGE_BUFFER_BIT; break;
   case binding::type::uniform_buffer: 
     usage_ |= VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT; break;
@@ -70,11 +80,33 @@ gpu_buffer &gpu_buffer::configure(const buffer_info &info)
     size_ = info.size;
 
   host_visible_ |= info.host_visible;
+  transient_ |= info.transient;
+
+  if (info.memory != memory_usage::gpu_only)
+  {
+    memory_usage_ = info.memory;
+    host_visible_ = true;
+  }
+
+  assert(!(host_visible_ && transient_));
 
   return *this;
 }
 
 gpu_buffer &gpu_buffer::alloc() 
+{
+  create_buffer_();
+
+  memory_usage usage = memory_usage_;
+  if (host_visible_ && usage == memory_usage::gpu_only)
+    usage = memory_usage::cpu_to_gpu;
+
+  buffer_memory_ = allocate_buffer_memory(buffer_, usage);
+
+  return *this;
+}
+
+void gpu_buffer::create_buffer_()
 {
   void *pNext = nullptr;
 
@@ -98,17 +130,14 @@ gpu_buffer &gpu_buffer::alloc()
   };
 
   vkCreateBuffer(gctx->device, &buffer_create_info, nullptr, &buffer_);
-
-  u32 allocated_size = 0;
-  VkMemoryPropertyFlags mem_prop = host_visible_ ? 
-    (VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) : (VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-
-  buffer_memory_ = allocate_buffer_memory(buffer_, mem_prop);
-
-  return *this;
 }
 
 memory_mapping gpu_buffer::map()
+{
+  return memory_mapping(get_mapped_(), size_);
+}
+
+void *gpu_buffer::get_mapped_()
 {
   if (buffer_ == VK_NULL_HANDLE)
   {
@@ -118,7 +147,98 @@ memory_mapping gpu_buffer::map()
     apply_action_();
   }
 
-  return memory_mapping(buffer_memory_, size_);
+  assert(buffer_memory_.mapped);
+
+  return buffer_memory_.mapped;
+}
+
+void gpu_buffer::flush(const range &rng)
+{
+  gctx->allocator->flush(buffer_memory_, rng.offset, 
+    rng.size ? rng.size : size_ - rng.offset);
+}
+
+void gpu_buffer::invalidate(const range &rng)
+{
+  gctx->allocator->invalidate(buffer_memory_, rng.offset, 
+    rng.size ? rng.size : size_ - rng.offset);
+}
+
+std::vector<gpu_buffer::range_state> &gpu_buffer::get_range_states_()
+{
+  // Not used yet (or got reconfigured to a different size)
+  if (range_states_.empty() || range_states_.back().end != size_)
+  {
+    range_states_.clear();
+    range_states_.push_back(
+      { 0, size_, 0, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT });
+  }
+
+  return range_states_;
+}
+
+u32 gpu_buffer::split_range_states_(VkDeviceSize begin, VkDeviceSize end)
+{
+  auto &states = get_range_states_();
+
+  auto split_at = [&states] (VkDeviceSize at) -> u32
+  {
+    for (u32 i = 0; i < states.size(); ++i)
+    {
+      if (states[i].begin == at)
+        return i;
+
+      if (states[i].begin < at && at < states[i].end)
+      {
+        range_state tail = states[i];
+        tail.begin = at;
+        states[i].end = at;
+        states.insert(states.begin() + i + 1, tail);
+
+        return i + 1;
+      }
+    }
+
+    return states.size();
+  };
+
+  split_at(end);
+  return split_at(begin);
+}
+
+void gpu_buffer::merge_range_states_()
+{
+  auto &states = get_range_states_();
+
+  u32 count = 1;
+  for (u32 i = 1; i < states.size(); ++i)
+  {
+    range_state &last = states[count - 1];
+
+    if (last.access == states[i].access && last.stage == states[i].stage)
+      last.end = states[i].end;
+    else
+      states[count++] = states[i];
+  }
+
+  states.resize(count);
+}
+
+gpu_buffer::range_state gpu_buffer::get_range_state_(
+  VkDeviceSize begin, VkDeviceSize end)
+{
+  range_state ret = { begin, end, 0, 0 };
+
+  for (auto &s : get_range_states_())
+  {
+    if (s.begin < end && begin < s.end)
+    {
+      ret.access |= s.access;
+      ret.stage |= s.stage;
+    }
+  }
+
+  return ret;
 }
 
 void gpu_buffer::add_usage_node_(graph_stage_ref stg, uint32_t binding_idx) 
@@ -199,18 +319,25 @@ void gpu_buffer::create_descriptors_(VkBufferUsageFlags usage)
 
 VkDescriptorSet gpu_buffer::get_descriptor_set_(binding::type utype) 
 {
-  return descriptor_sets_[utype - binding::type::storage_buffer];
+  switch (utype)
+  {
+  // Read / write only storage buffers only differ in how they get synchronized
+  case binding::type::storage_buffer_readonly:
+  case binding::type::storage_buffer_writeonly:
+    return descriptor_sets_[0];
+
+  default:
+    return descriptor_sets_[utype - binding::type::storage_buffer];
+  }
 }
 
-memory_mapping::memory_mapping(VkDeviceMemory memory, size_t size)
-  : memory_(memory), size_(size)
+memory_mapping::memory_mapping(void *data, size_t size)
+  : data_(data), size_(size)
 {
-  vkMapMemory(gctx->device, memory, 0, size, 0, &data_);
 }
 
 memory_mapping::~memory_mapping()
 {
-  vkUnmapMemory(gctx->device, memory_);
 }
 
 void *memory_mapping::data()
@@ -8,6 +8,8 @@
 #include <nezha/gpu_context.hpp>
 
 #include <vector>
+#include <cstring>
+#include <algorithm>
 #include <vulkan/vulkan.h>
 
 #include "ml_metal.h"
@@ -71,6 +73,19 @@ static void init_instance_(const gpu_config &config)
   app_info.engineVersion = VK_MAKE_VERSION(1, 0, 0);
   app_info.apiVersion = VK_API_VERSION_1_1;
 
+  // Ask for 1.3 if the loader knows about it (synchronization2 is core there,
+  // timeline semaphores are core from 1.2)
+  u32 instance_version = VK_API_VERSION_1_0;
+  if (vkEnumerateInstanceVersion(&instance_version) == VK_SUCCESS)
+  {
+    if (instance_version >= VK_API_VERSION_1_3)
+      app_info.apiVersion = VK_API_VERSION_1_3;
+    else if (instance_version >= VK_API_VERSION_1_2)
+      app_info.apiVersion = VK_API_VERSION_1_2;
+  }
+
+  gctx->api_version = app_info.apiVersion;
+
   void *pNext = nullptr;
 
 #if defined (__APPLE__)
@@ -177,6 +192,21 @@ static void init_surface_(const gpu_config &cfg, surface_data *surf)
     gctx->instance, surf->window, nullptr, &surf->surface));
 }
 
+static bool has_device_extension_(VkPhysicalDevice gpu, const char *name)
+{
+  u32 count = 0;
+  vkEnumerateDeviceExtensionProperties(gpu, nullptr, &count, nullptr);
+
+  std::vector<VkExtensionProperties> properties(count);
+  vkEnumerateDeviceExtensionProperties(gpu, nullptr, &count, properties.data());
+
+  for (auto &p : properties)
+    if (!strcmp(p.extensionName, name))
+      return true;
+
+  return false;
+}
+
 struct queue_families 
 {
   s32 graphics, present;
@@ -290,14 +320,126 @@ static void init_device_(const gpu_config &config, surface_data *surf)
         if (gctx->present_family >= 0 && gctx->graphics_family >= 0) 
           break;
       }
+
+      // A family which can do compute but not graphics lets compute-only jobs
+      // overlap with the graphics work. Without one (e.g. software drivers),
+      // they just go to the graphics queue.
+      gctx->compute_family = gctx->graphics_family;
+      for (u32 f = 0; f < queue_family_count; ++f)
+      {
+        if ((queue_properties[f].queueFlags & VK_QUEUE_COMPUTE_BIT) &&
+            !(queue_properties[f].queueFlags & VK_QUEUE_GRAPHICS_BIT) &&
+            queue_properties[f].queueCount > 0)
+        {
+          gctx->compute_family = f;
+          break;
+        }
+      }
+
+      // Same for a family which can only do transfers (DMA engines), which
+      // lets uploads / readbacks overlap with compute
+      gctx->transfer_family = gctx->compute_family;
+      for (u32 f = 0; f < queue_family_count; ++f)
+      {
+        VkQueueFlags flags = queue_properties[f].queueFlags;
+
+        if ((flags & VK_QUEUE_TRANSFER_BIT) &&
+            !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) &&
+            queue_properties[f].queueCount > 0)
+        {
+          gctx->transfer_family = f;
+          break;
+        }
+      }
     }
   }
 
   gctx->gpu = devices[selected_physical_device];
 
+  // Doesn't change, so only needs to be queried once
+  vkGetPhysicalDeviceMemoryProperties(gctx->gpu, &gctx->memory_properties);
+
+  // Synchronization2 is core in 1.3, otherwise it needs the KHR extension.
+  // If neither is there, the graph falls back to the legacy barriers.
+  bool sync2_core = false, sync2_ext = false;
+  {
+    VkPhysicalDeviceProperties device_properties;
+    vkGetPhysicalDeviceProperties(gctx->gpu, &device_properties);
+
+    sync2_core = gctx->api_version >= VK_API_VERSION_1_3 &&
+      device_properties.apiVersion >= VK_API_VERSION_1_3;
+    sync2_ext = !sync2_core && has_device_extension_(
+      gctx->gpu, VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME);
+  }
+
+  VkPhysicalDeviceSynchronization2Features sync2_feature = 
+  {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES,
+    .pNext = nullptr
+  };
+
+  if (sync2_core || sync2_ext)
+  {
+    VkPhysicalDeviceFeatures2 features = 
+    {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+      .pNext = &sync2_feature
+    };
+
+    vkGetPhysicalDeviceFeatures2(gctx->gpu, &features);
+  }
+
+  gctx->is_sync2_enabled = sync2_feature.synchronization2;
+
+  if (gctx->is_sync2_enabled && sync2_ext)
+    extensions.push_back(VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME);
+
+  // Submissions are tracked with timeline semaphores (core in 1.2, otherwise
+  // they need the KHR extension). There is no fallback for these.
+  bool timeline_core = false, timeline_ext = false;
+  {
+    VkPhysicalDeviceProperties device_properties;
+    vkGetPhysicalDeviceProperties(gctx->gpu, &device_properties);
+
+    timeline_core = gctx->api_version >= VK_API_VERSION_1_2 &&
+      device_properties.apiVersion >= VK_API_VERSION_1_2;
+    timeline_ext = !timeline_core && has_device_extension_(
+      gctx->gpu, VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+  }
+
+  VkPhysicalDeviceTimelineSemaphoreFeatures timeline_feature = 
+  {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+    .pNext = nullptr
+  };
+
+  if (timeline_core || timeline_ext)
+  {
+    VkPhysicalDeviceFeatures2 features = 
+    {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+      .pNext = &timeline_feature
+    };
+
+    vkGetPhysicalDeviceFeatures2(gctx->gpu, &features);
+  }
+
+  if (!timeline_feature.timelineSemaphore)
+  {
+    log_error("Device doesn't support timeline semaphores\n");
+    panic_and_exit();
+  }
+
+  if (timeline_ext)
+    extensions.push_back(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+
+  timeline_feature.pNext = gctx->is_sync2_enabled ? &sync2_feature : nullptr;
+
   u32 unique_queue_family_finder = 0;
   unique_queue_family_finder |= 1 << gctx->graphics_family;
   unique_queue_family_finder |= 1 << gctx->present_family;
+  unique_queue_family_finder |= 1 << gctx->compute_family;
+  unique_queue_family_finder |= 1 << gctx->transfer_family;
   u32 unique_queue_family_count = pop_count(unique_queue_family_finder);
 
   std::vector<u32> unique_family_indices;
@@ -313,17 +455,29 @@ static void init_device_(const gpu_config &config, surface_data *surf)
     }
   }
 
-  f32 priority1 = 1.0f;
+  u32 queue_family_count = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(
+    gctx->gpu, &queue_family_count, nullptr);
+  std::vector<VkQueueFamilyProperties> queue_properties;
+  queue_properties.resize(queue_family_count);
+  vkGetPhysicalDeviceQueueFamilyProperties(
+    gctx->gpu, &queue_family_count, queue_properties.data());
+
+  // Families get a second, low priority queue for batch jobs if they have one
+  // to spare (see LATENCY_CLASS)
+  f32 priorities[] = { 1.0f, 0.25f };
   unique_family_infos.resize(unique_queue_family_count);
   for (u32 i = 0; i < unique_queue_family_count; ++i) 
   {
+    u32 family = unique_family_indices[i];
+
     VkDeviceQueueCreateInfo queue_info = {};
     queue_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
     queue_info.pNext = NULL;
     queue_info.flags = 0;
-    queue_info.queueFamilyIndex = unique_family_indices[i];
-    queue_info.queueCount = 1;
-    queue_info.pQueuePriorities = &priority1;
+    queue_info.queueFamilyIndex = family;
+    queue_info.queueCount = std::min(queue_properties[family].queueCount, 2u);
+    queue_info.pQueuePriorities = priorities;
 
     unique_family_infos[i] = queue_info;
   }
@@ -343,7 +497,7 @@ static void init_device_(const gpu_config &config, surface_data *surf)
   {
     .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES,
     .dynamicRendering = VK_TRUE,
-    .pNext = nullptr
+    .pNext = &timeline_feature
   };
 
   VkDeviceCreateInfo device_info = {};
@@ -366,6 +520,32 @@ static void init_device_(const gpu_config &config, surface_data *surf)
     gctx->device, gctx->graphics_family, 0, &gctx->graphics_queue);
   vkGetDeviceQueue(
     gctx->device, gctx->present_family, 0, &gctx->present_queue);
+  vkGetDeviceQueue(
+    gctx->device, gctx->compute_family, 0, &gctx->compute_queue);
+
+  vkGetDeviceQueue(
+    gctx->device, gctx->transfer_family, 0, &gctx->transfer_queue);
+
+  // Batch queues alias the normal ones if the family only has one queue
+  auto get_batch_queue = [&queue_properties] (s32 family) {
+    VkQueue queue;
+    vkGetDeviceQueue(gctx->device, family,
+      queue_properties[family].queueCount > 1 ? 1 : 0, &queue);
+    return queue;
+  };
+
+  gctx->graphics_batch_queue = get_batch_queue(gctx->graphics_family);
+  gctx->compute_batch_queue = get_batch_queue(gctx->compute_family);
+  gctx->transfer_batch_queue = get_batch_queue(gctx->transfer_family);
+
+  if (queue_properties[gctx->graphics_family].queueCount > 1)
+    log_info("Using a separate low priority queue for batch jobs");
+
+  if (gctx->compute_family != gctx->graphics_family)
+    log_info("Using queue family %d for async compute", gctx->compute_family);
+
+  if (gctx->transfer_family != gctx->compute_family)
+    log_info("Using queue family %d for transfers", gctx->transfer_family);
 
   vkDebugMarkerSetObjectTag = (PFN_vkDebugMarkerSetObjectTagEXT)
     vkGetDeviceProcAddr(gctx->device, "vkDebugMarkerSetObjectTagEXT");
@@ -382,6 +562,28 @@ static void init_device_(const gpu_config &config, surface_data *surf)
   vkCmdEndRenderingKHR_proc = (PFN_vkCmdEndRenderingKHR)
     (vkGetDeviceProcAddr(gctx->device, "vkCmdEndRenderingKHR"));
 
+  if (gctx->is_sync2_enabled)
+  {
+    vkCmdPipelineBarrier2_proc = (PFN_vkCmdPipelineBarrier2KHR)
+      (vkGetDeviceProcAddr(gctx->device, sync2_core ?
+        "vkCmdPipelineBarrier2" : "vkCmdPipelineBarrier2KHR"));
+    vkQueueSubmit2_proc = (PFN_vkQueueSubmit2KHR)
+      (vkGetDeviceProcAddr(gctx->device, sync2_core ?
+        "vkQueueSubmit2" : "vkQueueSubmit2KHR"));
+
+    log_info("Using synchronization2");
+  }
+
+  vkWaitSemaphores_proc = (PFN_vkWaitSemaphoresKHR)
+    (vkGetDeviceProcAddr(gctx->device, timeline_core ?
+      "vkWaitSemaphores" : "vkWaitSemaphoresKHR"));
+  vkGetSemaphoreCounterValue_proc = (PFN_vkGetSemaphoreCounterValueKHR)
+    (vkGetDeviceProcAddr(gctx->device, timeline_core ?
+      "vkGetSemaphoreCounterValue" : "vkGetSemaphoreCounterValueKHR"));
+  vkSignalSemaphore_proc = (PFN_vkSignalSemaphoreKHR)
+    (vkGetDeviceProcAddr(gctx->device, timeline_core ?
+      "vkSignalSemaphore" : "vkSignalSemaphoreKHR"));
+
   // Find depth format
   VkFormat formats[] =
   {
@@ -511,6 +713,30 @@ void init_command_pool_()
   command_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
   VK_CHECK(vkCreateCommandPool(
     gctx->device, &command_pool_info, nullptr, &gctx->command_pool));
+
+  if (gctx->compute_family != gctx->graphics_family)
+  {
+    command_pool_info.queueFamilyIndex = gctx->compute_family;
+    VK_CHECK(vkCreateCommandPool(
+      gctx->device, &command_pool_info, nullptr, 
+      &gctx->compute_command_pool));
+  }
+  else
+  {
+    gctx->compute_command_pool = gctx->command_pool;
+  }
+
+  if (gctx->transfer_family != gctx->compute_family)
+  {
+    command_pool_info.queueFamilyIndex = gctx->transfer_family;
+    VK_CHECK(vkCreateCommandPool(
+      gctx->device, &command_pool_info, nullptr, 
+      &gctx->transfer_command_pool));
+  }
+  else
+  {
+    gctx->transfer_command_pool = gctx->compute_command_pool;
+  }
 }
 
 void init_descriptor_pool_() 
@@ -579,6 +805,8 @@ surface init_gpu_context(const gpu_config &config)
     init_surface_(config, &surf);
   init_device_(config, &surf);
 
+  gctx->allocator = mem_alloc<gpu_allocator>();
+
   if (config.create_surface)
     init_swapchain_(&surf);
 
@@ -599,6 +827,51 @@ VkDescriptorSetLayout get_descriptor_set_layout(
   return gctx->layout_categories[(int)type].get_descriptor_set_layout(count);
 }
 
+queue_type get_queue_type(s32 family)
+{
+  if (family == gctx->graphics_family)
+    return queue_graphics;
+  else if (family == gctx->compute_family)
+    return queue_compute;
+  else
+    return queue_transfer;
+}
+
+s32 get_queue_family(queue_type type)
+{
+  switch (type)
+  {
+  case queue_compute: case queue_compute_batch: return gctx->compute_family;
+  case queue_transfer: case queue_transfer_batch: return gctx->transfer_family;
+  default: return gctx->graphics_family;
+  }
+}
+
+VkQueue get_queue(queue_type type)
+{
+  switch (type)
+  {
+  case queue_compute: return gctx->compute_queue;
+  case queue_transfer: return gctx->transfer_queue;
+  case queue_graphics_batch: return gctx->graphics_batch_queue;
+  case queue_compute_batch: return gctx->compute_batch_queue;
+  case queue_transfer_batch: return gctx->transfer_batch_queue;
+  default: return gctx->graphics_queue;
+  }
+}
+
+VkCommandPool get_command_pool(queue_type type)
+{
+  switch (type)
+  {
+  case queue_compute: case queue_compute_batch:
+    return gctx->compute_command_pool;
+  case queue_transfer: case queue_transfer_batch:
+    return gctx->transfer_command_pool;
+  default: return gctx->command_pool;
+  }
+}
+
 VkAccessFlags find_access_flags_for_stage(VkPipelineStageFlags stage) 
 {
   switch (stage) 
@@ -672,8 +945,7 @@ VkAccessFlags find_access_flags_for_layout(VkImageLayout layout)
 u32 find_memory_type(
   VkMemoryPropertyFlags properties, VkMemoryRequirements &memory_requirements) 
 {
-  VkPhysicalDeviceMemoryProperties mem_properties;
-  vkGetPhysicalDeviceMemoryProperties(gctx->gpu, &mem_properties);
+  VkPhysicalDeviceMemoryProperties &mem_properties = gctx->memory_properties;
 
   for (uint32_t i = 0; i < mem_properties.memoryTypeCount; ++i) 
   {
@@ -689,45 +961,120 @@ u32 find_memory_type(
   return 0;
 }
 
-VkDeviceMemory allocate_buffer_memory(
-  VkBuffer buffer, VkMemoryPropertyFlags properties) 
+static s32 score_memory_type(memory_usage usage, VkMemoryPropertyFlags flags)
+{
+  auto has = [flags] (VkMemoryPropertyFlags flag) { return (flags & flag) ? 1 : 0; };
+
+  // Never wanted for regular resources
+  s32 score = -8 * has(VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT |
+    VK_MEMORY_PROPERTY_PROTECTED_BIT);
+
+  switch (usage)
+  {
+  case memory_usage::gpu_only:
+    score += 4 * has(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) -
+      2 * has(VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+    break;
+
+  // Staying away from device local memory leaves the BAR to the data which
+  // needs it
+  case memory_usage::cpu_to_gpu:
+    score += 2 * has(VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) -
+      2 * has(VK_MEMORY_PROPERTY_HOST_CACHED_BIT) -
+      has(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    break;
+
+  case memory_usage::gpu_to_cpu:
+    score += 4 * has(VK_MEMORY_PROPERTY_HOST_CACHED_BIT) +
+      2 * has(VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) -
+      has(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    break;
+
+  case memory_usage::gpu_and_cpu_bar:
+    score += 4 * has(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) +
+      2 * has(VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    break;
+  }
+
+  return score;
+}
+
+u32 find_memory_type(
+  memory_usage usage, const VkMemoryRequirements &memory_requirements)
+{
+  VkPhysicalDeviceMemoryProperties &mem_properties = gctx->memory_properties;
+
+  VkMemoryPropertyFlags required = (usage == memory_usage::gpu_only ?
+    0 : VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+
+  s32 best = -1, best_score = 0;
+
+  for (u32 i = 0; i < mem_properties.memoryTypeCount; ++i) 
+  {
+    VkMemoryPropertyFlags flags = mem_properties.memoryTypes[i].propertyFlags;
+
+    if (!(memory_requirements.memoryTypeBits & (1 << i)) ||
+        (flags & required) != required)
+      continue;
+
+    s32 score = score_memory_type(usage, flags);
+    if (best < 0 || score > best_score)
+    {
+      best = i;
+      best_score = score;
+    }
+  }
+
+  if (best < 0)
+  {
+    log_error("Unable to find memory type!");
+    panic_and_exit();
+  }
+
+  return best;
+}
+
+gpu_allocation allocate_buffer_memory(
+  VkBuffer buffer, memory_usage usage) 
 {
   VkMemoryRequirements requirements = {};
   vkGetBufferMemoryRequirements(gctx->device, buffer, &requirements);
 
-  VkMemoryAllocateInfo alloc_info = {};
-  alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  alloc_info.allocationSize = requirements.size;
-  alloc_info.memoryTypeIndex = find_memory_type(properties, requirements);
+  gpu_allocation allocation = gctx->allocator->allocate(
+    requirements, usage, true);
 
-  VkDeviceMemory memory;
-  vkAllocateMemory(gctx->device, &alloc_info, nullptr, &memory);
+  vkBindBufferMemory(
+    gctx->device, buffer, allocation.memory, allocation.offset);
 
-  vkBindBufferMemory(gctx->device, buffer, memory, 0);
-
-  return memory;
+  return allocation;
 }
 
-VkDeviceMemory allocate_image_memory(
-  VkImage image, VkMemoryPropertyFlags properties, u32 *size) 
+gpu_allocation allocate_image_memory(
+  VkImage image, memory_usage usage, u32 *size) 
 {
   VkMemoryRequirements requirements = {};
   vkGetImageMemoryRequirements(gctx->device, image, &requirements);
 
-  VkMemoryAllocateInfo alloc_info = {};
-  alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  alloc_info.allocationSize = requirements.size;
-  alloc_info.memoryTypeIndex = find_memory_type(properties, requirements);
-
-  VkDeviceMemory memory;
-  vkAllocateMemory(gctx->device, &alloc_info, nullptr, &memory);
+  gpu_allocation allocation = gctx->allocator->allocate(
+    requirements, usage, false);
 
-  vkBindImageMemory(gctx->device, image, memory, 0);
+  vkBindImageMemory(
+    gctx->device, image, allocation.memory, allocation.offset);
 
   if (size)
     *size = requirements.size;
 
-  return memory;
+  return allocation;
+}
+
+void free_memory(const gpu_allocation &allocation)
+{
+  gctx->allocator->free(allocation);
+}
+
+gpu_memory_stats get_memory_stats()
+{
+  return gctx->allocator->get_stats();
 }
 
 // Debug marker functions
@@ -738,5 +1085,10 @@ PFN_vkCmdDebugMarkerEndEXT vkCmdDebugMarkerEnd;
 PFN_vkCmdDebugMarkerInsertEXT vkCmdDebugMarkerInsert;
 PFN_vkCmdBeginRenderingKHR vkCmdBeginRenderingKHR_proc;
 PFN_vkCmdEndRenderingKHR vkCmdEndRenderingKHR_proc;
+PFN_vkCmdPipelineBarrier2KHR vkCmdPipelineBarrier2_proc;
+PFN_vkQueueSubmit2KHR vkQueueSubmit2_proc;
+PFN_vkWaitSemaphoresKHR vkWaitSemaphores_proc;
+PFN_vkGetSemaphoreCounterValueKHR vkGetSemaphoreCounterValue_proc;
+PFN_vkSignalSemaphoreKHR vkSignalSemaphore_proc;
 
 }
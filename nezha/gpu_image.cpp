@@ -10,10 +10,16 @@ gpu_image::gpu_image()
   tail_node_{ invalid_graph_ref, invalid_graph_ref },
   image_(VK_NULL_HANDLE),
   image_view_(VK_NULL_HANDLE),
-  image_memory_(VK_NULL_HANDLE),
+  image_memory_{},
   current_layout_(VK_IMAGE_LAYOUT_UNDEFINED),
   current_access_(0),
   last_used_(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT),
+  pending_event_(VK_NULL_HANDLE),
+  pending_event_stage_(0),
+  owner_family_(-1),
+  job_stages_(0), job_writes_(false),
+  history_{},
+  transient_(false), transient_slot_(-1),
   usage_(VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT),
   descriptor_sets_{} 
 {
@@ -25,10 +31,16 @@ gpu_image::gpu_image(render_graph *builder)
   builder_(builder),
   image_(VK_NULL_HANDLE),
   image_view_(VK_NULL_HANDLE),
-  image_memory_(VK_NULL_HANDLE),
+  image_memory_{},
   current_layout_(VK_IMAGE_LAYOUT_UNDEFINED),
   current_access_(0),
   last_used_(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT),
+  pending_event_(VK_NULL_HANDLE),
+  pending_event_stage_(0),
+  owner_family_(-1),
+  job_stages_(0), job_writes_(false),
+  history_{},
+  transient_(false), transient_slot_(-1),
   usage_(VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT),
   descriptor_sets_{} 
 {
@@ -175,6 +187,7 @@ gpu_image &gpu_image::configure(const image_info &info)
   if (image_ == VK_NULL_HANDLE)
   {
     extent_ = info.extent;
+    transient_ = info.transient;
 
     aspect_ = info.is_depth ?
       VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT;
@@ -202,6 +215,19 @@ gpu_image &gpu_image::configure(const image_info &info)
 }
 
 gpu_image &gpu_image::alloc() 
+{
+  create_image_();
+
+  u32 allocated_size = 0;
+  image_memory_ = allocate_image_memory(
+    image_, memory_usage::gpu_only, &allocated_size);
+
+  create_view_();
+
+  return *this;
+}
+
+void gpu_image::create_image_()
 {
   VkImageCreateInfo image_create_info = 
   {
@@ -220,11 +246,10 @@ gpu_image &gpu_image::alloc()
   };
 
   vkCreateImage(gctx->device, &image_create_info, nullptr, &image_);
+}
 
-  u32 allocated_size = 0;
-  image_memory_ = allocate_image_memory(
-    image_, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &allocated_size);
-
+void gpu_image::create_view_()
+{
   VkImageViewCreateInfo view_create_info = 
   {
     .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
@@ -240,8 +265,6 @@ gpu_image &gpu_image::alloc()
   };
 
   vkCreateImageView(gctx->device, &view_create_info, nullptr, &image_view_);
-
-  return *this;
 }
 
 }
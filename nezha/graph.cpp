@@ -1,17 +1,56 @@
 #include <nezha/log.hpp>
 #include <nezha/graph.hpp>
+#include <nezha/barrier.hpp>
 #include <nezha/bump_alloc.hpp>
 #include <nezha/gpu_context.hpp>
 
+#include <atomic>
+#include <cstring>
+#include <algorithm>
 #include <filesystem>
 
 namespace nz
 {
   
 render_graph::render_graph() 
-: resources_(max_resources)
+: resources_(max_resources),
+  barrier_stats_{},
+  compile_mode_(graph_compile_mode::in_order),
+  is_async_compute_enabled_(true),
+  is_async_transfer_enabled_(true),
+  current_queue_family_(-1),
+  ownership_family_(-1),
+  is_submission_deferred_(false),
+  deferred_count_(0),
+  current_staging_block_(-1),
+  next_record_id_(0),
+  plan_cache_stats_{}
 {
   nz::init_bump_allocator(nz::megabytes(10));
+
+  workers_.set_thread_count(
+    std::min(std::thread::hardware_concurrency(), 8u));
+
+  for (u32 q = 0; q < queue_type_count; ++q)
+  {
+    VkSemaphoreTypeCreateInfo type_info = {
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+      .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+      .initialValue = 0
+    };
+
+    VkSemaphoreCreateInfo semaphore_info = {
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+      .pNext = &type_info
+    };
+
+    VK_CHECK(vkCreateSemaphore(
+      gctx->device, &semaphore_info, nullptr, &timelines_[q]));
+
+    timeline_values_[q] = 0;
+    completed_values_[q] = 0;
+    flushed_values_[q] = 0;
+  }
 }
 
 gpu_buffer_ref render_graph::register_buffer(const buffer_info &cfg) 
@@ -19,7 +58,7 @@ gpu_buffer_ref render_graph::register_buffer(const buffer_info &cfg)
   gpu_buffer_ref ref = resources_.add();
   graph_resource &res = resources_[ref];
 
-  new (&res) graph_resource(gpu_buffer(this));
+  res = graph_resource(gpu_buffer(this));
 
   res.get_buffer().configure(cfg);
 
@@ -31,7 +70,7 @@ gpu_image_ref render_graph::register_image(const image_info &cfg)
   gpu_image_ref ref = resources_.add();
   graph_resource &res = resources_[ref];
 
-  new (&res) graph_resource(gpu_image(this));
+  res = graph_resource(gpu_image(this));
 
   res.get_image().configure(cfg);
 
@@ -45,7 +84,7 @@ void render_graph::register_swapchain(const surface &surf, gpu_image_ref *dst)
     gpu_image_ref ref = resources_.add();
     graph_resource &res = resources_[ref];
 
-    new (&res) graph_resource(gpu_image(this));
+    res = graph_resource(gpu_image(this));
 
     res.get_image().configure({
       .format = surf.swapchain_format_,
@@ -86,7 +125,7 @@ compute_pass &render_graph::add_compute_pass()
 }
 
 void render_graph::add_buffer_update(
-  gpu_buffer_ref ref, void *data, u32 offset, u32 size) 
+  gpu_buffer_ref ref, const void *data, u32 offset, u32 size) 
 {
   recorded_stages_.emplace_back(transfer_operation(this, recorded_stages_.size()));
   auto &transfer = recorded_stages_.back();
@@ -133,6 +172,8 @@ void render_graph::begin()
   // Clear the bump allocator
   bump_clear();
 
+  barrier_stats_ = {};
+
   // Looping through resource IDs (ID of resources that were used in the frame)
   for (auto &r : used_resources_) 
   {
@@ -146,6 +187,7 @@ void render_graph::begin()
         { invalid_graph_ref, invalid_graph_ref };
       resources_[r].get_image().tail_node_ =
         { invalid_graph_ref, invalid_graph_ref };
+      resources_[r].get_image().pending_event_ = VK_NULL_HANDLE;
     } break;
 
     case graph_resource::type::graph_buffer: 
@@ -154,6 +196,7 @@ void render_graph::begin()
         { invalid_graph_ref, invalid_graph_ref };
       resources_[r].get_buffer().tail_node_ =
         { invalid_graph_ref, invalid_graph_ref };
+      resources_[r].get_buffer().pending_event_ = VK_NULL_HANDLE;
     } break;
 
     default: break;
@@ -367,9 +410,21 @@ void render_graph::prepare_transfer_graph_stage_(transfer_operation &op)
   }
 }
 
+void render_graph::prepare_step_(
+  const compiled_plan &plan, u32 step, VkCommandBuffer cmdbuf)
+{
+  for (u32 i = plan.step_offsets[step]; i < plan.step_offsets[step + 1]; ++i)
+  {
+    graph_pass &stg = recorded_stages_[plan.order[i]];
+
+    if (stg.get_type() == graph_pass::graph_render_pass)
+      stg.get_render_pass().prepare_commands_(cmdbuf);
+  }
+}
+
 void render_graph::execute_pass_graph_stage_(
   graph_stage_ref stg, VkPipelineStageFlags &last_stage,
-  const cmdbuf_info &info) 
+  const cmdbuf_info &info, compiled_plan &plan) 
 {
   // Handle compute / render passes
   switch (recorded_stages_[stg].get_type()) 
@@ -380,25 +435,15 @@ void render_graph::execute_pass_graph_stage_(
 
     compute_pass &cp = recorded_stages_[stg].get_compute_pass();
 
-    compute_kernel_state &cp_state = kernels_[cp.kernel_];
+    prepare_kernel_(cp);
 
-    if (cp_state.src == nullptr)
-    {
-      if (cp_state.kernel == nullptr)
-      {
-        // Create the ML kernel
-        cp.create_(cp_state);
-      }
-    }
-    else if (cp_state.pipeline == VK_NULL_HANDLE)
-    {
-      // Actually initialize the compute pipeline/layout
-      // which is stored in the compute_kernel_state of the render graph
-      cp.create_(cp_state);
-    }
+    compute_kernel_state &cp_state = kernels_[cp.kernel_];
 
     // Issue the commands
-    cp.issue_commands_(info.cmdbuf, cp_state);
+    compiled_plan::stage_info &stg_info = plan.stages[stg];
+    cp.issue_commands_(info.cmdbuf, cp_state,
+      plan.descriptor_sets.data() + stg_info.descriptor_offset,
+      stg_info.group_count);
   } break;
 
   case graph_pass::graph_render_pass: 
@@ -422,37 +467,62 @@ void render_graph::execute_pass_graph_stage_(
   }
 }
 
-void render_graph::execute_transfer_graph_stage_(
-  transfer_operation &op, const cmdbuf_info &info) 
+void render_graph::prepare_kernel_(compute_pass &cp)
 {
-  switch (op.type_) 
+  compute_kernel_state &cp_state = kernels_[cp.kernel_];
+
+  if (cp_state.src == nullptr)
   {
-  case transfer_operation::type::buffer_update: 
+    if (cp_state.kernel == nullptr)
+    {
+      // Create the ML kernel
+      cp.create_(cp_state);
+    }
+  }
+  else if (cp_state.pipeline == VK_NULL_HANDLE)
   {
-    binding &b = (*op.bindings_)[0];
-    gpu_buffer &buf = get_buffer_(b.rref);
+    // Actually initialize the compute pipeline/layout
+    // which is stored in the compute_kernel_state of the render graph
+    cp.create_(cp_state);
+  }
+}
 
-    VkBufferMemoryBarrier barrier = 
-    {
-      .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
-      .buffer = buf.buffer_,
-      .srcAccessMask = buf.current_access_,
-      .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-      .offset = op.buffer_update_state_.offset,
-      .size = op.buffer_update_state_.size,
-    };
+void render_graph::add_stage_barriers_(
+  graph_stage_ref stg, barrier_batch &barriers)
+{
+  switch (recorded_stages_[stg].get_type()) 
+  {
+  case graph_pass::graph_compute_pass: 
+    recorded_stages_[stg].get_compute_pass().add_barriers_(barriers);
+    break;
 
-    assert(buf.buffer_ != VK_NULL_HANDLE);
+  case graph_pass::graph_render_pass: 
+    recorded_stages_[stg].get_render_pass().add_barriers_(barriers);
+    break;
+
+  case graph_pass::graph_transfer_pass:
+    add_transfer_barriers_(
+      recorded_stages_[stg].get_transfer_operation(), barriers);
+    break;
+
+  default: break;
+  }
+}
 
-    vkCmdPipelineBarrier(info.cmdbuf, buf.last_used_,
-      VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+void render_graph::add_transfer_barriers_(
+  transfer_operation &op, barrier_batch &barriers)
+{
+  switch (op.type_) 
+  {
+  case transfer_operation::type::buffer_update: 
+  {
+    gpu_buffer &buf = get_buffer_((*op.bindings_)[0].rref);
 
-    vkCmdUpdateBuffer(
-      info.cmdbuf, buf.buffer_, op.buffer_update_state_.offset, 
-      op.buffer_update_state_.size, op.buffer_update_state_.data);
+    assert(buf.buffer_ != VK_NULL_HANDLE);
 
-    buf.last_used_ = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    buf.current_access_ = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barriers.add_buffer(buf, VK_ACCESS_TRANSFER_WRITE_BIT,
+      VK_PIPELINE_STAGE_TRANSFER_BIT,
+      op.buffer_update_state_.offset, op.buffer_update_state_.size);
   } break;
 
   case transfer_operation::type::buffer_copy_to_cpu:
@@ -460,34 +530,99 @@ void render_graph::execute_transfer_graph_stage_(
     uint32_t dst_base = op.buffer_copy_to_cpu_.dst_offset;
     range src_rng = op.buffer_copy_to_cpu_.src_range;
 
-    binding &dst_binding = (*op.bindings_)[0];
-    binding &src_binding = (*op.bindings_)[1];
+    gpu_buffer &dst = get_buffer_((*op.bindings_)[0].rref);
+    gpu_buffer &src = get_buffer_((*op.bindings_)[1].rref);
 
-    gpu_buffer &dst = get_buffer_(dst_binding.rref);
-    gpu_buffer &src = get_buffer_(src_binding.rref);
+    barriers.add_buffer(dst, VK_ACCESS_TRANSFER_WRITE_BIT,
+      VK_PIPELINE_STAGE_TRANSFER_BIT, dst_base, src_rng.size);
+    barriers.add_buffer(src, VK_ACCESS_TRANSFER_READ_BIT,
+      VK_PIPELINE_STAGE_TRANSFER_BIT, src_rng.offset, src_rng.size);
+  } break;
 
-    VkBufferMemoryBarrier dst_barrier =
-    {
-      .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
-      .buffer = dst.buffer_,
-      .srcAccessMask = dst.current_access_,
-      .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-      .offset = dst_base,
-      .size = src_rng.size
+  case transfer_operation::type::buffer_copy:
+  {
+    uint32_t dst_base = op.buffer_copy_state_.dst_offset;
+    range src_rng = op.buffer_copy_state_.src_range;
+
+    gpu_buffer &dst = get_buffer_((*op.bindings_)[0].rref);
+    gpu_buffer &src = get_buffer_((*op.bindings_)[1].rref);
+
+    barriers.add_buffer(dst, VK_ACCESS_TRANSFER_WRITE_BIT,
+      VK_PIPELINE_STAGE_TRANSFER_BIT, dst_base, src_rng.size);
+    barriers.add_buffer(src, VK_ACCESS_TRANSFER_READ_BIT,
+      VK_PIPELINE_STAGE_TRANSFER_BIT, src_rng.offset, src_rng.size);
+  } break;
+
+  case transfer_operation::type::image_blit: 
+  {
+    gpu_image &src = get_image_((*op.bindings_)[0].rref);
+    gpu_image &dst = get_image_((*op.bindings_)[1].rref);
+
+    // Transition layouts
+    barriers.add_image(src, (*op.bindings_)[0].get_image_layout(),
+      (*op.bindings_)[0].get_image_access(), VK_PIPELINE_STAGE_TRANSFER_BIT);
+    barriers.add_image(dst, (*op.bindings_)[1].get_image_layout(),
+      (*op.bindings_)[1].get_image_access(), VK_PIPELINE_STAGE_TRANSFER_BIT);
+  } break;
+
+  case transfer_operation::type::present_ready:
+  {
+    gpu_image &img = get_image_((*op.bindings_)[0].rref);
+
+    // Handle present stage - transition image layout
+    barriers.add_image(img, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, 0,
+      VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+  } break;
+
+  default: break;
+  }
+}
+
+VkCommandBuffer render_graph::continue_command_buffer_()
+{
+  vkEndCommandBuffer(current_cmdbuf_);
+
+  current_cmdbuf_ = get_command_buffer_(current_queue_family_);
+  recorded_continuations_.push_back(current_cmdbuf_);
+
+  VkCommandBufferBeginInfo begin_info = 
+  {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    .flags = current_usage_flags_
+  };
+
+  vkBeginCommandBuffer(current_cmdbuf_, &begin_info);
+
+  return current_cmdbuf_;
+}
+
+void render_graph::execute_transfer_graph_stage_(
+  transfer_operation &op, const cmdbuf_info &info) 
+{
+  switch (op.type_) 
+  {
+  case transfer_operation::type::buffer_update: 
+  {
+    gpu_buffer &buf = get_buffer_((*op.bindings_)[0].rref);
+    staging_block &staging =
+      staging_blocks_[op.buffer_update_state_.staging_block];
+
+    VkBufferCopy region = {
+      .size = op.buffer_update_state_.size,
+      .srcOffset = op.buffer_update_state_.staging_offset,
+      .dstOffset = op.buffer_update_state_.offset
     };
 
-    vkCmdPipelineBarrier(info.cmdbuf, dst.last_used_,
-      VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1, &dst_barrier, 0, nullptr);
+    vkCmdCopyBuffer(info.cmdbuf, staging.buffer, buf.buffer_, 1, &region);
+  } break;
 
-    auto src_barrier = dst_barrier;
-    src_barrier.buffer = src.buffer_;
-    src_barrier.srcAccessMask = src.current_access_;
-    src_barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-    src_barrier.offset = src_rng.offset;
-    src_barrier.size = src_rng.size;
+  case transfer_operation::type::buffer_copy_to_cpu:
+  {
+    uint32_t dst_base = op.buffer_copy_to_cpu_.dst_offset;
+    range src_rng = op.buffer_copy_to_cpu_.src_range;
 
-    vkCmdPipelineBarrier(info.cmdbuf, src.last_used_,
-      VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1, &src_barrier, 0, nullptr);
+    gpu_buffer &dst = get_buffer_((*op.bindings_)[0].rref);
+    gpu_buffer &src = get_buffer_((*op.bindings_)[1].rref);
 
     VkBufferCopy region = {
       .size = src_rng.size,
@@ -496,12 +631,6 @@ void render_graph::execute_transfer_graph_stage_(
     };
 
     vkCmdCopyBuffer(info.cmdbuf, src.buffer_, dst.buffer_, 1, &region);
-
-    dst.last_used_ = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    dst.current_access_ = VK_ACCESS_TRANSFER_WRITE_BIT;
-
-    src.last_used_ = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    src.current_access_ = VK_ACCESS_TRANSFER_READ_BIT;
   } break;
 
   case transfer_operation::type::buffer_copy:
@@ -509,34 +638,8 @@ void render_graph::execute_transfer_graph_stage_(
     uint32_t dst_base = op.buffer_copy_state_.dst_offset;
     range src_rng = op.buffer_copy_state_.src_range;
 
-    binding &dst_binding = (*op.bindings_)[0];
-    binding &src_binding = (*op.bindings_)[1];
-
-    gpu_buffer &dst = get_buffer_(dst_binding.rref);
-    gpu_buffer &src = get_buffer_(src_binding.rref);
-
-    VkBufferMemoryBarrier dst_barrier =
-    {
-      .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
-      .buffer = dst.buffer_,
-      .srcAccessMask = dst.current_access_,
-      .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-      .offset = dst_base,
-      .size = src_rng.size
-    };
-
-    vkCmdPipelineBarrier(info.cmdbuf, dst.last_used_,
-      VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1, &dst_barrier, 0, nullptr);
-
-    auto src_barrier = dst_barrier;
-    src_barrier.buffer = src.buffer_;
-    src_barrier.srcAccessMask = src.current_access_;
-    src_barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-    src_barrier.offset = src_rng.offset;
-    src_barrier.size = src_rng.size;
-
-    vkCmdPipelineBarrier(info.cmdbuf, src.last_used_,
-      VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1, &src_barrier, 0, nullptr);
+    gpu_buffer &dst = get_buffer_((*op.bindings_)[0].rref);
+    gpu_buffer &src = get_buffer_((*op.bindings_)[1].rref);
 
     VkBufferCopy region = {
       .size = src_rng.size,
@@ -545,12 +648,6 @@ void render_graph::execute_transfer_graph_stage_(
     };
 
     vkCmdCopyBuffer(info.cmdbuf, src.buffer_, dst.buffer_, 1, &region);
-
-    dst.last_used_ = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    dst.current_access_ = VK_ACCESS_TRANSFER_WRITE_BIT;
-
-    src.last_used_ = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    src.current_access_ = VK_ACCESS_TRANSFER_READ_BIT;
   } break;
 
   case transfer_operation::type::image_blit: 
@@ -558,35 +655,6 @@ void render_graph::execute_transfer_graph_stage_(
     gpu_image &src = get_image_((*op.bindings_)[0].rref);
     gpu_image &dst = get_image_((*op.bindings_)[1].rref);
 
-    // Transition layouts
-    VkImageMemoryBarrier barrier = 
-    {
-      .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-      .image = src.get_().image_,
-      .oldLayout = src.get_().current_layout_,
-      .newLayout = (*op.bindings_)[0].get_image_layout(),
-      .srcAccessMask = src.get_().current_access_,
-      .dstAccessMask = (*op.bindings_)[0].get_image_access(),
-      .subresourceRange.aspectMask = src.get_().aspect_,
-      // TODO: Support non-hardcoded values for this
-      .subresourceRange.baseArrayLayer = 0,
-      .subresourceRange.baseMipLevel = 0,
-      .subresourceRange.layerCount = 1,
-      .subresourceRange.levelCount = 1
-    };
-
-    vkCmdPipelineBarrier(info.cmdbuf, src.get_().last_used_, 
-      VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
-
-    barrier.image = dst.get_().image_;
-    barrier.oldLayout = dst.get_().current_layout_;
-    barrier.newLayout = (*op.bindings_)[1].get_image_layout();
-    barrier.srcAccessMask = dst.get_().current_access_;
-    barrier.dstAccessMask = (*op.bindings_)[1].get_image_access();
-
-    vkCmdPipelineBarrier(info.cmdbuf, dst.get_().last_used_,
-      VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
-
     VkImageBlit region = 
     {
       .srcOffsets = { {}, { (int32_t)src.get_().extent_.width, 
@@ -605,49 +673,15 @@ void render_graph::execute_transfer_graph_stage_(
       }
     };
 
-    src.get_().current_layout_ = (*op.bindings_)[0].get_image_layout();
-    src.get_().current_access_ = (*op.bindings_)[0].get_image_access();
-    src.get_().last_used_ = VK_PIPELINE_STAGE_TRANSFER_BIT;
-
-    dst.get_().current_layout_ = (*op.bindings_)[1].get_image_layout();
-    dst.get_().current_access_ = (*op.bindings_)[1].get_image_access();
-    dst.get_().last_used_ = VK_PIPELINE_STAGE_TRANSFER_BIT;
-
     vkCmdBlitImage(
       info.cmdbuf, 
-      src.get_().image_, src.get_().current_layout_, 
-      dst.get_().image_, dst.get_().current_layout_, 
+      src.get_().image_, (*op.bindings_)[0].get_image_layout(), 
+      dst.get_().image_, (*op.bindings_)[1].get_image_layout(), 
       1, &region, VK_FILTER_LINEAR);
   } break;
 
-  case transfer_operation::type::present_ready:
-  {
-    gpu_image &img = get_image_((*op.bindings_)[0].rref);
-
-    // Handle present stage - transition image layout
-    VkImageMemoryBarrier barrier = 
-    {
-      .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-      .image = img.get_().image_,
-      .oldLayout = img.get_().current_layout_,
-      .newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-      .srcAccessMask = img.get_().current_access_,
-      .dstAccessMask = 0,
-      .subresourceRange.aspectMask = img.get_().aspect_,
-      .subresourceRange.baseArrayLayer = 0,
-      .subresourceRange.baseMipLevel = 0,
-      .subresourceRange.layerCount = 1,
-      .subresourceRange.levelCount = 1
-    };
-
-    vkCmdPipelineBarrier(info.cmdbuf, img.get_().last_used_,
-      VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
-
-    // Update image data
-    img.get_().current_layout_ = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-    img.get_().current_access_ = 0;
-    img.get_().last_used_ = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
-  } break;
+  // The layout transition is all there is to it
+  case transfer_operation::type::present_ready: break;
 
   default: break;
   }
@@ -655,282 +689,2644 @@ void render_graph::execute_transfer_graph_stage_(
 
 job render_graph::end() 
 {
-  cmdbuf_info info;
-  info.cmdbuf = current_cmdbuf_ = get_command_buffer_();
-
-  VkCommandBufferBeginInfo begin_info = 
-  {
-    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO
-  };
-
-  vkBeginCommandBuffer(current_cmdbuf_, &begin_info);
+  VkPipelineStageFlags last_stage = 0;
+  VkCommandBuffer release_cmdbufs[queue_type_count] = {};
+  VkCommandBuffer cmdbuf = record_(last_stage, release_cmdbufs, false);
 
-  // swapchain_img_idx_ = info.swapchain_idx;
+  job j(cmdbuf, last_stage, this);
+  j.queue_family_ = current_queue_family_;
+  for (int i = 0; i < queue_type_count; ++i)
+    j.release_cmdbufs_[i] = release_cmdbufs[i];
 
-  // First traverse through all stages in order to figure out resources to use
-  for (int i = 0; i < recorded_stages_.size(); ++i) 
-    prepare_pass_graph_stage_(i);
+  j.record_id_ = ++next_record_id_;
+  unsubmitted_jobs_[j.record_id_] = 1;
 
-  // Loop through all used resources
-  for (auto &rref : used_resources_) 
+  // The swapchain can only wait on binary semaphores
+  for (auto &stg : recorded_stages_)
   {
-    graph_resource &res = resources_[rref];
-
-    switch (res.get_type()) 
+    if (stg.get_type() == graph_pass::graph_transfer_pass &&
+        stg.get_transfer_operation().type_ == 
+          transfer_operation::type::present_ready)
     {
-    case graph_resource::type::graph_image:
-      res.get_image().apply_action_();
-      break;
-
-    case graph_resource::type::graph_buffer:
-      res.get_buffer().apply_action_();
-      break;
-
-    default:
+      j.swapchain_semaphore_ = get_semaphore_();
       break;
     }
   }
 
-  VkPipelineStageFlags last_stage = 0;
-
-  // Now loop through the passes and actually issue the commands!
-  for (int i = 0; i < recorded_stages_.size(); ++i) 
-  {
-    execute_pass_graph_stage_(i, last_stage, info);
-  }
-
-  vkEndCommandBuffer(current_cmdbuf_);
-  // generator->submit_command_buffer(info, last_stage);
-
-  return job(info.cmdbuf, last_stage, this);
+  return j;
 }
 
-int render_graph::add_submission_(const submission &sub)
+persistent_job render_graph::end_persistent(gpu_buffer_ref parameters)
 {
-  /* Find any inactive submissions */
-  for (int i = 0; i < submissions_.size(); ++i)
+  // The parameters get written by the CPU before every submission
+  if (parameters != invalid_graph_ref)
   {
-    if (!submissions_[i].active_)
+    gpu_buffer &buf = get_buffer(parameters);
+    buf.configure({ .host_visible = true });
+
+    // Configuring only matters before the buffer gets created: it can't be
+    // moved to host visible memory while earlier jobs may still use it
+    if (buf.buffer_ != VK_NULL_HANDLE && !buf.buffer_memory_.mapped)
     {
-      submissions_[i] = sub;
-      return i;
+      log_error("Parameter buffer of a persistent job was already allocated "
+        "in memory which isn't host visible (configure it with HOST_VISIBLE "
+        "before using it)");
+      panic_and_exit();
     }
   }
 
-  int idx = submissions_.size();
-  submissions_.push_back(sub);
-  return idx;
+  // Persistent jobs don't track ownership, so nothing gets released
+  VkPipelineStageFlags last_stage = 0;
+  VkCommandBuffer release_cmdbufs[queue_type_count] = {};
+  VkCommandBuffer cmdbuf = record_(last_stage, release_cmdbufs, true);
+
+  return persistent_job(cmdbuf, last_stage, parameters, this);
 }
 
-job render_graph::placeholder_job()
+VkCommandBuffer render_graph::record_(VkPipelineStageFlags &last_stage,
+  VkCommandBuffer *release_cmdbufs, bool persistent)
 {
-  VkFence fence = get_fence_();
+  current_queue_family_ = (persistent ?
+    gctx->graphics_family : pick_queue_family_());
+  ownership_family_ = (persistent ? -1 : current_queue_family_);
+  releases_.clear();
 
-  job j = job(VK_NULL_HANDLE, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, this);
-  j.fence_ = fence;
+  cmdbuf_info info;
+  info.cmdbuf = current_cmdbuf_ = get_command_buffer_(current_queue_family_);
 
-  submission sub;
-  sub.fence_ = fence;
-  sub.ref_count_ = 1;
-  sub.active_ = true;
-  sub.semaphores_.push_back(j.finished_semaphore_);
+  // A persistent job may get submitted again before the last one finished
+  current_usage_flags_ = (persistent ? 
+    (VkCommandBufferUsageFlags)VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT : 0u);
 
-  u32 sub_idx = add_submission_(sub);
+  VkCommandBufferBeginInfo begin_info = 
+  {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    .flags = current_usage_flags_
+  };
 
-  j.submission_idx_ = sub_idx;
+  vkBeginCommandBuffer(current_cmdbuf_, &begin_info);
 
-  return j;
-}
+  // The job is known by its first command buffer, even if chunked dispatches
+  // continue it in others (INFO.CMDBUF follows CURRENT_CMDBUF_)
+  VkCommandBuffer first_cmdbuf = info.cmdbuf;
 
-render_graph::submission *render_graph::get_successful_submission_()
-{
-  for (auto &sub : submissions_)
-  {
-    if (sub.active_ && sub.ref_count_ == 0)
-    {
-      VkResult res = vkGetFenceStatus(gctx->device, sub.fence_);
-      if (res == VK_SUCCESS)
-        return &sub;
-    }
-  }
+  // swapchain_img_idx_ = info.swapchain_idx;
 
-  return nullptr;
-}
+  // If the exact same thing was recorded before (with the resources in the
+  // same state), reuse what was planned back then. Persistent jobs don't go
+  // through the cache: they are only recorded once anyway.
+  bool cacheable = false;
+  u64 hash = (persistent ? 0 : hash_recorded_frame_(cacheable));
 
-void render_graph::recycle_submissions_()
-{
-  auto *sub = get_successful_submission_();
+  auto cached = (cacheable ? plans_.find(hash) : plans_.end());
+  // The hash only finds the candidate: the plan is only reused if what was
+  // recorded really is the same
+  bool is_cached = (cached != plans_.end() && cached->second.key == frame_key_);
+
+  u64 lookup_idx = (u64)plan_cache_stats_.hits + plan_cache_stats_.misses;
 
-  if (sub)
+  compiled_plan &plan = (is_cached ? cached->second : scratch_plan_);
+
+  if (is_cached)
   {
-    // Recycle all the stuff
-    if (sub->fence_ != VK_NULL_HANDLE)
-      free_fences_.insert(sub->fence_);
+    ++plan_cache_stats_.hits;
 
-    free_semaphores_.insert(free_semaphores_.end(), sub->semaphores_.begin(), sub->semaphores_.end());
-    free_cmdbufs_.insert(free_cmdbufs_.end(), sub->cmdbufs_.begin(), sub->cmdbufs_.end());
+    plan.last_used = lookup_idx;
 
-    sub->cmdbufs_.resize(0);
-    sub->semaphores_.resize(0);
-    sub->fence_ = VK_NULL_HANDLE;
-    sub->active_ = false;
-  }
-}
+    // BEGIN() still needs to know which resources to reset
+    used_resources_ = plan.used_resources;
+    for (auto &rref : used_resources_)
+      resources_[rref].was_used_ = true;
 
-VkFence render_graph::get_fence_()
-{
-  recycle_submissions_();
+    for (u32 i = 0; i < plan.event_count; ++i)
+      recorded_events_.push_back(get_event_());
 
-  if (free_fences_.size())
-  {
-    auto iter = free_fences_.begin();
-    VkFence ret = *iter;
-    free_fences_.erase(iter);
-    return ret;
+    barrier_stats_.elided_barriers += plan.elided_barriers;
   }
   else
   {
-    VkFence fence;
-    VkFenceCreateInfo fence_info = {};
-    fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT; // Set to signaled because we reset the fence when submitting commands
-    vkCreateFence(gctx->device, &fence_info, nullptr, &fence);
-
-    nz::log_info("Created fence");
+    ++plan_cache_stats_.misses;
 
-    return fence;
+    compile_frame_(plan);
   }
-}
 
-VkSemaphore render_graph::get_semaphore_()
-{
-  recycle_submissions_();
+  // A persistent job can run after anything: its first access to every
+  // resource needs to wait on whatever came before it
+  VkImageLayout *start_layouts = nullptr;
+  if (persistent)
+    start_layouts = forget_resource_states_();
 
-  if (free_semaphores_.size())
-  {
-    VkSemaphore ret = free_semaphores_.back();
-    free_semaphores_.pop_back();
-    return ret;
-  }
-  else
+  // Secondary command buffers can't be split for chunked dispatches
+  bool has_chunks = false;
+  for (auto &stg : recorded_stages_)
   {
-    VkSemaphore semaphore;
-    VkSemaphoreCreateInfo semaphore_info = {};
-    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-    vkCreateSemaphore(gctx->device, &semaphore_info, nullptr, &semaphore);
-
-    nz::log_info("Created semaphore");
-
-    return semaphore;
+    if (stg.get_type() == graph_pass::graph_compute_pass &&
+        stg.get_compute_pass().max_workgroups_per_chunk_)
+      has_chunks = true;
   }
-}
 
-VkCommandBuffer render_graph::get_command_buffer_()
-{
-  recycle_submissions_();
-
-  if (free_cmdbufs_.size())
+  if (!persistent && !has_chunks && workers_.get_thread_count() > 1 && 
+      plan.order.size() >= min_parallel_stages)
   {
-    VkCommandBuffer ret = free_cmdbufs_.back();
-    free_cmdbufs_.pop_back();
-    return ret;
+    record_in_parallel_(plan, is_cached, info, last_stage);
   }
   else
   {
-    VkCommandBuffer command_buffer;
-    VkCommandBufferAllocateInfo command_buffer_info = {};
-    command_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    command_buffer_info.commandBufferCount = 1;
-    command_buffer_info.commandPool = gctx->command_pool;
-    command_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    vkAllocateCommandBuffers(
-      gctx->device, &command_buffer_info, &command_buffer);
+    // Every step is one barrier batch followed by the stages it was for
+    for (u32 s = 0; s + 1 < plan.step_offsets.size(); ++s)
+    {
+      u32 first = plan.step_offsets[s], last = plan.step_offsets[s + 1];
 
-    nz::log_info("Created command buffer");
+      prepare_step_(plan, s, info.cmdbuf);
 
-    return command_buffer;
-  }
-}
+      if (is_cached)
+      {
+        barrier_batch barriers(plan.barriers, s,
+          recorded_events_.data(), &barrier_stats_);
 
-pending_workload render_graph::submit(job *jobs, int count,
-  job *dependencies, int dependency_count)
-{
-  VkCommandBuffer *jobs_raw = stack_alloc(VkCommandBuffer, count);
-  VkSemaphore *signal_raw = stack_alloc(VkSemaphore, count);
-  for (int i = 0; i < count; ++i)
-    (jobs_raw[i] = jobs[i].cmdbuf_), (signal_raw[i] = jobs[i].finished_semaphore_);
+        barriers.issue(info.cmdbuf);
+      }
+      else
+      {
+        u32 binding_count = 0;
+        for (u32 i = first; i < last; ++i)
+          binding_count += recorded_stages_[plan.order[i]].bindings_->size();
 
-  uint32_t wait_count = 0;
-  VkSemaphore *wait_raw = stack_alloc(VkSemaphore, dependency_count);
-  VkPipelineStageFlags *end_stages = stack_alloc(VkPipelineStageFlags, dependency_count);
+        barrier_batch barriers(binding_count, binding_count, &barrier_stats_);
+        barriers.set_queue_family(ownership_family_, &releases_);
 
-  for (int i = 0; i < dependency_count; ++i)
+        discard_aliased_(s);
+        for (u32 i = first; i < last; ++i)
+          add_stage_barriers_(plan.order[i], barriers);
+
+        barriers.save(plan.barriers, recorded_events_);
+        barriers.issue(info.cmdbuf);
+      }
+
+      for (u32 i = first; i < last; ++i)
+      {
+        graph_stage_ref stg = plan.order[i];
+
+        execute_pass_graph_stage_(stg, last_stage, info, plan);
+        info.cmdbuf = current_cmdbuf_;
+
+        // Events would stay signaled from one submission to the next
+        if (!is_cached && !persistent)
+          plan_split_barriers_(stg, plan);
+
+        compiled_plan::stage_info &stg_info = plan.stages[stg];
+        if (stg_info.event >= 0)
+        {
+          vkCmdSetEvent(info.cmdbuf,
+            recorded_events_[stg_info.event], stg_info.event_stage);
+        }
+      }
+    }
+  }
+
+  if (is_cached)
+  {
+    // Nothing got planned, so the tracked state needs to be brought forward
+    restore_resource_states_(plan);
+  }
+  else
+  {
+    plan.event_count = recorded_events_.size();
+    plan.elided_barriers = barrier_stats_.elided_barriers;
+    plan.used_resources = used_resources_;
+    save_resource_states_(plan);
+
+    // Replaying the plan wouldn't release the resources on the other queue
+    if (cacheable && releases_.empty())
+    {
+      if (plans_.size() >= max_cached_plans && !plans_.count(hash))
+      {
+        auto oldest = plans_.begin();
+        for (auto it = plans_.begin(); it != plans_.end(); ++it)
+        {
+          if (it->second.last_used < oldest->second.last_used)
+            oldest = it;
+        }
+
+        plans_.erase(oldest);
+      }
+
+      plan.key = frame_key_;
+      plan.last_used = lookup_idx;
+      plans_[hash] = plan;
+    }
+  }
+
+  if (persistent)
+  {
+    // Every submission needs to start from the same layouts
+    restore_start_layouts_(start_layouts, info.cmdbuf);
+    forget_resource_states_();
+  }
+
+  vkEndCommandBuffer(current_cmdbuf_);
+
+  // One command buffer per queue the job takes resources over from
+  for (u32 q = 0; q < queue_type_count && !releases_.empty(); ++q)
+  {
+    s32 family = get_queue_family((queue_type)q);
+
+    if (family == current_queue_family_ || !releases_.has_family(family) ||
+        get_queue_type(family) != q)
+      continue;
+
+    release_cmdbufs[q] = get_command_buffer_(family);
+
+    VkCommandBufferBeginInfo release_begin_info = 
+    {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO
+    };
+
+    vkBeginCommandBuffer(release_cmdbufs[q], &release_begin_info);
+    releases_.issue(release_cmdbufs[q], family);
+    vkEndCommandBuffer(release_cmdbufs[q]);
+  }
+
+  releases_.clear();
+
+  info.cmdbuf = first_cmdbuf;
+
+  if (recorded_continuations_.size())
+    job_continuations_[info.cmdbuf] = std::move(recorded_continuations_);
+
+  recorded_continuations_.clear();
+
+  // The events can only be recycled once the job has finished executing
+  if (recorded_events_.size())
+    job_events_[info.cmdbuf] = std::move(recorded_events_);
+
+  recorded_events_.clear();
+
+  // Same for the staging blocks the buffer updates copy from
+  if (recorded_staging_.size())
+    job_staging_[info.cmdbuf] = std::move(recorded_staging_);
+
+  recorded_staging_.clear();
+
+  collect_resource_uses_(info.cmdbuf);
+  // generator->submit_command_buffer(info, last_stage);
+
+  return info.cmdbuf;
+}
+
+void render_graph::record_in_parallel_(compiled_plan &plan, bool is_cached,
+  const cmdbuf_info &info, VkPipelineStageFlags &last_stage)
+{
+  u32 step_count = plan.step_offsets.size() - 1;
+
+  // Everything which depends on what came before gets done up front: planning
+  // the barriers (and split barriers), and creating the pipelines. The chunks
+  // then only replay the saved barrier batches.
+  for (u32 s = 0; s < step_count; ++s)
+  {
+    u32 first = plan.step_offsets[s], last = plan.step_offsets[s + 1];
+
+    if (!is_cached)
+    {
+      u32 binding_count = 0;
+      for (u32 i = first; i < last; ++i)
+        binding_count += recorded_stages_[plan.order[i]].bindings_->size();
+
+      barrier_batch barriers(binding_count, binding_count, &barrier_stats_);
+      barriers.set_queue_family(ownership_family_, &releases_);
+
+      discard_aliased_(s);
+      for (u32 i = first; i < last; ++i)
+        add_stage_barriers_(plan.order[i], barriers);
+
+      barriers.save(plan.barriers, recorded_events_);
+    }
+
+    for (u32 i = first; i < last; ++i)
+    {
+      graph_stage_ref stg = plan.order[i];
+
+      if (recorded_stages_[stg].get_type() == graph_pass::graph_compute_pass)
+        prepare_kernel_(get_compute_pass_(stg));
+
+      if (!is_cached)
+        plan_split_barriers_(stg, plan);
+    }
+  }
+
+  struct chunk
+  {
+    u32 first_step, last_step;
+    bool has_render_pass;
+    worker_pool::secondary cmdbuf;
+    VkPipelineStageFlags last_stage;
+  };
+
+  // A couple of chunks per thread so that threads which are done early can
+  // pick up more work
+  u32 thread_count = workers_.get_thread_count();
+  u32 chunk_stages = std::max(min_stages_per_chunk,
+    (u32)plan.order.size() / (thread_count * 2));
+
+  chunk *chunks = bump_mem_alloc<chunk>(step_count);
+  u32 chunk_count = 0;
+
+  for (u32 s = 0; s < step_count; ++s)
+  {
+    if (chunk_count == 0 || plan.step_offsets[s] - 
+        plan.step_offsets[chunks[chunk_count - 1].first_step] >= chunk_stages)
+    {
+      chunks[chunk_count++] = { s, s, false };
+    }
+
+    chunk &c = chunks[chunk_count - 1];
+    c.last_step = s + 1;
+
+    for (u32 i = plan.step_offsets[s]; i < plan.step_offsets[s + 1]; ++i)
+    {
+      if (recorded_stages_[plan.order[i]].get_type() == 
+          graph_pass::graph_render_pass)
+        c.has_render_pass = true;
+    }
+  }
+
+  barrier_stats *thread_stats = bump_mem_alloc<barrier_stats>(thread_count);
+  for (u32 t = 0; t < thread_count; ++t)
+    thread_stats[t] = {};
+
+  auto record_chunk = [&] (u32 thread_idx, chunk &c)
+  {
+    c.cmdbuf = workers_.get_secondary(thread_idx, current_queue_family_);
+    c.last_stage = 0;
+
+    VkCommandBufferInheritanceInfo inheritance_info = 
+    {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO
+    };
+
+    VkCommandBufferBeginInfo begin_info = 
+    {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      .pInheritanceInfo = &inheritance_info
+    };
+
+    vkBeginCommandBuffer(c.cmdbuf.cmdbuf, &begin_info);
+
+    cmdbuf_info chunk_info = info;
+    chunk_info.cmdbuf = c.cmdbuf.cmdbuf;
+
+    for (u32 s = c.first_step; s < c.last_step; ++s)
+    {
+      prepare_step_(plan, s, chunk_info.cmdbuf);
+
+      barrier_batch barriers(plan.barriers, s,
+        recorded_events_.data(), &thread_stats[thread_idx]);
+
+      barriers.issue(chunk_info.cmdbuf);
+
+      for (u32 i = plan.step_offsets[s]; i < plan.step_offsets[s + 1]; ++i)
+      {
+        graph_stage_ref stg = plan.order[i];
+
+        execute_pass_graph_stage_(stg, c.last_stage, chunk_info, plan);
+
+        compiled_plan::stage_info &stg_info = plan.stages[stg];
+        if (stg_info.event >= 0)
+        {
+          vkCmdSetEvent(chunk_info.cmdbuf,
+            recorded_events_[stg_info.event], stg_info.event_stage);
+        }
+      }
+    }
+
+    vkEndCommandBuffer(c.cmdbuf.cmdbuf);
+  };
+
+  std::atomic<u32> next_chunk(0);
+
+  workers_.run([&] (u32 thread_idx)
+  {
+    if (thread_idx == 0)
+    {
+      for (u32 c = 0; c < chunk_count; ++c)
+        if (chunks[c].has_render_pass)
+          record_chunk(0, chunks[c]);
+    }
+
+    for (u32 c = next_chunk++; c < chunk_count; c = next_chunk++)
+    {
+      if (!chunks[c].has_render_pass)
+        record_chunk(thread_idx, chunks[c]);
+    }
+  });
+
+  auto *cmdbufs = bump_mem_alloc<VkCommandBuffer>(chunk_count);
+  auto &secondaries = job_secondaries_[info.cmdbuf];
+
+  for (u32 c = 0; c < chunk_count; ++c)
+  {
+    cmdbufs[c] = chunks[c].cmdbuf.cmdbuf;
+    secondaries.push_back(chunks[c].cmdbuf);
+  }
+
+  vkCmdExecuteCommands(info.cmdbuf, chunk_count, cmdbufs);
+
+  last_stage = chunks[chunk_count - 1].last_stage;
+
+  for (u32 t = 0; t < thread_count; ++t)
+  {
+    barrier_stats_.issued_barriers += thread_stats[t].issued_barriers;
+    barrier_stats_.pipeline_barrier_calls += 
+      thread_stats[t].pipeline_barrier_calls;
+    barrier_stats_.split_barriers += thread_stats[t].split_barriers;
+  }
+}
+
+s32 render_graph::pick_queue_family_()
+{
+  if (recorded_stages_.empty())
+    return gctx->graphics_family;
+
+  bool has_compute = false;
+
+  // Anything which needs the graphics queue keeps the whole job there
+  for (auto &stg : recorded_stages_)
+  {
+    switch (stg.get_type())
+    {
+    case graph_pass::graph_compute_pass: has_compute = true; break;
+
+    case graph_pass::graph_transfer_pass:
+    {
+      switch (stg.get_transfer_operation().type_)
+      {
+      case transfer_operation::type::buffer_update:
+      case transfer_operation::type::buffer_copy:
+      case transfer_operation::type::buffer_copy_to_cpu:
+        break;
+
+      default:
+        return gctx->graphics_family;
+      }
+    } break;
+
+    default:
+      return gctx->graphics_family;
+    }
+  }
+
+  // Without a dedicated transfer family, TRANSFER_FAMILY is the compute one
+  if (!has_compute && is_async_transfer_enabled_ &&
+      gctx->transfer_family != gctx->compute_family)
+    return gctx->transfer_family;
+
+  return (is_async_compute_enabled_ ?
+    gctx->compute_family : gctx->graphics_family);
+}
+
+VkImageLayout *render_graph::forget_resource_states_()
+{
+  VkImageLayout *layouts = bump_mem_alloc<VkImageLayout>(used_resources_.size());
+
+  for (u32 i = 0; i < used_resources_.size(); ++i)
+  {
+    graph_resource &res = resources_[used_resources_[i]];
+
+    switch (res.get_type())
+    {
+    case graph_resource::type::graph_image:
+    {
+      gpu_image &img = res.get_image().get_();
+
+      layouts[i] = img.current_layout_;
+      img.current_access_ = VK_ACCESS_MEMORY_WRITE_BIT;
+      img.last_used_ = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+      img.owner_family_ = gctx->graphics_family;
+    } break;
+
+    case graph_resource::type::graph_buffer:
+    {
+      gpu_buffer &buf = res.get_buffer();
+      auto &states = buf.get_range_states_();
+
+      states.resize(1);
+      states[0] = { 0, buf.size_, 
+        VK_ACCESS_MEMORY_WRITE_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT };
+      buf.owner_family_ = gctx->graphics_family;
+    } break;
+
+    default: break;
+    }
+  }
+
+  return layouts;
+}
+
+void render_graph::restore_start_layouts_(
+  const VkImageLayout *layouts, VkCommandBuffer cmdbuf)
+{
+  barrier_batch barriers(used_resources_.size(), 0, &barrier_stats_);
+
+  for (u32 i = 0; i < used_resources_.size(); ++i)
+  {
+    graph_resource &res = resources_[used_resources_[i]];
+
+    if (res.get_type() != graph_resource::type::graph_image)
+      continue;
+
+    gpu_image &img = res.get_image().get_();
+
+    // Images which started out undefined don't have contents to preserve
+    // between submissions, they can stay as they are
+    if (layouts[i] == VK_IMAGE_LAYOUT_UNDEFINED || 
+        layouts[i] == img.current_layout_)
+      continue;
+
+    barriers.add_image(img, layouts[i], 0, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+  }
+
+  barriers.issue(cmdbuf);
+}
+
+void render_graph::compile_frame_(compiled_plan &plan)
+{
+  plan.clear();
+
+  // First traverse through all stages in order to figure out resources to use
+  for (int i = 0; i < recorded_stages_.size(); ++i) 
+    prepare_pass_graph_stage_(i);
+
+  u32 stage_count = recorded_stages_.size();
+
+  if (compile_mode_ == graph_compile_mode::dependency_waves)
+  {
+    // All stages of a wave are independent - one barrier for all of them
+    build_dependency_waves_();
+
+    plan.order = wave_order_;
+    plan.step_offsets = wave_offsets_;
+  }
+  else
+  {
+    plan.order.resize(stage_count);
+    plan.step_offsets.resize(stage_count + 1);
+
+    for (u32 i = 0; i < stage_count; ++i)
+      plan.order[i] = plan.step_offsets[i] = i;
+
+    plan.step_offsets[stage_count] = stage_count;
+  }
+
+  // Needs to know when the resources get used
+  bind_transient_resources_(plan);
+
+  // Loop through all used resources
+  for (auto &rref : used_resources_) 
+  {
+    graph_resource &res = resources_[rref];
+
+    switch (res.get_type()) 
+    {
+    case graph_resource::type::graph_image:
+      res.get_image().apply_action_();
+      break;
+
+    case graph_resource::type::graph_buffer:
+      res.get_buffer().apply_action_();
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  plan.stages.resize(stage_count);
+  for (u32 i = 0; i < stage_count; ++i)
+    compile_stage_(i, plan);
+}
+
+void render_graph::compile_stage_(graph_stage_ref stg, compiled_plan &plan)
+{
+  compiled_plan::stage_info &info = plan.stages[stg];
+  info.event = -1;
+  info.event_stage = 0;
+  info.descriptor_offset = plan.descriptor_sets.size();
+
+  if (recorded_stages_[stg].get_type() == graph_pass::graph_compute_pass)
+  {
+    compute_pass &cp = get_compute_pass_(stg);
+
+    plan.descriptor_sets.resize(
+      info.descriptor_offset + cp.bindings_->size());
+    cp.get_descriptor_sets_(
+      plan.descriptor_sets.data() + info.descriptor_offset);
+
+    cp.get_dispatch_size_(info.group_count);
+  }
+}
+
+static inline void add_key_value(std::vector<u64> &key, u64 value)
+{
+  key.push_back(value);
+}
+
+u64 render_graph::hash_recorded_frame_(bool &cacheable)
+{
+  std::vector<u64> &key = frame_key_;
+  key.clear();
+  cacheable = true;
+
+  add_key_value(key, (u64)compile_mode_);
+  add_key_value(key, current_queue_family_);
+
+  for (auto &stg : recorded_stages_)
+  {
+    add_key_value(key, stg.get_type());
+
+    switch (stg.get_type())
+    {
+    case graph_pass::graph_compute_pass:
+    {
+      compute_pass &cp = stg.get_compute_pass();
+
+      add_key_value(key, cp.kernel_);
+      add_key_value(key, cp.dispatch_params_.x);
+      add_key_value(key, cp.dispatch_params_.y);
+      add_key_value(key, cp.dispatch_params_.z);
+      add_key_value(key, cp.dispatch_params_.is_waves);
+      add_key_value(key, cp.dispatch_params_.binding_res);
+      add_key_value(key, cp.max_workgroups_per_chunk_);
+    } break;
+
+    case graph_pass::graph_render_pass:
+    {
+      // We can't know what these will do to the resources
+      if (stg.get_render_pass().prepare_commands_proc_)
+        cacheable = false;
+    } break;
+
+    case graph_pass::graph_transfer_pass:
+    {
+      add_key_value(key, stg.get_transfer_operation().type_);
+    } break;
+
+    default: break;
+    }
+
+    for (auto &b : *stg.bindings_)
+    {
+      add_key_value(key, b.utype);
+      add_key_value(key, b.rref);
+      add_key_value(key, b.buffer_range.offset);
+      add_key_value(key, b.buffer_range.size);
+
+      // The planned barriers depend on the state the resources are in
+      graph_resource &res = get_resource_(b.rref);
+
+      switch (res.get_type())
+      {
+      case graph_resource::type::graph_image:
+      {
+        gpu_image &img = res.get_image().get_();
+
+        add_key_value(key, (u64)img.image_);
+        add_key_value(key, img.current_layout_);
+        add_key_value(key, img.current_access_);
+        add_key_value(key, img.last_used_);
+        add_key_value(key, img.owner_family_);
+      } break;
+
+      case graph_resource::type::graph_buffer:
+      {
+        gpu_buffer &buf = res.get_buffer();
+
+        add_key_value(key, (u64)buf.buffer_);
+        add_key_value(key, buf.owner_family_);
+
+        for (auto &state : buf.range_states_)
+        {
+          add_key_value(key, state.begin);
+          add_key_value(key, state.end);
+          add_key_value(key, state.access);
+          add_key_value(key, state.stage);
+        }
+      } break;
+
+      default: break;
+      }
+    }
+  }
+
+  // FNV-1a
+  u64 hash = 14695981039346656037ull;
+  for (u64 value : key)
+  {
+    for (u32 i = 0; i < sizeof(value); ++i)
+    {
+      hash ^= (value >> (i * 8)) & 0xFF;
+      hash *= 1099511628211ull;
+    }
+  }
+
+  return hash;
+}
+
+void render_graph::save_resource_states_(compiled_plan &plan)
+{
+  plan.end_states.resize(used_resources_.size());
+
+  for (u32 i = 0; i < used_resources_.size(); ++i)
+  {
+    graph_resource &res = resources_[used_resources_[i]];
+    compiled_plan::resource_state &state = plan.end_states[i];
+
+    switch (res.get_type())
+    {
+    case graph_resource::type::graph_image:
+    {
+      gpu_image &img = res.get_image().get_();
+
+      state.layout = img.current_layout_;
+      state.access = img.current_access_;
+      state.stage = img.last_used_;
+      state.job_stages = img.job_stages_;
+      state.job_writes = img.job_writes_;
+    } break;
+
+    case graph_resource::type::graph_buffer:
+    {
+      gpu_buffer &buf = res.get_buffer();
+
+      state.ranges = buf.get_range_states_();
+      state.job_stages = buf.job_stages_;
+      state.job_writes = buf.job_writes_;
+    } break;
+
+    default: break;
+    }
+  }
+}
+
+void render_graph::restore_resource_states_(compiled_plan &plan)
+{
+  for (u32 i = 0; i < plan.used_resources.size(); ++i)
+  {
+    graph_resource &res = resources_[plan.used_resources[i]];
+    compiled_plan::resource_state &state = plan.end_states[i];
+
+    switch (res.get_type())
+    {
+    case graph_resource::type::graph_image:
+    {
+      gpu_image &img = res.get_image().get_();
+
+      img.current_layout_ = state.layout;
+      img.current_access_ = state.access;
+      img.last_used_ = state.stage;
+      img.job_stages_ = state.job_stages;
+      img.job_writes_ = state.job_writes;
+    } break;
+
+    case graph_resource::type::graph_buffer:
+    {
+      gpu_buffer &buf = res.get_buffer();
+
+      buf.get_range_states_() = state.ranges;
+      buf.job_stages_ = state.job_stages;
+      buf.job_writes_ = state.job_writes;
+    } break;
+
+    default: break;
+    }
+  }
+}
+
+void render_graph::collect_resource_uses_(VkCommandBuffer cmdbuf)
+{
+  std::vector<resource_use> &uses = job_uses_[cmdbuf];
+  uses.resize(0);
+
+  for (auto rref : used_resources_)
+  {
+    graph_resource &res = resources_[rref];
+
+    switch (res.get_type())
+    {
+    case graph_resource::type::graph_image:
+    {
+      gpu_image &img = res.get_image().get_();
+
+      if (img.job_stages_)
+      {
+        uses.push_back({ rref, img.job_stages_,
+          img.job_writes_ || is_shared_transient_(img.transient_slot_) });
+      }
+
+      img.job_stages_ = 0;
+      img.job_writes_ = false;
+    } break;
+
+    case graph_resource::type::graph_buffer:
+    {
+      gpu_buffer &buf = res.get_buffer();
+
+      if (buf.job_stages_)
+      {
+        uses.push_back({ rref, buf.job_stages_,
+          buf.job_writes_ || is_shared_transient_(buf.transient_slot_) });
+      }
+
+      buf.job_stages_ = 0;
+      buf.job_writes_ = false;
+    } break;
+
+    default: break;
+    }
+  }
+}
+
+bool render_graph::is_shared_transient_(s32 slot)
+{
+  return slot >= 0 && transient_slots_[slot].resource_count > 1;
+}
+
+submission_history *render_graph::get_history_(graph_resource_ref rref)
+{
+  graph_resource &res = resources_[rref];
+
+  s32 slot = -1;
+  submission_history *history = nullptr;
+
+  switch (res.get_type())
+  {
+  case graph_resource::type::graph_image:
+  {
+    gpu_image &img = res.get_image().get_();
+    slot = img.transient_slot_;
+    history = &img.history_;
+  } break;
+
+  case graph_resource::type::graph_buffer:
+  {
+    gpu_buffer &buf = res.get_buffer();
+    slot = buf.transient_slot_;
+    history = &buf.history_;
+  } break;
+
+  default: break;
+  }
+
+  return (slot >= 0 ? &transient_slots_[slot].history : history);
+}
+
+void render_graph::bind_transient_resources_(const compiled_plan &plan)
+{
+  aliased_uses_.clear();
+
+  u32 step_count = plan.step_offsets.size() - 1;
+  u32 *stage_steps = bump_mem_alloc<u32>(recorded_stages_.size());
+  for (u32 s = 0; s < step_count; ++s)
+  {
+    for (u32 i = plan.step_offsets[s]; i < plan.step_offsets[s + 1]; ++i)
+      stage_steps[plan.order[i]] = s;
+  }
+
+  struct lifetime
+  {
+    graph_resource_ref rref;
+    s32 *slot;
+    u32 first_step, last_step;
+    // Only set for the resources which were just created
+    VkMemoryRequirements requirements;
+    bool is_buffer;
+    // Got moved out of a slot it shared with a resource used at the same time
+    bool moved;
+  };
+
+  u32 lifetime_count = 0;
+  lifetime *lifetimes = bump_mem_alloc<lifetime>(used_resources_.size());
+
+  for (auto rref : used_resources_)
+  {
+    graph_resource &res = resources_[rref];
+
+    lifetime lt = { rref };
+    resource_usage_node node;
+
+    switch (res.get_type())
+    {
+    case graph_resource::type::graph_image:
+    {
+      gpu_image &img = res.get_image();
+      if (!img.transient_ || img.action_ == gpu_image::to_present)
+        continue;
+
+      if (img.image_ == VK_NULL_HANDLE)
+      {
+        img.create_image_();
+        vkGetImageMemoryRequirements(
+          gctx->device, img.image_, &lt.requirements);
+      }
+
+      lt.slot = &img.transient_slot_;
+      lt.is_buffer = false;
+      node = img.head_node_;
+    } break;
+
+    case graph_resource::type::graph_buffer:
+    {
+      gpu_buffer &buf = res.get_buffer();
+      if (!buf.transient_)
+        continue;
+
+      if (buf.buffer_ == VK_NULL_HANDLE)
+      {
+        buf.create_buffer_();
+        vkGetBufferMemoryRequirements(
+          gctx->device, buf.buffer_, &lt.requirements);
+      }
+
+      lt.slot = &buf.transient_slot_;
+      lt.is_buffer = true;
+      node = buf.head_node_;
+    } break;
+
+    default: continue;
+    }
+
+    // Reads may get moved around by the dependency waves, so the first use
+    // isn't necessarily at the head of the chain
+    lt.first_step = step_count;
+    lt.last_step = 0;
+    for (; !node.is_invalid(); node = get_binding_(node.stage, node.binding_idx).next)
+    {
+      lt.first_step = glm::min(lt.first_step, stage_steps[node.stage]);
+      lt.last_step = glm::max(lt.last_step, stage_steps[node.stage]);
+    }
+
+    lifetimes[lifetime_count++] = lt;
+  }
+
+  // The new resources go into the first slot created for this job which is
+  // free by the time they get used, in order of first use
+  std::sort(lifetimes, lifetimes + lifetime_count,
+    [] (const lifetime &a, const lifetime &b) 
+      { return a.first_step < b.first_step; });
+
+  struct new_slot
+  {
+    VkMemoryRequirements requirements;
+    u32 last_step;
+    bool is_buffer;
+  };
+
+  std::vector<new_slot> new_slots;
+  u32 first_slot = transient_slots_.size();
+
+  for (u32 i = 0; i < lifetime_count; ++i)
+  {
+    lifetime &lt = lifetimes[i];
+    if (*lt.slot >= 0)
+      continue;
+
+    u32 j = 0;
+    for (; j < new_slots.size(); ++j)
+    {
+      new_slot &ns = new_slots[j];
+
+      if (ns.is_buffer == lt.is_buffer && ns.last_step < lt.first_step &&
+          (ns.requirements.memoryTypeBits & lt.requirements.memoryTypeBits))
+        break;
+    }
+
+    if (j == new_slots.size())
+    {
+      new_slots.push_back({ lt.requirements, lt.last_step, lt.is_buffer });
+    }
+    else
+    {
+      VkMemoryRequirements &reqs = new_slots[j].requirements;
+      reqs.size = glm::max(reqs.size, lt.requirements.size);
+      reqs.alignment = glm::max(reqs.alignment, lt.requirements.alignment);
+      reqs.memoryTypeBits &= lt.requirements.memoryTypeBits;
+
+      new_slots[j].last_step = lt.last_step;
+    }
+
+    *lt.slot = first_slot + j;
+  }
+
+  for (auto &ns : new_slots)
+  {
+    transient_slots_.push_back({ gctx->allocator->allocate(ns.requirements,
+      memory_usage::gpu_only, ns.is_buffer), 0, {} });
+  }
+
+  for (u32 i = 0; i < lifetime_count; ++i)
+  {
+    lifetime &lt = lifetimes[i];
+    transient_slot &ts = transient_slots_[*lt.slot];
+
+    if (*lt.slot >= (s32)first_slot)
+    {
+      graph_resource &res = resources_[lt.rref];
+      ++ts.resource_count;
+
+      // Created already, only the descriptors are left to do
+      if (lt.is_buffer)
+      {
+        gpu_buffer &buf = res.get_buffer();
+        vkBindBufferMemory(gctx->device, buf.buffer_,
+          ts.memory.memory, ts.memory.offset);
+
+        buf.action_ = gpu_buffer::none;
+      }
+      else
+      {
+        gpu_image &img = res.get_image();
+        vkBindImageMemory(gctx->device, img.image_,
+          ts.memory.memory, ts.memory.offset);
+        img.create_view_();
+
+        img.action_ = gpu_image::none;
+      }
+    }
+  }
+
+  // Resources which share memory can't be used at the same time. Only the
+  // job which created them is guaranteed to use them in the right order: the
+  // ones from earlier jobs may now overlap, and one of them has to go.
+  for (u32 i = 0; i < lifetime_count; ++i)
+  {
+    lifetime &a = lifetimes[i];
+
+    for (u32 j = i + 1; j < lifetime_count; ++j)
+    {
+      lifetime &b = lifetimes[j];
+
+      if (*a.slot != *b.slot || b.first_step > a.last_step)
+        continue;
+
+      // Jobs which were ended but not submitted yet were recorded with the
+      // old handle: better move the one which isn't in any of them
+      bool move_a = is_used_by_pending_job_(b.rref) &&
+        !is_used_by_pending_job_(a.rref);
+
+      lifetime &moved = (move_a ? a : b);
+      move_to_own_slot_(moved.rref);
+      moved.moved = true;
+
+      // A has a slot of its own now, nothing else can overlap with it
+      if (move_a)
+        break;
+    }
+  }
+
+  for (u32 i = 0; i < lifetime_count; ++i)
+  {
+    lifetime &lt = lifetimes[i];
+
+    // Moved resources start out in new memory, which has no contents either
+    if (lt.moved || transient_slots_[*lt.slot].resource_count > 1)
+      aliased_uses_.push_back({ lt.first_step, lt.rref });
+  }
+}
+
+void render_graph::move_to_own_slot_(graph_resource_ref rref)
+{
+  graph_resource &res = resources_[rref];
+  bool is_buffer = (res.get_type() == graph_resource::type::graph_buffer);
+
+  s32 *slot = nullptr;
+  VkMemoryRequirements requirements;
+
+  // Submissions which used the old handle may still be running
+  retired_transient retired = { rref };
+
+  if (is_buffer)
+  {
+    gpu_buffer &buf = res.get_buffer();
+    slot = &buf.transient_slot_;
+
+    retired.buffer = buf.buffer_;
+    for (auto &set : buf.descriptor_sets_)
+    {
+      if (set != VK_NULL_HANDLE)
+        retired.descriptor_sets.push_back(set);
+
+      set = VK_NULL_HANDLE;
+    }
+
+    buf.create_buffer_();
+    vkGetBufferMemoryRequirements(gctx->device, buf.buffer_, &requirements);
+  }
+  else
+  {
+    gpu_image &img = res.get_image();
+    slot = &img.transient_slot_;
+
+    retired.image = img.image_;
+    retired.view = img.image_view_;
+    for (auto &set : img.descriptor_sets_)
+    {
+      if (set != VK_NULL_HANDLE)
+        retired.descriptor_sets.push_back(set);
+
+      set = VK_NULL_HANDLE;
+    }
+
+    img.create_image_();
+    vkGetImageMemoryRequirements(gctx->device, img.image_, &requirements);
+  }
+
+  transient_slot &old_slot = transient_slots_[*slot];
+  retired.history = old_slot.history;
+
+  // Nothing else is going to be bound to the memory of an empty slot
+  if (--old_slot.resource_count == 0)
+  {
+    retired.memory = old_slot.memory;
+    old_slot.memory = {};
+  }
+
+  retired_transients_.push_back(retired);
+
+  *slot = transient_slots_.size();
+  transient_slots_.push_back({ gctx->allocator->allocate(requirements,
+    memory_usage::gpu_only, is_buffer), 1, {} });
+
+  transient_slot &ts = transient_slots_.back();
+
+  // The descriptors get created again when the action gets applied
+  if (is_buffer)
+  {
+    gpu_buffer &buf = res.get_buffer();
+    vkBindBufferMemory(gctx->device, buf.buffer_,
+      ts.memory.memory, ts.memory.offset);
+  }
+  else
+  {
+    gpu_image &img = res.get_image();
+    vkBindImageMemory(gctx->device, img.image_,
+      ts.memory.memory, ts.memory.offset);
+    img.create_view_();
+  }
+
+  // Cached plans have the old handle in their barriers
+  for (auto it = plans_.begin(); it != plans_.end();)
+  {
+    auto &used = it->second.used_resources;
+
+    if (std::find(used.begin(), used.end(), rref) != used.end())
+      it = plans_.erase(it);
+    else
+      ++it;
+  }
+}
+
+bool render_graph::is_used_by_pending_job_(graph_resource_ref rref)
+{
+  for (auto &[cmdbuf, uses] : job_uses_)
+  {
+    for (auto &use : uses)
+    {
+      if (use.rref == rref)
+        return true;
+    }
+  }
+
+  return false;
+}
+
+bool render_graph::is_history_complete_(const submission_history &history)
+{
+  if (history.write_value && 
+      !is_timeline_complete_(history.write_queue, history.write_value))
+    return false;
+
+  for (u32 q = 0; q < queue_type_count; ++q)
+  {
+    if (history.read_values[q] &&
+        !is_timeline_complete_((queue_type)q, history.read_values[q]))
+      return false;
+  }
+
+  return true;
+}
+
+void render_graph::free_retired_transients_()
+{
+  for (u32 i = 0; i < retired_transients_.size();)
+  {
+    retired_transient &retired = retired_transients_[i];
+
+    // Jobs which weren't submitted yet still have the old handle, and the
+    // resource's current history includes them once they do get submitted
+    submission_history *current = get_history_(retired.rref);
+
+    if (is_used_by_pending_job_(retired.rref) ||
+        !is_history_complete_(retired.history) ||
+        (current && !is_history_complete_(*current)))
+    {
+      ++i;
+      continue;
+    }
+
+    if (!retired.descriptor_sets.empty())
+    {
+      vkFreeDescriptorSets(gctx->device, gctx->descriptor_pool,
+        retired.descriptor_sets.size(), retired.descriptor_sets.data());
+    }
+
+    if (retired.view != VK_NULL_HANDLE)
+      vkDestroyImageView(gctx->device, retired.view, nullptr);
+    if (retired.image != VK_NULL_HANDLE)
+      vkDestroyImage(gctx->device, retired.image, nullptr);
+    if (retired.buffer != VK_NULL_HANDLE)
+      vkDestroyBuffer(gctx->device, retired.buffer, nullptr);
+
+    if (retired.memory.memory != VK_NULL_HANDLE)
+      gctx->allocator->free(retired.memory);
+
+    retired_transients_[i] = std::move(retired_transients_.back());
+    retired_transients_.pop_back();
+  }
+}
+
+void render_graph::discard_aliased_(u32 step)
+{
+  for (auto &use : aliased_uses_)
+  {
+    if (use.step != step)
+      continue;
+
+    // Whatever used the memory last may have been any of the resources which
+    // share it: wait on everything, and drop the contents
+    graph_resource &res = resources_[use.rref];
+
+    switch (res.get_type())
+    {
+    case graph_resource::type::graph_image:
+    {
+      gpu_image &img = res.get_image();
+
+      img.current_layout_ = VK_IMAGE_LAYOUT_UNDEFINED;
+      img.current_access_ = VK_ACCESS_MEMORY_WRITE_BIT;
+      img.last_used_ = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+      img.owner_family_ = -1;
+    } break;
+
+    case graph_resource::type::graph_buffer:
+    {
+      gpu_buffer &buf = res.get_buffer();
+      auto &states = buf.get_range_states_();
+
+      states.resize(1);
+      states[0] = { 0, buf.size_, 
+        VK_ACCESS_MEMORY_WRITE_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT };
+      buf.owner_family_ = -1;
+    } break;
+
+    default: break;
+    }
+  }
+}
+
+u32 render_graph::stage_upload_(const void *data, u32 size, u32 &offset)
+{
+  u32 aligned_size = (size + staging_alignment - 1) & ~(staging_alignment - 1);
+
+  u32 idx = get_staging_block_(aligned_size);
+  staging_block &b = staging_blocks_[idx];
+
+  offset = b.used;
+  b.used += aligned_size;
+
+  memcpy((u8 *)b.memory.mapped + offset, data, size);
+  gctx->allocator->flush(b.memory, offset, size);
+
+  // The job being recorded holds on to the block until it's done with it
+  if (std::find(recorded_staging_.begin(), recorded_staging_.end(), idx) ==
+      recorded_staging_.end())
+  {
+    recorded_staging_.push_back(idx);
+    ++b.job_count;
+  }
+
+  return idx;
+}
+
+u32 render_graph::get_staging_block_(u32 size)
+{
+  auto has_space = [this, size] (u32 idx)
+  {
+    staging_block &b = staging_blocks_[idx];
+
+    // Nothing copies from the block anymore
+    if (b.job_count == 0)
+      b.used = 0;
+
+    return b.size - b.used >= size;
+  };
+
+  if (current_staging_block_ >= 0 && has_space(current_staging_block_))
+    return current_staging_block_;
+
+  // Jobs which finished in the meantime may have given back some blocks
+  recycle_submissions_();
+
+  for (u32 i = 0; i < staging_blocks_.size(); ++i)
+  {
+    if (has_space(i))
+    {
+      current_staging_block_ = i;
+      return i;
+    }
+  }
+
+  staging_block b = {};
+  b.size = std::max(size, staging_block_size);
+
+  // The blocks get copied from by jobs of every queue family, and the graph
+  // doesn't track their ownership
+  u32 families[3];
+  u32 family_count = 0;
+  for (s32 family : { gctx->graphics_family, gctx->compute_family, gctx->transfer_family })
+  {
+    if (std::find(families, families + family_count, (u32)family) ==
+        families + family_count)
+      families[family_count++] = family;
+  }
+
+  VkBufferCreateInfo buffer_create_info = 
+  {
+    .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+    .size = b.size,
+    .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    .sharingMode = (family_count > 1 ?
+      VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE),
+    .queueFamilyIndexCount = (family_count > 1 ? family_count : 0),
+    .pQueueFamilyIndices = (family_count > 1 ? families : nullptr)
+  };
+
+  VK_CHECK(vkCreateBuffer(gctx->device, &buffer_create_info, nullptr, &b.buffer));
+  b.memory = allocate_buffer_memory(b.buffer, memory_usage::cpu_to_gpu);
+
+  assert(b.memory.mapped);
+
+  log_info("Allocated staging block (%d bytes)", b.size);
+
+  current_staging_block_ = staging_blocks_.size();
+  staging_blocks_.push_back(b);
+
+  return current_staging_block_;
+}
+
+void render_graph::release_staging_blocks_(const std::vector<u32> &blocks)
+{
+  for (u32 idx : blocks)
+  {
+    assert(staging_blocks_[idx].job_count > 0);
+    --staging_blocks_[idx].job_count;
+  }
+}
+
+void render_graph::compiled_plan::clear()
+{
+  order.clear();
+  step_offsets.clear();
+  barriers.clear();
+  stages.clear();
+  descriptor_sets.clear();
+  used_resources.clear();
+  end_states.clear();
+  event_count = 0;
+  elided_barriers = 0;
+}
+
+void render_graph::plan_split_barriers_(
+  graph_stage_ref stg, compiled_plan &plan)
+{
+  VkEvent event = VK_NULL_HANDLE;
+  VkPipelineStageFlags event_stage = 0;
+
+  u32 slot = get_execution_slot_(stg);
+
+  // Resources written by this stage which are next used at least one slot
+  // later get their barrier split: the consumer waits on an event instead of
+  // everything that was recorded before it.
+  for (auto &b : *recorded_stages_[stg].bindings_)
+  {
+    if (b.next.is_invalid() || b.next.stage >= recorded_stages_.size())
+      continue;
+
+    if (get_execution_slot_(b.next.stage) <= slot + 1)
+      continue;
+
+    VkEvent *pending_event;
+    VkPipelineStageFlags *pending_stage;
+    VkPipelineStageFlags last_used;
+
+    if (b.utype < binding::type::max_image)
+    {
+      gpu_image &img = get_image_(b.rref).get_();
+      if (!is_write_access(img.current_access_))
+        continue;
+
+      pending_event = &img.pending_event_;
+      pending_stage = &img.pending_event_stage_;
+      last_used = img.last_used_;
+    }
+    else if (b.utype < binding::type::max_buffer)
+    {
+      gpu_buffer &buf = get_buffer_(b.rref);
+      gpu_buffer::range_state state = buf.get_range_state_(
+        b.buffer_range.offset, buf.get_range_end_(b.buffer_range));
+
+      if (!is_write_access(state.access))
+        continue;
+
+      pending_event = &buf.pending_event_;
+      pending_stage = &buf.pending_event_stage_;
+      last_used = state.stage;
+    }
+    else continue;
+
+    if (event == VK_NULL_HANDLE)
+    {
+      event = get_event_();
+      recorded_events_.push_back(event);
+    }
+
+    event_stage |= last_used;
+
+    *pending_event = event;
+    *pending_stage = 0;
+  }
+
+  if (event == VK_NULL_HANDLE)
+    return;
+
+  plan.stages[stg].event = recorded_events_.size() - 1;
+  plan.stages[stg].event_stage = event_stage;
+
+  // Every waiter has to use the mask the event was signaled with
+  for (auto &b : *recorded_stages_[stg].bindings_)
+  {
+    if (b.utype < binding::type::max_image)
+    {
+      gpu_image &img = get_image_(b.rref).get_();
+      if (img.pending_event_ == event)
+        img.pending_event_stage_ = event_stage;
+    }
+    else if (b.utype < binding::type::max_buffer)
+    {
+      gpu_buffer &buf = get_buffer_(b.rref);
+      if (buf.pending_event_ == event)
+        buf.pending_event_stage_ = event_stage;
+    }
+  }
+}
+
+void render_graph::add_buffer_dag_edges_(gpu_buffer &buf)
+{
+  // Same as for images, but accesses only depend on each other if their
+  // ranges overlap. Once a write covers an earlier access, later accesses
+  // depend on it through the write.
+  dag_buffer_uses_.clear();
+
+  resource_usage_node node = buf.head_node_;
+
+  while (!node.is_invalid())
+  {
+    binding &b = get_binding_(node.stage, node.binding_idx);
+
+    dag_buffer_use use = {
+      node.stage, b.buffer_range.offset, buf.get_range_end_(b.buffer_range),
+      is_write_access(b.get_buffer_access())
+    };
+
+    u32 count = 0;
+    for (auto &prev : dag_buffer_uses_)
+    {
+      bool overlaps = prev.begin < use.end && use.begin < prev.end;
+
+      if (overlaps && (prev.writes || use.writes))
+        add_dag_edge_(prev.stage, use.stage);
+
+      bool covered = use.writes &&
+        use.begin <= prev.begin && prev.end <= use.end;
+
+      if (!covered)
+        dag_buffer_uses_[count++] = prev;
+    }
+
+    dag_buffer_uses_.resize(count);
+    dag_buffer_uses_.push_back(use);
+
+    node = b.next;
+  }
+}
+
+void render_graph::set_compile_mode(graph_compile_mode mode)
+{
+  compile_mode_ = mode;
+}
+
+void render_graph::set_recording_threads(u32 thread_count)
+{
+  workers_.set_thread_count(thread_count);
+}
+
+void render_graph::set_async_compute(bool enabled)
+{
+  is_async_compute_enabled_ = enabled;
+}
+
+void render_graph::set_async_transfer(bool enabled)
+{
+  is_async_transfer_enabled_ = enabled;
+}
+
+void render_graph::build_dependency_waves_()
+{
+  u32 stage_count = recorded_stages_.size();
+
+  dag_edges_.clear();
+
+  // Walk the usage chain of every resource. Reads depend on the last write,
+  // writes depend on the last write and on every read since then.
+  for (auto &rref : used_resources_)
+  {
+    graph_resource &res = resources_[rref];
+
+    resource_usage_node node;
+    switch (res.get_type())
+    {
+    case graph_resource::type::graph_image:
+      node = res.get_image().head_node_; break;
+    case graph_resource::type::graph_buffer:
+      add_buffer_dag_edges_(res.get_buffer()); continue;
+    default: continue;
+    }
+
+    graph_stage_ref last_writer = invalid_graph_ref;
+    VkImageLayout layout = VK_IMAGE_LAYOUT_MAX_ENUM;
+    dag_readers_.clear();
+
+    while (!node.is_invalid())
+    {
+      binding &b = get_binding_(node.stage, node.binding_idx);
+
+      bool present = (b.utype == binding::type::present_ready);
+
+      VkImageLayout next_layout = present ?
+        VK_IMAGE_LAYOUT_PRESENT_SRC_KHR : b.get_image_layout();
+      VkAccessFlags access = present ? 0 : b.get_image_access();
+
+      // Layout transitions count as writes
+      bool writes = is_write_access(access) ||
+        (layout != VK_IMAGE_LAYOUT_MAX_ENUM && layout != next_layout);
+      layout = next_layout;
+
+      if (last_writer != invalid_graph_ref)
+        add_dag_edge_(last_writer, node.stage);
+
+      if (writes)
+      {
+        for (auto reader : dag_readers_)
+          add_dag_edge_(reader, node.stage);
+
+        dag_readers_.clear();
+        last_writer = node.stage;
+      }
+      else
+      {
+        dag_readers_.push_back(node.stage);
+      }
+
+      node = b.next;
+    }
+  }
+
+  // Render passes with custom prepare commands may touch resources which the
+  // graph doesn't know about, so they are never moved around other stages.
+  graph_stage_ref last_fence = invalid_graph_ref;
+  for (u32 i = 0; i < stage_count; ++i)
+  {
+    if (last_fence != invalid_graph_ref)
+      add_dag_edge_(last_fence, i);
+
+    graph_pass &stg = recorded_stages_[i];
+    if (stg.get_type() == graph_pass::graph_render_pass &&
+        stg.get_render_pass().prepare_commands_proc_)
+    {
+      u32 first = (last_fence == invalid_graph_ref ? 0 : last_fence + 1);
+      for (u32 j = first; j < i; ++j)
+        add_dag_edge_(j, i);
+
+      last_fence = i;
+    }
+  }
+
+  // Edges always go forward in recording order, so processing them sorted by
+  // destination means the wave of the source is already final.
+  std::sort(dag_edges_.begin(), dag_edges_.end(),
+    [] (const dag_edge &a, const dag_edge &b) { return a.to < b.to; });
+
+  stage_waves_.assign(stage_count, 0);
+  u32 wave_count = (stage_count ? 1 : 0);
+
+  for (auto &e : dag_edges_)
+  {
+    stage_waves_[e.to] = glm::max(stage_waves_[e.to], stage_waves_[e.from] + 1);
+    wave_count = glm::max(wave_count, stage_waves_[e.to] + 1);
+  }
+
+  // Bucket the stages by wave (keeping recording order inside of a wave)
+  wave_offsets_.assign(wave_count + 1, 0);
+  for (u32 i = 0; i < stage_count; ++i)
+    ++wave_offsets_[stage_waves_[i] + 1];
+
+  for (u32 w = 0; w < wave_count; ++w)
+    wave_offsets_[w + 1] += wave_offsets_[w];
+
+  u32 *cursors = bump_mem_alloc<u32>(wave_count);
+  for (u32 w = 0; w < wave_count; ++w)
+    cursors[w] = wave_offsets_[w];
+
+  wave_order_.resize(stage_count);
+  for (u32 i = 0; i < stage_count; ++i)
+    wave_order_[cursors[stage_waves_[i]]++] = i;
+}
+
+u32 render_graph::add_submission_()
+{
+  u32 idx;
+
+  if (free_submissions_.size())
+  {
+    idx = free_submissions_.back();
+    free_submissions_.pop_back();
+  }
+  else
+  {
+    idx = submissions_.size();
+    submissions_.emplace_back();
+  }
+
+  submission &sub = submissions_[idx];
+  sub.queue_ = queue_graphics;
+  sub.timeline_value_ = 0;
+  sub.ref_count_ = 0;
+  sub.active_ = true;
+  sub.in_flight_ = false;
+
+  return idx;
+}
+
+void render_graph::release_submission_(u32 idx)
+{
+  submission &sub = submissions_[idx];
+
+  assert(sub.ref_count_ > 0);
+  if (--sub.ref_count_ == 0 && !sub.in_flight_)
+    free_submission_(sub, idx);
+}
+
+void render_graph::free_submission_(submission &sub, u32 idx)
+{
+  free_semaphores_.insert(free_semaphores_.end(), 
+    sub.semaphores_.begin(), sub.semaphores_.end());
+
+  sub.semaphores_.resize(0);
+  sub.active_ = false;
+
+  free_submissions_.push_back(idx);
+}
+
+void render_graph::submission_ring::push(u32 idx)
+{
+  if (count == slots.size())
+  {
+    // Unroll the ring into a bigger one
+    std::vector<u32> grown(std::max<size_t>(slots.size() * 2, 16));
+    for (u32 i = 0; i < count; ++i)
+      grown[i] = slots[(head + i) % slots.size()];
+
+    slots = std::move(grown);
+    head = 0;
+  }
+
+  slots[(head + count) % slots.size()] = idx;
+  ++count;
+}
+
+job render_graph::placeholder_job()
+{
+  job j = job(VK_NULL_HANDLE, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, this);
+  j.swapchain_semaphore_ = get_semaphore_();
+
+  // Never goes to a queue, so it's complete right away
+  u32 sub_idx = add_submission_();
+  submission &sub = submissions_[sub_idx];
+  sub.ref_count_ = 1;
+  sub.semaphores_.push_back(j.swapchain_semaphore_);
+
+  j.submission_idx_ = sub_idx;
+
+  return j;
+}
+
+void render_graph::retain_unsubmitted_(u64 record_id)
+{
+  auto found = unsubmitted_jobs_.find(record_id);
+  if (found != unsubmitted_jobs_.end())
+    ++found->second;
+}
+
+void render_graph::release_unsubmitted_(const job &j)
+{
+  // Copies made before the job got submitted don't count anymore
+  auto found = unsubmitted_jobs_.find(j.record_id_);
+  if (found == unsubmitted_jobs_.end())
+    return;
+
+  if (--found->second == 0)
+  {
+    unsubmitted_jobs_.erase(found);
+    drop_unsubmitted_job_(j);
+  }
+}
+
+void render_graph::drop_unsubmitted_job_(const job &j)
+{
+  // Nothing was executed, so everything can be reused right away
+  queue_type pool_type = get_queue_type(j.queue_family_);
+  free_cmdbufs_[pool_type].push_back(j.cmdbuf_);
+
+  auto continuations = job_continuations_.find(j.cmdbuf_);
+  if (continuations != job_continuations_.end())
+  {
+    free_cmdbufs_[pool_type].insert(free_cmdbufs_[pool_type].end(),
+      continuations->second.begin(), continuations->second.end());
+    job_continuations_.erase(continuations);
+  }
+
+  for (u32 q = 0; q < queue_type_count; ++q)
+  {
+    if (j.release_cmdbufs_[q] != VK_NULL_HANDLE)
+      free_cmdbufs_[q].push_back(j.release_cmdbufs_[q]);
+  }
+
+  auto events = job_events_.find(j.cmdbuf_);
+  if (events != job_events_.end())
+  {
+    free_events_.insert(free_events_.end(),
+      events->second.begin(), events->second.end());
+    job_events_.erase(events);
+  }
+
+  auto secondaries = job_secondaries_.find(j.cmdbuf_);
+  if (secondaries != job_secondaries_.end())
+  {
+    for (auto &secondary : secondaries->second)
+      workers_.free_secondary(secondary);
+
+    job_secondaries_.erase(secondaries);
+  }
+
+  // Otherwise the staging blocks would never get filled from the start again
+  auto staging = job_staging_.find(j.cmdbuf_);
+  if (staging != job_staging_.end())
+  {
+    release_staging_blocks_(staging->second);
+    job_staging_.erase(staging);
+  }
+
+  job_uses_.erase(j.cmdbuf_);
+}
+
+void render_graph::recycle_submissions_()
+{
+  for (u32 q = 0; q < queue_type_count; ++q)
+  {
+    submission_ring &ring = in_flight_[q];
+
+    while (ring.count)
+    {
+      u32 idx = ring.front();
+      submission &sub = submissions_[idx];
+
+      if (!is_timeline_complete_((queue_type)q, sub.timeline_value_))
+        break;
+
+      ring.pop();
+
+      // Recycle all the stuff
+      for (u32 t = 0; t < queue_type_count; ++t)
+      {
+        free_cmdbufs_[t].insert(free_cmdbufs_[t].end(), 
+          sub.cmdbufs_[t].begin(), sub.cmdbufs_[t].end());
+        sub.cmdbufs_[t].resize(0);
+      }
+
+      // Events don't get reset when they are used
+      for (auto event : sub.events_)
+      {
+        vkResetEvent(gctx->device, event);
+        free_events_.push_back(event);
+      }
+
+      for (auto &secondary : sub.secondaries_)
+        workers_.free_secondary(secondary);
+
+      release_staging_blocks_(sub.staging_blocks_);
+
+      sub.events_.resize(0);
+      sub.secondaries_.resize(0);
+      sub.staging_blocks_.resize(0);
+      sub.in_flight_ = false;
+
+      if (sub.ref_count_ == 0)
+        free_submission_(sub, idx);
+    }
+  }
+
+  free_retired_transients_();
+}
+
+bool render_graph::is_timeline_complete_(queue_type queue, u64 value)
+{
+  if (value <= completed_values_[queue])
+    return true;
+
+  vkGetSemaphoreCounterValue_proc(
+    gctx->device, timelines_[queue], &completed_values_[queue]);
+
+  return value <= completed_values_[queue];
+}
+
+void render_graph::wait_timeline_(queue_type queue, u64 value)
+{
+  if (value <= completed_values_[queue])
+    return;
+
+  ensure_flushed_(queue, value);
+
+  VkSemaphoreWaitInfo wait_info = {
+    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+    .semaphoreCount = 1,
+    .pSemaphores = &timelines_[queue],
+    .pValues = &value
+  };
+
+  vkWaitSemaphores_proc(gctx->device, &wait_info, UINT64_MAX);
+
+  completed_values_[queue] = std::max(completed_values_[queue], value);
+}
+
+VkSemaphore render_graph::get_semaphore_()
+{
+  if (free_semaphores_.empty())
+    recycle_submissions_();
+
+  if (free_semaphores_.size())
+  {
+    VkSemaphore ret = free_semaphores_.back();
+    free_semaphores_.pop_back();
+    return ret;
+  }
+  else
+  {
+    VkSemaphore semaphore;
+    VkSemaphoreCreateInfo semaphore_info = {};
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    vkCreateSemaphore(gctx->device, &semaphore_info, nullptr, &semaphore);
+
+    nz::log_info("Created semaphore");
+
+    return semaphore;
+  }
+}
+
+VkEvent render_graph::get_event_()
+{
+  if (free_events_.empty())
+    recycle_submissions_();
+
+  if (free_events_.size())
+  {
+    VkEvent ret = free_events_.back();
+    free_events_.pop_back();
+    return ret;
+  }
+  else
+  {
+    VkEvent event;
+    VkEventCreateInfo event_info = {};
+    event_info.sType = VK_STRUCTURE_TYPE_EVENT_CREATE_INFO;
+    vkCreateEvent(gctx->device, &event_info, nullptr, &event);
+
+    nz::log_info("Created event");
+
+    return event;
+  }
+}
+
+VkCommandBuffer render_graph::get_command_buffer_(s32 family)
+{
+  queue_type type = get_queue_type(family);
+  auto &free_cmdbufs = free_cmdbufs_[type];
+
+  if (free_cmdbufs.empty())
+    recycle_submissions_();
+
+  if (free_cmdbufs.size())
+  {
+    VkCommandBuffer ret = free_cmdbufs.back();
+    free_cmdbufs.pop_back();
+    return ret;
+  }
+  else
+  {
+    VkCommandBuffer command_buffer;
+    VkCommandBufferAllocateInfo command_buffer_info = {};
+    command_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    command_buffer_info.commandBufferCount = 1;
+    command_buffer_info.commandPool = get_command_pool(type);
+    command_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    vkAllocateCommandBuffers(
+      gctx->device, &command_buffer_info, &command_buffer);
+
+    nz::log_info("Created command buffer");
+
+    return command_buffer;
+  }
+}
+
+pending_workload render_graph::submit(job *jobs, int count,
+  job *dependencies, int dependency_count, latency_class cls)
+{
+  // All the jobs of a submission go to the same queue. Command buffers belong
+  // to the pool of the family, whichever queue of it they get submitted to.
+  s32 family = (count ? jobs[0].queue_family_ : gctx->graphics_family);
+  queue_type pool_type = get_queue_type(family);
+  queue_type type = get_queue_type(pool_type, cls);
+
+  // The timeline value signaled by the submission, plus the binary
+  // semaphores of jobs which get presented
+  u32 signal_count = 0;
+  VkCommandBuffer *jobs_raw = stack_alloc(VkCommandBuffer, count);
+  semaphore_op *signals = stack_alloc(semaphore_op, count + 1);
+  for (int i = 0; i < count; ++i)
   {
-    if (dependencies[i].submission_idx_ >= 0)
+    assert(jobs[i].queue_family_ == family);
+    jobs_raw[i] = jobs[i].cmdbuf_;
+
+    if (jobs[i].swapchain_semaphore_ != VK_NULL_HANDLE)
     {
-      submission &s = submissions_[dependencies[i].submission_idx_];
-      ++wait_count;
-      (wait_raw[i] = dependencies[i].finished_semaphore_), (end_stages[i] = dependencies[i].end_stage_);
+      signals[signal_count++] = { jobs[i].swapchain_semaphore_, 0,
+        VK_PIPELINE_STAGE_ALL_COMMANDS_BIT };
     }
   }
 
-  VkSubmitInfo info = {
-    .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-    .commandBufferCount = (uint32_t)count,
-    .pCommandBuffers = jobs_raw,
-    .waitSemaphoreCount = (uint32_t)wait_count,
-    .pWaitSemaphores = wait_raw,
-    .pWaitDstStageMask = end_stages,
-    .signalSemaphoreCount = (uint32_t)count,
-    .pSignalSemaphores = signal_raw
-  };
+  // Waits on timelines get merged per queue: the highest value and the
+  // stages which need it
+  u64 wait_values[queue_type_count] = {};
+  VkPipelineStageFlags wait_stages[queue_type_count] = {};
+
+  u32 wait_count = 0;
+  semaphore_op *waits = stack_alloc(semaphore_op, dependency_count + queue_type_count);
+
+  for (int i = 0; i < dependency_count; ++i)
+  {
+    job &dep = dependencies[i];
 
-  VkFence fence = get_fence_();
-  vkResetFences(gctx->device, 1, &fence);
+    if (dep.submission_idx_ < 0)
+      continue;
 
-  vkQueueSubmit(gctx->graphics_queue, 1, &info, fence);
+    // The end stage of a graphics job may not exist on the other queues
+    VkPipelineStageFlags stage = (family == gctx->graphics_family ?
+      dep.end_stage_ : VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
 
-  submission sub;
-  sub.fence_ = fence;
-  sub.semaphores_.resize(count);
-  sub.cmdbufs_.resize(count);
-  sub.ref_count_ = count + 1;
-  sub.active_ = true;
+    if (dep.timeline_value_)
+    {
+      queue_type dep_type = dep.queue_;
+      wait_values[dep_type] = std::max(wait_values[dep_type], dep.timeline_value_);
+      wait_stages[dep_type] |= stage;
+    }
+    else if (dep.swapchain_semaphore_ != VK_NULL_HANDLE)
+    {
+      // Swapchain image acquisition
+      waits[wait_count++] = { dep.swapchain_semaphore_, 0, stage };
+    }
+  }
+
+  // Dependencies on the other queues which come from the resources (the ones
+  // on the same queue are taken care of by the barriers)
+  for (int i = 0; i < count; ++i)
+  {
+    auto uses = job_uses_.find(jobs_raw[i]);
+    if (uses == job_uses_.end())
+      continue;
+
+    for (auto &use : uses->second)
+    {
+      submission_history *found = get_history_(use.rref);
+      if (!found)
+        continue;
+
+      submission_history &history = *found;
+
+      // A semaphore wait doesn't block anything at the top / bottom of pipe
+      VkPipelineStageFlags stages = use.stages;
+      if (stages & (VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT | VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT))
+        stages = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+
+      for (u32 q = 0; q < queue_type_count; ++q)
+      {
+        bool wrote = (history.write_value && history.write_queue == q);
+
+        if (q == type || !(wrote || history.read_values[q]))
+          continue;
+
+        // Also what the ownership release of the queue needs to block
+        wait_stages[q] |= stages;
+
+        // Reads only need to wait on writes, writes on everything
+        u64 value = (use.writes ? 
+          std::max(history.read_values[q], wrote ? history.write_value : 0) :
+          (wrote ? history.write_value : 0));
+
+        if (value > completed_values_[q])
+          wait_values[q] = std::max(wait_values[q], value);
+      }
+    }
+  }
+
+  // Resources the jobs take over from other queue families need to be
+  // released by those queues first
+  for (int i = 0; i < count; ++i)
+  {
+    for (u32 q = 0; q < queue_type_count; ++q)
+    {
+      VkCommandBuffer release = jobs[i].release_cmdbufs_[q];
+
+      if (release == VK_NULL_HANDLE)
+        continue;
+
+      semaphore_op released = { timelines_[q], ++timeline_values_[q],
+        VK_PIPELINE_STAGE_ALL_COMMANDS_BIT };
+
+      // The last uses may have been on the other queues of the family, which
+      // the release doesn't synchronize with by itself
+      u32 release_wait_count = 0;
+      semaphore_op *release_waits = stack_alloc(semaphore_op, queue_type_count);
+      for (u32 other = 0; other < queue_type_count; ++other)
+      {
+        if (other != q && wait_values[other] &&
+            get_queue_family((queue_type)other) == get_queue_family((queue_type)q))
+        {
+          release_waits[release_wait_count++] = { timelines_[other],
+            wait_values[other], VK_PIPELINE_STAGE_ALL_COMMANDS_BIT };
+        }
+      }
+
+      enqueue_submit_((queue_type)q, &release, 1,
+        release_waits, release_wait_count, &released, 1);
+
+      wait_values[q] = released.value;
+      if (!wait_stages[q])
+        wait_stages[q] = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+    }
+  }
+
+  for (u32 q = 0; q < queue_type_count; ++q)
+  {
+    if (wait_values[q])
+      waits[wait_count++] = { timelines_[q], wait_values[q], wait_stages[q] };
+  }
+
+  u64 value = ++timeline_values_[type];
+  signals[signal_count++] = { timelines_[type], value,
+    VK_PIPELINE_STAGE_ALL_COMMANDS_BIT };
+
+  // Jobs which continue in more command buffers (chunked dispatches) get
+  // split into one batch per command buffer, so that the GPU can switch to
+  // other queues in between. The batches run in order on the queue, so only
+  // the first needs to wait and only the last needs to signal.
+  u32 cmdbuf_count = count;
+  for (int i = 0; i < count; ++i)
+  {
+    auto continuations = job_continuations_.find(jobs_raw[i]);
+    if (continuations != job_continuations_.end())
+      cmdbuf_count += continuations->second.size();
+  }
 
+  VkCommandBuffer *cmdbufs = stack_alloc(VkCommandBuffer, cmdbuf_count);
+  u32 *batch_offsets = stack_alloc(u32, cmdbuf_count + 2);
+  u32 batch_count = 0, cmdbuf_idx = 0;
+
+  batch_offsets[batch_count++] = 0;
   for (int i = 0; i < count; ++i)
   {
-    sub.semaphores_[i] = signal_raw[i];
-    sub.cmdbufs_[i] = jobs_raw[i];
+    cmdbufs[cmdbuf_idx++] = jobs_raw[i];
+
+    auto continuations = job_continuations_.find(jobs_raw[i]);
+    if (continuations == job_continuations_.end())
+      continue;
+
+    for (VkCommandBuffer continuation : continuations->second)
+    {
+      batch_offsets[batch_count++] = cmdbuf_idx;
+      cmdbufs[cmdbuf_idx++] = continuation;
+    }
+  }
+  batch_offsets[batch_count] = cmdbuf_idx;
+
+  for (u32 b = 0; b < batch_count; ++b)
+  {
+    bool is_first = (b == 0), is_last = (b + 1 == batch_count);
+
+    enqueue_submit_(type, cmdbufs + batch_offsets[b],
+      batch_offsets[b + 1] - batch_offsets[b],
+      waits, (is_first ? wait_count : 0),
+      signals, (is_last ? signal_count : 0));
   }
 
-  u32 sub_idx = add_submission_(std::move(sub));
+  if (!is_submission_deferred_ || ++deferred_count_ >= max_deferred_submits)
+    flush();
+
+  // Reclaim whatever finished in the meantime
+  recycle_submissions_();
+
+  u32 sub_idx = add_submission_();
+  submission &sub = submissions_[sub_idx];
+  sub.queue_ = type;
+  sub.timeline_value_ = value;
+  sub.ref_count_ = count + 1;
+  sub.in_flight_ = true;
+  in_flight_[type].push(sub_idx);
+
+  for (int i = 0; i < count; ++i)
+  {
+    if (jobs[i].swapchain_semaphore_ != VK_NULL_HANDLE)
+      sub.semaphores_.push_back(jobs[i].swapchain_semaphore_);
+
+    // Command buffers of persistent jobs get released by the job itself
+    if (!jobs[i].persistent_)
+    {
+      sub.cmdbufs_[pool_type].push_back(jobs_raw[i]);
+
+      auto continuations = job_continuations_.find(jobs_raw[i]);
+      if (continuations != job_continuations_.end())
+      {
+        sub.cmdbufs_[pool_type].insert(sub.cmdbufs_[pool_type].end(),
+          continuations->second.begin(), continuations->second.end());
+        job_continuations_.erase(continuations);
+      }
+    }
+
+    // The releases were waited on by this submission, so they are done when
+    // its timeline value is reached
+    for (u32 q = 0; q < queue_type_count; ++q)
+    {
+      if (jobs[i].release_cmdbufs_[q] != VK_NULL_HANDLE)
+        sub.cmdbufs_[q].push_back(jobs[i].release_cmdbufs_[q]);
+    }
+
+    auto events = job_events_.find(jobs_raw[i]);
+    if (events != job_events_.end())
+    {
+      sub.events_.insert(sub.events_.end(),
+        events->second.begin(), events->second.end());
+      job_events_.erase(events);
+    }
+
+    auto secondaries = job_secondaries_.find(jobs_raw[i]);
+    if (secondaries != job_secondaries_.end())
+    {
+      sub.secondaries_.insert(sub.secondaries_.end(),
+        secondaries->second.begin(), secondaries->second.end());
+      job_secondaries_.erase(secondaries);
+    }
+
+    // Persistent jobs copy from their staging blocks every time they get
+    // submitted, so they only give them back when they get released
+    auto staging = job_staging_.find(jobs_raw[i]);
+    if (staging != job_staging_.end() && !jobs[i].persistent_)
+    {
+      sub.staging_blocks_.insert(sub.staging_blocks_.end(),
+        staging->second.begin(), staging->second.end());
+      job_staging_.erase(staging);
+    }
+
+    // Later submissions now depend on this one
+    auto uses = job_uses_.find(jobs_raw[i]);
+    if (uses != job_uses_.end())
+    {
+      for (auto &use : uses->second)
+      {
+        submission_history *history = get_history_(use.rref);
+        if (!history)
+          continue;
+
+        if (use.writes)
+          *history = { .write_queue = type, .write_value = value };
+        else
+          history->read_values[type] = value;
+      }
+
+      if (!jobs[i].persistent_)
+        job_uses_.erase(uses);
+    }
+  }
 
   for (int i = 0; i < count; ++i)
   {
     jobs[i].submission_idx_ = sub_idx;
-    jobs[i].fence_ = fence;
+    jobs[i].timeline_value_ = value;
+    jobs[i].queue_ = type;
+
+    // The submission owns what the job held on to now
+    unsubmitted_jobs_.erase(jobs[i].record_id_);
+    jobs[i].record_id_ = 0;
   }
 
   pending_workload ret;
   ret.builder_ = this;
-  ret.fence_ = fence;
+  ret.queue_ = type;
+  ret.timeline_value_ = value;
   ret.submission_idx_ = sub_idx;
 
   return ret;
 }
 
-pending_workload render_graph::placeholder_workload()
+pending_workload render_graph::submit(persistent_job *pjob,
+  job *dependencies, int dependency_count, latency_class cls)
 {
-  submission sub;
-  sub.fence_ = get_fence_();
-  sub.ref_count_ = 1;
-  sub.active_ = true;
+  assert(pjob->cmdbuf_ != VK_NULL_HANDLE);
+
+  // Goes through a regular job so that it gets tracked like one
+  job j(pjob->cmdbuf_, pjob->end_stage_, this);
+  j.persistent_ = true;
+
+  pjob->last_workload_ = submit(&j, 1, dependencies, dependency_count, cls);
+
+  // Values only grow on a timeline, so the last one covers the earlier ones
+  // on the same queue
+  pending_workload &w = pjob->last_workload_;
+  pjob->submitted_values_[w.queue_] = w.timeline_value_;
+
+  return pjob->last_workload_;
+}
+
+void render_graph::set_deferred_submission(bool enabled)
+{
+  if (!enabled)
+    flush();
+
+  is_submission_deferred_ = enabled;
+}
 
-  u32 sub_idx = add_submission_(sub);
+void render_graph::ensure_flushed_(queue_type queue, u64 value)
+{
+  if (value > flushed_values_[queue])
+    flush();
+}
+
+s32 render_graph::wait_any(
+  const pending_workload *workloads, u32 count, u64 timeout)
+{
+  // The earliest value of every queue is the first one to finish there
+  u64 values[queue_type_count] = {};
+
+  for (u32 i = 0; i < count; ++i)
+  {
+    const pending_workload &w = workloads[i];
+
+    if (!w.timeline_value_ || w.timeline_value_ <= completed_values_[w.queue_])
+      return i;
+
+    ensure_flushed_(w.queue_, w.timeline_value_);
+
+    u64 &value = values[w.queue_];
+    value = (value ? std::min(value, w.timeline_value_) : w.timeline_value_);
+  }
+
+  if (!wait_any_value_(values, timeout))
+    return -1;
+
+  for (u32 i = 0; i < count; ++i)
+  {
+    if (is_timeline_complete_(workloads[i].queue_, workloads[i].timeline_value_))
+      return i;
+  }
+
+  return -1;
+}
+
+bool render_graph::wait_any_value_(const u64 *values, u64 timeout)
+{
+  VkSemaphore semaphores[queue_type_count];
+  u64 wait_values[queue_type_count];
+  u32 semaphore_count = 0;
+
+  for (u32 q = 0; q < queue_type_count; ++q)
+  {
+    if (values[q])
+    {
+      semaphores[semaphore_count] = timelines_[q];
+      wait_values[semaphore_count++] = values[q];
+    }
+  }
+
+  if (!semaphore_count)
+    return false;
+
+  VkSemaphoreWaitInfo wait_info = {
+    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+    .flags = VK_SEMAPHORE_WAIT_ANY_BIT,
+    .semaphoreCount = semaphore_count,
+    .pSemaphores = semaphores,
+    .pValues = wait_values
+  };
+
+  return vkWaitSemaphores_proc(gctx->device, &wait_info, timeout) == VK_SUCCESS;
+}
+
+bool render_graph::wait_all(
+  const pending_workload *workloads, u32 count, u64 timeout)
+{
+  // Waiting on the last value of every queue covers the rest
+  u64 values[queue_type_count] = {};
+
+  for (u32 i = 0; i < count; ++i)
+  {
+    const pending_workload &w = workloads[i];
+
+    if (w.timeline_value_ > completed_values_[w.queue_])
+      values[w.queue_] = std::max(values[w.queue_], w.timeline_value_);
+  }
+
+  VkSemaphore semaphores[queue_type_count];
+  u32 semaphore_count = 0;
+
+  for (u32 q = 0; q < queue_type_count; ++q)
+  {
+    if (values[q])
+    {
+      ensure_flushed_((queue_type)q, values[q]);
+
+      semaphores[semaphore_count] = timelines_[q];
+      values[semaphore_count++] = values[q];
+    }
+  }
+
+  if (!semaphore_count)
+    return true;
+
+  VkSemaphoreWaitInfo wait_info = {
+    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+    .semaphoreCount = semaphore_count,
+    .pSemaphores = semaphores,
+    .pValues = values
+  };
+
+  return vkWaitSemaphores_proc(gctx->device, &wait_info, timeout) == VK_SUCCESS;
+}
+
+buffer_readback render_graph::readback(gpu_buffer_ref ref, range rng)
+{
+  gpu_buffer &buf = get_buffer_(ref);
+  assert(buf.host_visible_);
+
+  buffer_readback ret;
+  ret.builder_ = this;
+  ret.buffer_ = ref;
+  ret.range_ = rng;
+  ret.queue_ = buf.history_.write_queue;
+  ret.value_ = buf.history_.write_value;
+
+  return ret;
+}
+
+void render_graph::suspend_until_(
+  queue_type queue, u64 value, void *handle, void (*resume)(void *))
+{
+  // Nothing would ever resume it otherwise
+  ensure_flushed_(queue, value);
+
+  suspended_.push_back({ queue, value, handle, resume });
+}
+
+u32 render_graph::poll()
+{
+  std::vector<suspended_coroutine> ready;
+
+  for (u32 i = 0; i < suspended_.size();)
+  {
+    if (is_timeline_complete_(suspended_[i].queue, suspended_[i].value))
+    {
+      ready.push_back(suspended_[i]);
+      suspended_[i] = suspended_.back();
+      suspended_.pop_back();
+    }
+    else
+    {
+      ++i;
+    }
+  }
+
+  // Resumed coroutines may suspend again (or suspend others)
+  for (auto &co : ready)
+    co.resume(co.handle);
+
+  return ready.size();
+}
+
+void render_graph::run()
+{
+  while (suspended_.size())
+  {
+    if (poll())
+      continue;
+
+    // Sleep until the first awaited value of any queue is reached
+    u64 values[queue_type_count] = {};
+    for (auto &co : suspended_)
+    {
+      u64 &value = values[co.queue];
+      value = (value ? std::min(value, co.value) : co.value);
+    }
+
+    wait_any_value_(values, UINT64_MAX);
+  }
+}
+
+void render_graph::flush()
+{
+  // Batches may wait on timeline values of batches which go to another
+  // queue, which is fine as long as they all get flushed here
+  for (u32 q = 0; q < queue_type_count; ++q)
+  {
+    flush_queue_((queue_type)q);
+    flushed_values_[q] = timeline_values_[q];
+  }
+
+  deferred_count_ = 0;
+}
+
+void render_graph::enqueue_submit_(queue_type queue, 
+  const VkCommandBuffer *cmdbufs, int count,
+  const semaphore_op *waits, int wait_count,
+  const semaphore_op *signals, int signal_count)
+{
+  deferred_submits &deferred = deferred_[queue];
+
+  deferred.batches.push_back({
+    .cmdbuf_offset = (u32)deferred.cmdbufs.size(), .cmdbuf_count = (u32)count,
+    .wait_offset = (u32)deferred.waits.size(), .wait_count = (u32)wait_count,
+    .signal_offset = (u32)deferred.signals.size(), .signal_count = (u32)signal_count
+  });
+
+  deferred.cmdbufs.insert(deferred.cmdbufs.end(), cmdbufs, cmdbufs + count);
+  deferred.waits.insert(deferred.waits.end(), waits, waits + wait_count);
+  deferred.signals.insert(deferred.signals.end(), signals, signals + signal_count);
+}
+
+void render_graph::flush_queue_(queue_type queue)
+{
+  deferred_submits &deferred = deferred_[queue];
+
+  if (deferred.batches.empty())
+    return;
+
+  u32 batch_count = deferred.batches.size();
+  u32 cmdbuf_count = deferred.cmdbufs.size();
+  u32 wait_count = deferred.waits.size();
+  u32 signal_count = deferred.signals.size();
+
+  if (gctx->is_sync2_enabled)
+  {
+    auto *infos = stack_alloc(VkSubmitInfo2, batch_count);
+    auto *cmdbuf_infos = stack_alloc(VkCommandBufferSubmitInfo, cmdbuf_count);
+    auto *wait_infos = stack_alloc(VkSemaphoreSubmitInfo, wait_count);
+    auto *signal_infos = stack_alloc(VkSemaphoreSubmitInfo, signal_count);
+
+    for (u32 i = 0; i < cmdbuf_count; ++i)
+    {
+      cmdbuf_infos[i] = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+        .commandBuffer = deferred.cmdbufs[i]
+      };
+    }
+
+    for (u32 i = 0; i < wait_count; ++i)
+    {
+      wait_infos[i] = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+        .semaphore = deferred.waits[i].semaphore,
+        .value = deferred.waits[i].value,
+        .stageMask = deferred.waits[i].stage
+      };
+    }
+
+    for (u32 i = 0; i < signal_count; ++i)
+    {
+      signal_infos[i] = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+        .semaphore = deferred.signals[i].semaphore,
+        .value = deferred.signals[i].value,
+        .stageMask = deferred.signals[i].stage
+      };
+    }
+
+    for (u32 b = 0; b < batch_count; ++b)
+    {
+      auto &batch = deferred.batches[b];
+
+      infos[b] = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+        .waitSemaphoreInfoCount = batch.wait_count,
+        .pWaitSemaphoreInfos = wait_infos + batch.wait_offset,
+        .commandBufferInfoCount = batch.cmdbuf_count,
+        .pCommandBufferInfos = cmdbuf_infos + batch.cmdbuf_offset,
+        .signalSemaphoreInfoCount = batch.signal_count,
+        .pSignalSemaphoreInfos = signal_infos + batch.signal_offset
+      };
+    }
+
+    vkQueueSubmit2_proc(get_queue(queue), batch_count, infos, VK_NULL_HANDLE);
+  }
+  else
+  {
+    // Signals always happen once everything is done with the legacy path
+    auto *infos = stack_alloc(VkSubmitInfo, batch_count);
+    auto *timeline_infos = stack_alloc(VkTimelineSemaphoreSubmitInfo, batch_count);
+    auto *wait_raw = stack_alloc(VkSemaphore, wait_count);
+    auto *wait_values = stack_alloc(u64, wait_count);
+    auto *wait_stages = stack_alloc(VkPipelineStageFlags, wait_count);
+    auto *signal_raw = stack_alloc(VkSemaphore, signal_count);
+    auto *signal_values = stack_alloc(u64, signal_count);
+
+    for (u32 i = 0; i < wait_count; ++i)
+    {
+      wait_raw[i] = deferred.waits[i].semaphore;
+      wait_values[i] = deferred.waits[i].value;
+      wait_stages[i] = deferred.waits[i].stage;
+    }
+
+    for (u32 i = 0; i < signal_count; ++i)
+    {
+      signal_raw[i] = deferred.signals[i].semaphore;
+      signal_values[i] = deferred.signals[i].value;
+    }
+
+    for (u32 b = 0; b < batch_count; ++b)
+    {
+      auto &batch = deferred.batches[b];
+
+      timeline_infos[b] = {
+        .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+        .waitSemaphoreValueCount = batch.wait_count,
+        .pWaitSemaphoreValues = wait_values + batch.wait_offset,
+        .signalSemaphoreValueCount = batch.signal_count,
+        .pSignalSemaphoreValues = signal_values + batch.signal_offset
+      };
+
+      infos[b] = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .pNext = &timeline_infos[b],
+        .waitSemaphoreCount = batch.wait_count,
+        .pWaitSemaphores = wait_raw + batch.wait_offset,
+        .pWaitDstStageMask = wait_stages + batch.wait_offset,
+        .commandBufferCount = batch.cmdbuf_count,
+        .pCommandBuffers = deferred.cmdbufs.data() + batch.cmdbuf_offset,
+        .signalSemaphoreCount = batch.signal_count,
+        .pSignalSemaphores = signal_raw + batch.signal_offset
+      };
+    }
+
+    vkQueueSubmit(get_queue(queue), batch_count, infos, VK_NULL_HANDLE);
+  }
+
+  deferred.batches.resize(0);
+  deferred.cmdbufs.resize(0);
+  deferred.waits.resize(0);
+  deferred.signals.resize(0);
+}
+
+pending_workload render_graph::placeholder_workload()
+{
+  u32 sub_idx = add_submission_();
+  submissions_[sub_idx].ref_count_ = 1;
 
   pending_workload ret;
   ret.builder_ = this;
-  ret.fence_ = sub.fence_;
+  ret.queue_ = queue_graphics;
+  ret.timeline_value_ = 0;
 
   ret.submission_idx_ = sub_idx;
 
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <nezha/types.hpp>
+#include <nezha/gpu_image.hpp>
+#include <nezha/gpu_buffer.hpp>
+#include <vulkan/vulkan.h>
+
+#include <vector>
+
+namespace nz
+{
+
+
+/* Kind of hazard between the last access(es) made to a resource and the next
+ * one. Barriers only get issued when there is one. NONE means that the new
+ * access is a read which was already made visible by a previous barrier (same
+ * stage / access flags), or that the resource was never accessed. A read from a
+ * stage which previous readers didn't cover is classified as READ_AFTER_READ:
+ * it doesn't need to wait on anything but still needs an earlier write to be
+ * made visible to it. Image layout transitions count as writes. */
+enum class hazard
+{
+  none, read_after_read, read_after_write, write_after_read, write_after_write
+};
+
+hazard classify_hazard(
+  VkAccessFlags prev_access, VkPipelineStageFlags prev_stage,
+  VkAccessFlags next_access, VkPipelineStageFlags next_stage,
+  bool layout_transition = false);
+
+bool is_write_access(VkAccessFlags access);
+
+
+/* Counters which get reset at every BEGIN() of the graph. */
+struct barrier_stats
+{
+  u32 issued_barriers;
+  /* Accesses which followed another one without needing a barrier (first
+   * accesses to a resource don't count). */
+  u32 elided_barriers;
+  u32 pipeline_barrier_calls;
+
+  /* Barriers (included in ISSUED_BARRIERS) which waited on a VkEvent. */
+  u32 split_barriers;
+};
+
+
+/* Storage for the content of BARRIER_BATCHes so that they can be issued again
+ * without being planned (see the plan cache of RENDER_GRAPH). Events are saved
+ * as indices into the events of the job which get passed in when issuing. */
+struct saved_barrier_batches
+{
+  struct batch
+  {
+    u32 img_offset, img_count;
+    u32 buf_offset, buf_count;
+    u32 evt_img_offset, evt_img_count;
+    u32 evt_buf_offset, evt_buf_count;
+    u32 event_offset, event_count;
+  };
+
+  std::vector<batch> batches;
+  std::vector<VkImageMemoryBarrier2> img_barriers;
+  std::vector<VkBufferMemoryBarrier2> buf_barriers;
+  std::vector<VkImageMemoryBarrier2> evt_img_barriers;
+  std::vector<VkBufferMemoryBarrier2> evt_buf_barriers;
+  std::vector<u32> events;
+
+  void clear();
+};
+
+
+/* Queue family ownership transfers found while planning a job. The acquire
+ * half of every transfer goes into the barrier batches of the job, the release
+ * half gets collected here so that it can be recorded for the queue which used
+ * the resources before (see RENDER_GRAPH::SUBMIT()). */
+struct ownership_releases
+{
+  std::vector<VkImageMemoryBarrier2> img_barriers;
+  std::vector<VkBufferMemoryBarrier2> buf_barriers;
+
+  inline bool empty() const
+    { return img_barriers.empty() && buf_barriers.empty(); }
+
+  /* Whether any resource gets released by queue family FAMILY. */
+  bool has_family(s32 family) const;
+
+  void clear();
+
+  /* Issues the releases which have to happen on queue family FAMILY. */
+  void issue(VkCommandBuffer cmdbuf, s32 family);
+};
+
+
+/* BARRIER_BATCH collects all the image / buffer memory barriers that a single
+ * stage of the graph needs before it can execute, so that they can all be
+ * issued with one call to vkCmdPipelineBarrier. The source / destination
+ * stage masks of that call are the union of the stages of every barrier that
+ * was added. Storage comes from the bump allocator, so a batch only lives for
+ * the duration of the recording of the graph stage it was created for.
+ *
+ * If the device supports VK_KHR_synchronization2, the batch gets issued with
+ * vkCmdPipelineBarrier2 and every barrier keeps its own source / destination
+ * stages, so that unrelated barriers of a batch don't wait on each other.
+ *
+ * ADD_BUFFER / ADD_IMAGE look at the tracked state of the resource to figure
+ * out whether there is a hazard and only add a barrier if there is one. The
+ * tracked state of the resource gets updated either way.
+ *
+ * If the last user of the resource signaled an event right after it executed
+ * (see RENDER_GRAPH::SIGNAL_SPLIT_BARRIERS_()), the barrier waits on that event
+ * with vkCmdWaitEvents instead. This only makes the consumer wait on the work
+ * which came before the event, so stages recorded in between keep running.
+ *
+ * Once SET_QUEUE_FAMILY() was called, resources which were last used by
+ * another queue family get transferred to the family of the batch: the
+ * barrier becomes the acquire half of the transfer and the release half goes
+ * to the given OWNERSHIP_RELEASES. */
+class barrier_batch
+{
+public:
+  barrier_batch(
+    u32 max_image_barriers, u32 max_buffer_barriers,
+    barrier_stats *stats = nullptr);
+
+  /* Re-creates batch IDX of STORAGE. Nothing can be added to it. */
+  barrier_batch(
+    saved_barrier_batches &storage, u32 idx, const VkEvent *events,
+    barrier_stats *stats = nullptr);
+
+  /* Appends the content of the batch to STORAGE. EVENTS are all the events
+   * which were signaled by the job so far. Needs to happen before ISSUE(). */
+  void save(saved_barrier_batches &storage,
+    const std::vector<VkEvent> &events) const;
+
+  void add_buffer(gpu_buffer &buf,
+    VkAccessFlags access, VkPipelineStageFlags stage,
+    VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE);
+
+  void add_image(gpu_image &img, VkImageLayout layout,
+    VkAccessFlags access, VkPipelineStageFlags stage);
+
+  void set_queue_family(s32 family, ownership_releases *releases);
+
+  /* Issues all the collected barriers (if any) and empties the batch. */
+  void issue(VkCommandBuffer cmdbuf);
+
+  inline bool empty() const
+  {
+    return img_barrier_count_ == 0 && buf_barrier_count_ == 0 &&
+      evt_img_barrier_count_ == 0 && evt_buf_barrier_count_ == 0;
+  }
+
+private:
+  void push_(const VkImageMemoryBarrier2 &barrier, VkEvent event);
+  void push_(const VkBufferMemoryBarrier2 &barrier, VkEvent event);
+  void add_event_(VkEvent event);
+  void grow_buffer_barriers_();
+
+  void transfer_buffer_(gpu_buffer &buf,
+    VkAccessFlags access, VkPipelineStageFlags stage);
+  void transfer_image_(gpu_image &img, VkImageLayout layout,
+    VkAccessFlags access, VkPipelineStageFlags stage);
+
+  void issue_legacy_(VkCommandBuffer cmdbuf);
+  void issue_sync2_(VkCommandBuffer cmdbuf);
+  void issue_events_(VkCommandBuffer cmdbuf);
+
+private:
+  // Barriers are always stored with their own stage pairs (synchronization2
+  // layout). The legacy path merges the stages when issuing them.
+  VkImageMemoryBarrier2 *img_barriers_;
+  VkBufferMemoryBarrier2 *buf_barriers_;
+
+  u32 img_barrier_count_, max_img_barriers_;
+  u32 buf_barrier_count_, max_buf_barriers_;
+
+  // Barriers which wait on events (split barriers)
+  VkImageMemoryBarrier2 *evt_img_barriers_;
+  VkBufferMemoryBarrier2 *evt_buf_barriers_;
+  VkEvent *events_;
+
+  u32 evt_img_barrier_count_;
+  u32 evt_buf_barrier_count_;
+  u32 event_count_;
+
+  barrier_stats *stats_;
+
+  // -1 if ownership isn't tracked
+  s32 queue_family_;
+  ownership_releases *releases_;
+};
+
+
+}
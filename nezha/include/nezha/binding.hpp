@@ -34,6 +34,12 @@ struct resource_usage_node
   uint32_t binding_idx;
 };
 
+struct range
+{
+  uint32_t offset;
+  uint32_t size;
+};
+
 struct clear_color 
 {
   float r, g, b, a;
@@ -48,7 +54,8 @@ struct binding
     image_transfer_src, image_transfer_dst, present_ready, max_image,
 
     // Buffer types
-    storage_buffer, uniform_buffer, buffer_transfer_src,
+    storage_buffer, uniform_buffer, storage_buffer_readonly,
+    storage_buffer_writeonly, buffer_transfer_src,
     buffer_transfer_dst, vertex_buffer, max_buffer,
     none
   };
@@ -65,6 +72,10 @@ struct binding
   // Member is written to by the resource which is pointed to by the binding
   resource_usage_node next;
 
+  // For buffers: bytes which the stage accesses (a size of 0 means the whole
+  // buffer). This is only used for tracking hazards between stages.
+  range buffer_range;
+
   VkDescriptorType get_descriptor_type() 
   {
     switch (utype) 
@@ -72,6 +83,8 @@ struct binding
     case sampled_image: return VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
     case storage_image: return VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
     case storage_buffer: return VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    case storage_buffer_readonly: return VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    case storage_buffer_writeonly: return VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
     case uniform_buffer: return VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
     default: return VK_DESCRIPTOR_TYPE_MAX_ENUM;
     }
@@ -109,6 +122,10 @@ struct binding
       return VK_ACCESS_MEMORY_READ_BIT;
     case type::storage_buffer:
       return VK_ACCESS_MEMORY_WRITE_BIT | VK_ACCESS_MEMORY_READ_BIT;
+    case type::storage_buffer_readonly:
+      return VK_ACCESS_SHADER_READ_BIT;
+    case type::storage_buffer_writeonly:
+      return VK_ACCESS_SHADER_WRITE_BIT;
     case type::buffer_transfer_src:
       return VK_ACCESS_MEMORY_READ_BIT;
     case type::buffer_transfer_dst:
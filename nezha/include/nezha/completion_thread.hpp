@@ -0,0 +1,58 @@
+#pragma once
+
+#include <nezha/types.hpp>
+#include <vulkan/vulkan.h>
+
+#include <mutex>
+#include <vector>
+#include <thread>
+#include <functional>
+
+namespace nz
+{
+
+
+/* COMPLETION_THREAD calls callbacks from a background thread once timeline
+ * semaphores reach the values they were waiting for (see
+ * PENDING_WORKLOAD::ON_COMPLETE()). The thread sleeps in a single
+ * vkWaitSemaphores call on all of them, plus a semaphore the CPU signals to
+ * wake it up when callbacks get added. The thread only gets spawned when the
+ * first callback is added. Callbacks which didn't get called by the time the
+ * COMPLETION_THREAD is destroyed never will. */
+class completion_thread
+{
+public:
+  completion_thread();
+  ~completion_thread();
+
+  /* PROC gets called from the completion thread once SEMAPHORE reaches
+   * VALUE. */
+  void add(VkSemaphore semaphore, u64 value, std::function<void()> proc);
+
+private:
+  struct callback
+  {
+    VkSemaphore semaphore;
+    u64 value;
+    std::function<void()> proc;
+  };
+
+  void spawn_();
+  // Needs MUTEX_ to be locked
+  void wake_();
+  void loop_();
+
+private:
+  std::thread thread_;
+  std::mutex mutex_;
+
+  // Callbacks which the thread didn't pick up yet
+  std::vector<callback> added_;
+
+  VkSemaphore wake_semaphore_;
+  u64 wake_value_;
+  bool quit_;
+};
+
+
+}
@@ -52,6 +52,7 @@ struct compute_kernel_state
 
 
 class render_graph;
+class barrier_batch;
 
 
 /* Encapsulates a compute pass that will get executed on the GPU. Translates
@@ -72,8 +73,19 @@ public:
    * of used nodes that start with the resource itself. */
   compute_pass &add_sampled_image(gpu_image_ref);
   compute_pass &add_storage_image(gpu_image_ref, const image_info &i = {});
-  compute_pass &add_storage_buffer(gpu_image_ref);
-  compute_pass &add_uniform_buffer(gpu_image_ref);
+
+  /* Buffers can optionally be given the RANGE of bytes that the kernel
+   * accesses (the whole buffer is still bound). Passes which access disjoint
+   * ranges of the same buffer don't need barriers between them. */
+  compute_pass &add_storage_buffer(gpu_buffer_ref, const range &rng = {});
+  compute_pass &add_uniform_buffer(gpu_buffer_ref, const range &rng = {});
+
+  /* Storage buffers which the kernel only reads from / writes to. These allow
+   * the graph to skip barriers between passes which only read a buffer. */
+  compute_pass &add_storage_buffer_readonly(
+    gpu_buffer_ref, const range &rng = {});
+  compute_pass &add_storage_buffer_writeonly(
+    gpu_buffer_ref, const range &rng = {});
 
   /* Configures the dispatch with given dimensions */
   compute_pass &dispatch(uint32_t count_x, uint32_t count_y, uint32_t count_z);
@@ -82,6 +94,14 @@ public:
   compute_pass &dispatch_waves(
     uint32_t wave_x, uint32_t wave_y, uint32_t wave_z, gpu_image_ref);
 
+  /* Splits the dispatch into several dispatches of at most COUNT workgroups
+   * each (0 doesn't split). The kernel still sees the same global / workgroup
+   * IDs (they go through vkCmdDispatchBase). Every chunk after the first one
+   * continues the job in a new command buffer, and these get submitted as
+   * separate batches: long running dispatches then leave gaps where the GPU
+   * can run work from higher priority queues (see LATENCY_CLASS). */
+  compute_pass &set_max_workgroups_per_chunk(uint32_t count);
+
 public:
   compute_pass() = default;
   compute_pass(render_graph *, const uid_string &uid);
@@ -89,10 +109,27 @@ public:
 
 private:
   void reset_();
+  /* Shared by the ADD_STORAGE_BUFFER# functions. */
+  compute_pass &add_storage_buffer_(
+    gpu_buffer_ref ref, const range &rng, binding::type type);
   void create_(compute_kernel_state &);
   void create_compute_shader_(compute_kernel_state &);
   void create_ml_backend_(compute_kernel_state &);
-  void issue_commands_(VkCommandBuffer cmdbuf, compute_kernel_state &state);
+  /* Queues the barriers for all bindings. These need to be issued before
+   * ISSUE_COMMANDS_ gets called. */
+  void add_barriers_(barrier_batch &barriers);
+  /* Fills DST with the descriptor sets of all bindings, and GROUP_COUNT with
+   * the size of the dispatch. Both only change if the bindings do. */
+  void get_descriptor_sets_(VkDescriptorSet *dst);
+  void get_dispatch_size_(u32 group_count[3]);
+  void issue_commands_(VkCommandBuffer cmdbuf, compute_kernel_state &state,
+    const VkDescriptorSet *descriptor_sets, const u32 group_count[3]);
+  void bind_state_(VkCommandBuffer cmdbuf, compute_kernel_state &state,
+    const VkDescriptorSet *descriptor_sets);
+  /* Switches to a new command buffer before every chunk but the first (the
+   * bound state needs to be set again there). */
+  void issue_dispatch_chunks_(VkCommandBuffer cmdbuf, compute_kernel_state &state,
+    const VkDescriptorSet *descriptor_sets, const u32 group_count[3]);
 
 private:
   void *push_constant_;
@@ -110,6 +147,8 @@ private:
     bool is_waves;
   } dispatch_params_;
 
+  uint32_t max_workgroups_per_chunk_;
+
 private:
   uid_string uid_;
 
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <nezha/types.hpp>
+#include <vulkan/vulkan.h>
+
+#include <set>
+#include <vector>
+
+namespace nz
+{
+
+
+/* What the CPU does with the memory of a resource, which decides the memory
+ * type it goes to:
+ * - GPU_ONLY: nothing (device local memory).
+ * - CPU_TO_GPU: writes it for the GPU to read (uploads). Prefers coherent,
+ *   uncached memory: write combining is the fastest for that.
+ * - GPU_TO_CPU: reads what the GPU wrote (readbacks). Prefers cached memory,
+ *   since reading uncached memory from the CPU is very slow.
+ * - GPU_AND_CPU_BAR: small data which both access often. Prefers memory which
+ *   is both device local and host visible (the BAR, which can be small). */
+enum class memory_usage
+{
+  gpu_only, cpu_to_gpu, gpu_to_cpu, gpu_and_cpu_bar
+};
+
+
+/* Piece of device memory handed out by the GPU_ALLOCATOR. MAPPED points to
+ * the start of the allocation if the memory is host visible (blocks stay
+ * mapped for as long as they live), nullptr otherwise. Mapped memory which
+ * isn't coherent needs GPU_ALLOCATOR::FLUSH() / INVALIDATE(). */
+struct gpu_allocation
+{
+  VkDeviceMemory memory;
+  VkDeviceSize offset;
+  VkDeviceSize size;
+  void *mapped;
+  bool is_coherent;
+
+  /* For internal use: where the allocation came from (BLOCK is -1 for
+   * allocations which got their own VkDeviceMemory). */
+  u32 pool;
+  s32 block;
+  u32 order;
+};
+
+
+struct gpu_memory_stats
+{
+  /* Blocks which got sub-allocated from, and allocations which were too big
+   * for them and got their own VkDeviceMemory. */
+  u32 block_count;
+  u32 dedicated_count;
+  u32 allocation_count;
+
+  /* Bytes allocated from the driver, and bytes requested by resources. */
+  VkDeviceSize bytes_reserved;
+  VkDeviceSize bytes_in_use;
+
+  /* Biggest allocation which fits in the current blocks. FRAGMENTATION is 0 if
+   * the free memory is all in ranges of that size, and goes towards 1 the
+   * more it is scattered in smaller ranges. */
+  VkDeviceSize largest_free_range;
+  f32 fragmentation;
+};
+
+
+/* GPU_ALLOCATOR sub-allocates resources from large blocks of device memory,
+ * instead of calling vkAllocateMemory for every resource (which is slow and
+ * runs into maxMemoryAllocationCount). Blocks get split with a buddy
+ * allocator: ranges have power of two sizes and are aligned to their size,
+ * which takes care of the alignment requirements. Buffers and images come
+ * from different pools so that bufferImageGranularity never matters. */
+class gpu_allocator
+{
+public:
+  gpu_allocator();
+  ~gpu_allocator();
+
+  /* LINEAR is set for buffers (and linear images), and not for images with
+   * optimal tiling. */
+  gpu_allocation allocate(const VkMemoryRequirements &requirements,
+    memory_usage usage, bool linear);
+
+  void free(const gpu_allocation &allocation);
+
+  /* Make CPU writes to the mapped memory visible to the GPU, or GPU writes
+   * visible to the CPU, for SIZE bytes at OFFSET into the allocation. They do
+   * nothing for coherent memory. */
+  void flush(const gpu_allocation &allocation,
+    VkDeviceSize offset, VkDeviceSize size);
+  void invalidate(const gpu_allocation &allocation,
+    VkDeviceSize offset, VkDeviceSize size);
+
+  gpu_memory_stats get_stats() const;
+
+private:
+  struct block
+  {
+    VkDeviceMemory memory;
+    u8 *mapped;
+
+    /* Offsets of the free ranges of each order (the size of a range of order
+     * N is MIN_SIZE << N). */
+    std::vector<std::set<VkDeviceSize>> free_ranges;
+
+    u32 allocation_count;
+  };
+
+  struct pool
+  {
+    u32 memory_type;
+    bool linear;
+    std::vector<block> blocks;
+  };
+
+  u32 get_pool_(u32 memory_type, bool linear);
+  /* Returns the index of a block which has a free range of ORDER. */
+  s32 get_block_(pool &p, u32 order);
+  VkDeviceSize split_(block &b, u32 order);
+  void merge_(block &b, VkDeviceSize offset, u32 order);
+
+  VkDeviceMemory allocate_memory_(
+    u32 memory_type, VkDeviceSize size, void **mapped);
+
+  /* Range covering the bytes, rounded out to nonCoherentAtomSize. */
+  VkMappedMemoryRange get_mapped_range_(const gpu_allocation &allocation,
+    VkDeviceSize offset, VkDeviceSize size);
+
+private:
+  static constexpr VkDeviceSize min_size = 256;
+  static constexpr u32 order_count = 19;
+  static constexpr VkDeviceSize block_size = min_size << (order_count - 1);
+
+  VkDeviceSize non_coherent_atom_size_;
+
+  std::vector<pool> pools_;
+
+  u32 dedicated_count_;
+  VkDeviceSize dedicated_bytes_;
+
+  u32 allocation_count_;
+  VkDeviceSize bytes_in_use_;
+};
+
+
+}
@@ -2,6 +2,10 @@
 
 #include <nezha/types.hpp>
 #include <nezha/binding.hpp>
+#include <nezha/queue_type.hpp>
+#include <nezha/gpu_allocator.hpp>
+
+#include <vector>
 
 namespace nz
 {
@@ -26,6 +30,13 @@ struct buffer_info
   binding::type type = binding::type::max_buffer;
   bool host_visible = false;
 
+  /* Which memory type the buffer goes to. Anything but GPU_ONLY makes the
+   * buffer host visible, and HOST_VISIBLE alone means CPU_TO_GPU. */
+  memory_usage memory = memory_usage::gpu_only;
+
+  /* Same as IMAGE_INFO::TRANSIENT (can't be host visible). */
+  bool transient = false;
+
   /* For ML. */
   bool ml_accelerate = false;
   uint32_t rows;
@@ -33,6 +44,21 @@ struct buffer_info
 };
 
 
+/* Typed view into the mapped memory of a host visible buffer (see
+ * GPU_BUFFER::VIEW()). */
+template <typename T>
+struct buffer_view
+{
+  T *data;
+  size_t count;
+
+  inline T &operator[](size_t i) { return data[i]; }
+  inline T *begin() { return data; }
+  inline T *end() { return data + count; }
+  inline size_t size() const { return count; }
+};
+
+
 /* MEMORY_MAPPING allows the user to have a CPU-side view of the bytes inside
  * a buffer (TODO: or image). To use, make sure that the GPU_BUFFER is
  * HOST_VISIBLE. Then call the MAP function of GPU_BUFFER/GPU_IMAGE. */
@@ -46,14 +72,14 @@ public:
   size_t size();
 
 public:
-  /* RAII style unmapping of memory happens when object gets destroyed. */
+  /* Host visible memory stays mapped (see GPU_ALLOCATOR), so this doesn't
+   * unmap anything. */
   ~memory_mapping();
 
 private:
-  memory_mapping(VkDeviceMemory memory, size_t size);
+  memory_mapping(void *data, size_t size);
 
 private:
-  VkDeviceMemory memory_;
   void *data_;
   size_t size_;
 
@@ -82,6 +108,19 @@ public:
   /* Mapping memory. */
   memory_mapping map();
 
+  /* Host visible buffers stay mapped, so this is just a pointer into the
+   * mapping: no vkMapMemory / vkUnmapMemory involved. */
+  template <typename T>
+  inline buffer_view<T> view()
+    { return { (T *)get_mapped_(), size_ / sizeof(T) }; }
+
+  /* Host visible memory may not be coherent. FLUSH() makes what the CPU wrote
+   * to RNG visible to the GPU (before submitting the jobs which read it), and
+   * INVALIDATE() makes what the GPU wrote visible to the CPU (once the job
+   * which wrote it finished). Both do nothing for coherent memory. */
+  void flush(const range &rng = {});
+  void invalidate(const range &rng = {});
+
 public:
   /* For internal use. */
   inline VkBuffer buffer() { return buffer_; }
@@ -91,11 +130,37 @@ private:
   void update_action_(const binding &b);
   void apply_action_();
 
+  /* Creates the buffer as host visible if it wasn't yet. */
+  void *get_mapped_();
+
+  /* ALLOC() without the memory (see GPU_IMAGE::CREATE_IMAGE_()). */
+  void create_buffer_();
+
   void add_usage_node_(graph_stage_ref stg, uint32_t binding_idx);
 
   VkDescriptorSet get_descriptor_set_(binding::type utype);
   void create_descriptors_(VkBufferUsageFlags usage);
 
+  /* Access state of a range of bytes of the buffer. */
+  struct range_state
+  {
+    VkDeviceSize begin, end;
+    VkAccessFlags access;
+    VkPipelineStageFlags stage;
+  };
+
+  std::vector<range_state> &get_range_states_();
+  /* Makes sure BEGIN and END fall on range boundaries. Returns the index of
+   * the first range inside [BEGIN, END). */
+  u32 split_range_states_(VkDeviceSize begin, VkDeviceSize end);
+  /* Merges neighbouring ranges which ended up with the same state. */
+  void merge_range_states_();
+  /* Union of the states of all the ranges overlapping [BEGIN, END). */
+  range_state get_range_state_(VkDeviceSize begin, VkDeviceSize end);
+  /* End of the bytes accessed by a binding of this buffer. */
+  inline VkDeviceSize get_range_end_(const range &rng)
+    { return rng.size ? (VkDeviceSize)rng.offset + rng.size : size_; }
+
 private:
   resource_usage_node head_node_;
   resource_usage_node tail_node_;
@@ -105,7 +170,7 @@ private:
   render_graph *builder_;
 
   VkBuffer buffer_;
-  VkDeviceMemory buffer_memory_;
+  gpu_allocation buffer_memory_;
 
   u32 size_;
 
@@ -114,12 +179,33 @@ private:
   VkDescriptorSet descriptor_sets_[
     binding::type::max_buffer - binding::type::max_image];
 
-  VkAccessFlags current_access_;
-  VkPipelineStageFlags last_used_;
+  /* Sorted by offset, the ranges don't overlap and cover the whole buffer so
+   * that stages accessing disjoint parts of the buffer don't wait on each
+   * other. Empty until the state of the buffer is first needed. */
+  std::vector<range_state> range_states_;
+
+  /* Set if the last user signaled an event for a split barrier. */
+  VkEvent pending_event_;
+  VkPipelineStageFlags pending_event_stage_;
+
+  /* Queue family which used the resource last (-1 if none). */
+  s32 owner_family_;
+
+  /* Stages which the job being recorded uses the resource from, and whether
+   * it writes to it. They get collected (and reset) by RENDER_GRAPH::END(). */
+  VkPipelineStageFlags job_stages_;
+  bool job_writes_;
+
+  submission_history history_;
+
+  /* See GPU_IMAGE::TRANSIENT_SLOT_. */
+  bool transient_;
+  s32 transient_slot_;
 
   acc_matrix_descriptor *acc_desc_;
 
   bool host_visible_;
+  memory_usage memory_usage_;
 
   friend class render_graph;
   friend class compute_pass;
@@ -127,5 +213,6 @@ private:
   friend class graph_resource;
   friend class transfer_operation;
   friend class graph_resource_tracker;
+  friend class barrier_batch;
 };
 }
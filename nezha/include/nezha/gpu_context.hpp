@@ -4,6 +4,8 @@
 #include <nezha/types.hpp>
 #include <nezha/surface.hpp>
 #include <nezha/heap_array.hpp>
+#include <nezha/queue_type.hpp>
+#include <nezha/gpu_allocator.hpp>
 #include <nezha/descriptor_helper.hpp>
 
 #include <GLFW/glfw3.h>
@@ -20,9 +22,12 @@ extern struct gpu_context
 {
   // Various flags
   u32 is_validation_enabled : 1;
+  // Set if vkCmdPipelineBarrier2 / vkQueueSubmit2 can be used
+  u32 is_sync2_enabled : 1;
 
   // Instance
   VkInstance instance;
+  u32 api_version;
   heap_array<const char *> layers;
 
   // Device
@@ -30,7 +35,17 @@ extern struct gpu_context
   VkDevice device;
   s32 graphics_family, present_family;
   VkQueue graphics_queue, present_queue;
+  // Same as the graphics family / queue if there is no compute-only family
+  s32 compute_family;
+  VkQueue compute_queue;
+  // Same as the compute family / queue if there is no transfer-only family
+  s32 transfer_family;
+  VkQueue transfer_queue;
+  // Low priority queues for batch jobs (same as the above if the family
+  // only has one queue)
+  VkQueue graphics_batch_queue, compute_batch_queue, transfer_batch_queue;
   VkFormat depth_format;
+  VkPhysicalDeviceMemoryProperties memory_properties;
 
 #if 0
   // Window / Surface
@@ -48,7 +63,10 @@ extern struct gpu_context
   VkDebugUtilsMessengerEXT messenger;
 
   // Other shit
+  gpu_allocator *allocator;
   VkCommandPool command_pool;
+  VkCommandPool compute_command_pool;
+  VkCommandPool transfer_command_pool;
   VkDescriptorPool descriptor_pool;
   descriptor_set_layout_category layout_categories[
     descriptor_set_layout_category::category_count];
@@ -77,6 +95,12 @@ void present_swapchain_image(VkSemaphore to_wait, u32 image_idx);
 VkDescriptorSetLayout get_descriptor_set_layout(
   VkDescriptorType type, u32 count);
 
+// Helpers for queues. Families which alias each other map to the first type
+queue_type get_queue_type(s32 family);
+s32 get_queue_family(queue_type type);
+VkQueue get_queue(queue_type type);
+VkCommandPool get_command_pool(queue_type type);
+
 // Helpers for synchronization
 VkAccessFlags find_access_flags_for_stage(VkPipelineStageFlags stage);
 VkAccessFlags find_access_flags_for_layout(VkImageLayout layout);
@@ -84,10 +108,16 @@ VkAccessFlags find_access_flags_for_layout(VkImageLayout layout);
 // Helpers for memory management
 u32 find_memory_type(
   VkMemoryPropertyFlags properties, VkMemoryRequirements &memory_requirements);
-VkDeviceMemory allocate_buffer_memory(
-  VkBuffer buffer, VkMemoryPropertyFlags properties);
-VkDeviceMemory allocate_image_memory(
-  VkImage image, VkMemoryPropertyFlags properties, u32 *size);
+// Best scoring type for USAGE (see MEMORY_USAGE)
+u32 find_memory_type(
+  memory_usage usage, const VkMemoryRequirements &memory_requirements);
+// These sub-allocate from the blocks of GCTX->ALLOCATOR
+gpu_allocation allocate_buffer_memory(
+  VkBuffer buffer, memory_usage usage);
+gpu_allocation allocate_image_memory(
+  VkImage image, memory_usage usage, u32 *size);
+void free_memory(const gpu_allocation &allocation);
+gpu_memory_stats get_memory_stats();
 
 extern PFN_vkDebugMarkerSetObjectTagEXT vkDebugMarkerSetObjectTag;
 extern PFN_vkDebugMarkerSetObjectNameEXT vkDebugMarkerSetObjectName;
@@ -96,5 +126,10 @@ extern PFN_vkCmdDebugMarkerEndEXT vkCmdDebugMarkerEnd;
 extern PFN_vkCmdDebugMarkerInsertEXT vkCmdDebugMarkerInsert;
 extern PFN_vkCmdBeginRenderingKHR vkCmdBeginRenderingKHR_proc;
 extern PFN_vkCmdEndRenderingKHR vkCmdEndRenderingKHR_proc;
+extern PFN_vkCmdPipelineBarrier2KHR vkCmdPipelineBarrier2_proc;
+extern PFN_vkQueueSubmit2KHR vkQueueSubmit2_proc;
+extern PFN_vkWaitSemaphoresKHR vkWaitSemaphores_proc;
+extern PFN_vkGetSemaphoreCounterValueKHR vkGetSemaphoreCounterValue_proc;
+extern PFN_vkSignalSemaphoreKHR vkSignalSemaphore_proc;
 
 }
@@ -2,6 +2,8 @@
 
 #include <nezha/types.hpp>
 #include <nezha/binding.hpp>
+#include <nezha/queue_type.hpp>
+#include <nezha/gpu_allocator.hpp>
 #include <nezha/string.hpp>
 
 #include <vector>
@@ -25,6 +27,12 @@ struct image_info
   /* Default values */
   bool is_depth = false;
   u32 layer_count = 1;
+
+  /* Transient images are only used inside of the job which uses them first,
+   * and their contents don't survive from one job to the next. They share
+   * memory with the other transient resources of that job which are used at
+   * different times (see RENDER_GRAPH::END()). */
+  bool transient = false;
 };
 
   
@@ -51,6 +59,11 @@ private:
 
   void apply_action_();
 
+  /* ALLOC() without the memory, for images which get bound to memory by the
+   * graph (transient images). */
+  void create_image_();
+  void create_view_();
+
   /* Create descriptors given a usage flag (if the descriptors were already 
    * created, don't do anything for that kind of descriptor). */
   void create_descriptors_(VkImageUsageFlags usage);
@@ -74,7 +87,7 @@ private:
 
   VkImage image_;
   VkImageView image_view_;
-  VkDeviceMemory image_memory_;
+  gpu_allocation image_memory_;
   VkExtent3D extent_;
   VkImageAspectFlags aspect_;
   VkFormat format_;
@@ -86,11 +99,31 @@ private:
   VkAccessFlags current_access_;
   VkPipelineStageFlags last_used_;
 
+  /* Set if the last user signaled an event for a split barrier. */
+  VkEvent pending_event_;
+  VkPipelineStageFlags pending_event_stage_;
+
+  /* Queue family which used the resource last (-1 if none). */
+  s32 owner_family_;
+
+  /* Stages which the job being recorded uses the resource from, and whether
+   * it writes to it. They get collected (and reset) by RENDER_GRAPH::END(). */
+  VkPipelineStageFlags job_stages_;
+  bool job_writes_;
+
+  submission_history history_;
+
+  /* See IMAGE_INFO::TRANSIENT. TRANSIENT_SLOT_ is the memory the graph bound
+   * the image to (-1 until it gets created). */
+  bool transient_;
+  s32 transient_slot_;
+
   friend class render_graph;
   friend class compute_pass;
   friend class render_pass;
   friend class graph_resource;
   friend class transfer_operation;
+  friend class barrier_batch;
 };
 
 }
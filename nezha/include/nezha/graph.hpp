@@ -5,20 +5,76 @@
 #include <nezha/types.hpp>
 #include <nezha/surface.hpp>
 #include <nezha/binding.hpp>
+#include <nezha/barrier.hpp>
 #include <nezha/resource.hpp>
 #include <nezha/transfer.hpp>
 #include <nezha/gpu_image.hpp>
 #include <nezha/gpu_buffer.hpp>
 #include <nezha/render_pass.hpp>
+#include <nezha/worker_pool.hpp>
 #include <nezha/compute_pass.hpp>
+#include <nezha/completion_thread.hpp>
 #include <nezha/dynamic_array.hpp>
 
-#include <set>
+#include <deque>
+#include <unordered_map>
 
 namespace nz
 {
 
 
+/* BUFFER_READBACK comes from RENDER_GRAPH::READBACK(). It's meant to be
+ * CO_AWAIT-ed on from a C++20 coroutine, which gets resumed by
+ * RENDER_GRAPH::POLL() / RUN() with the bytes once the data is there. */
+class buffer_readback
+{
+public:
+  bool await_ready();
+
+  template <typename Handle>
+  void await_suspend(Handle handle);
+
+  std::vector<u8> await_resume();
+
+private:
+  render_graph *builder_;
+  gpu_buffer_ref buffer_;
+  range range_;
+  queue_type queue_;
+  u64 value_;
+
+  friend class render_graph;
+};
+
+
+/* Controls how END() turns the recorded stages into a JOB. By default
+ * (IN_ORDER), stages are executed in the order in which they were recorded.
+ * With DEPENDENCY_WAVES, END() builds a dependency DAG out of the usage chains
+ * of every resource and groups stages which don't depend on each other into
+ * waves. Each wave is preceded by a single barrier, so that independent stages
+ * (e.g. branches of a network which got recorded one after the other) can
+ * overlap on the GPU. Render passes with PREPARE_COMMANDS() are never moved
+ * around since the graph can't know which resources they touch. */
+enum class graph_compile_mode
+{
+  in_order, dependency_waves
+};
+
+
+/* END() remembers what it planned for a recorded frame: the order of the
+ * stages, the barriers, descriptor sets and dispatch sizes. If a later frame
+ * records the same stages with the same bindings while the resources are in
+ * the same state, that plan gets reused and only the command buffer is
+ * recorded again. Frames with render passes which have PREPARE_COMMANDS() are
+ * never cached (they always count as a miss). When the cache is full, the
+ * least recently used plan gets dropped. */
+struct plan_cache_stats
+{
+  u32 hits;
+  u32 misses;
+};
+
+
 /* RENDER_GRAPH is the main class through which everything goes through. This is 
  * responsible for managing GPU resources, as well as recording commands into the 
  * computation graph.
@@ -55,11 +111,23 @@ public:
   gpu_image  &get_image(gpu_image_ref);
 
 
+  /* Barrier counters of the last recorded JOB (reset every BEGIN()). */
+  inline const barrier_stats &get_barrier_stats() const 
+    { return barrier_stats_; }
+
+
+  /* Counters of the plan cache. These never get reset. */
+  inline const plan_cache_stats &get_plan_cache_stats() const 
+    { return plan_cache_stats_; }
+
+
   /* ADD_# functions. These add stages into the computation graph. Must be called
-   * after BEGIN() and before END(). */
+   * after BEGIN() and before END(). ADD_BUFFER_UPDATE() copies the data right
+   * away (to a staging buffer the job copies from), so it doesn't need to stay
+   * around and there is no limit on its size. */
   render_pass  &add_render_pass();
   compute_pass &add_compute_pass();
-  void          add_buffer_update(gpu_buffer_ref, void *data, u32 offset = 0, u32 size = 0);
+  void          add_buffer_update(gpu_buffer_ref, const void *data, u32 offset = 0, u32 size = 0);
   void          add_buffer_copy_to_cpu(gpu_buffer_ref dst, gpu_buffer_ref src, u32 dst_offset, const range &src_rng);
   void          add_buffer_copy(gpu_buffer_ref dst, gpu_buffer_ref src, u32 dst_offset, const range &src_rng);
   void          add_image_blit(gpu_image_ref src, gpu_image_ref dst);
@@ -70,23 +138,133 @@ public:
   void begin();
 
 
-  /* END() funciton. This stops recording and gives you a JOB which is ready for SUBMIT(). */
+  /* SET_COMPILE_MODE() function. See GRAPH_COMPILE_MODE. */
+  void set_compile_mode(graph_compile_mode mode);
+
+
+  /* SET_RECORDING_THREADS() function. Big jobs (at least MIN_PARALLEL_STAGES
+   * stages) get split into chunks after the barriers were planned, and the
+   * chunks get recorded into secondary command buffers on THREAD_COUNT threads
+   * (including the one calling END()). Chunks with render passes are always
+   * recorded by the thread calling END() since they call back into user code.
+   * 1 records everything into the primary command buffer. Defaults to the
+   * number of cores (up to 8). */
+  void set_recording_threads(u32 thread_count);
+
+
+  /* SET_ASYNC_COMPUTE() function. If the GPU has a queue family which can do
+   * compute but not graphics, jobs which only contain compute passes and
+   * buffer transfers get recorded for it and submitted to its queue, so they
+   * can overlap with the graphics work. Resources used by both queues get
+   * transferred between the queue families automatically (the release is
+   * submitted to the queue which used the resource last, right before the
+   * job which takes it over). Enabled by default. Persistent jobs always go
+   * to the graphics queue and their resources shouldn't be shared with async
+   * compute jobs. */
+  void set_async_compute(bool enabled);
+
+
+  /* SET_ASYNC_TRANSFER() function. Same as SET_ASYNC_COMPUTE() for jobs which
+   * only contain buffer transfers (ADD_BUFFER_UPDATE(), ADD_BUFFER_COPY() and
+   * ADD_BUFFER_COPY_TO_CPU()): if the GPU has a transfer-only queue family,
+   * they go to its queue. Recording uploads into their own job lets them
+   * overlap with the compute jobs, which wait on them through the ownership
+   * transfers of the buffers. Since the transfer job has to wait on the last
+   * job which used the buffer, uploads only overlap with the computation of
+   * the previous batch if they go to a different buffer (double buffering).
+   * Enabled by default. */
+  void set_async_transfer(bool enabled);
+
+
+  /* END() funciton. This stops recording and gives you a JOB which is ready for SUBMIT().
+   *
+   * Transient resources (see IMAGE_INFO::TRANSIENT) which get created by the
+   * job share memory if their lifetimes (from their first to their last use
+   * in the order the stages get executed) don't overlap. A chain of layers
+   * then only needs as much memory as the widest few layers. */
   job end();
   job placeholder_job();
 
 
+  /* END_PERSISTENT() function. Like END() but the command buffer is kept, so
+   * the returned PERSISTENT_JOB can be submitted again and again without
+   * recording anything. PARAMETERS (optional) is a buffer bound to the passes
+   * like any other buffer, which gets made host visible so that it can be
+   * updated between submissions with PERSISTENT_JOB::SET_PARAMETERS(). If an
+   * earlier job already allocated it in device local memory, that's an error
+   * (configure it with HOST_VISIBLE when registering it instead). 
+   * Persistent jobs don't use split barriers, and images which were undefined
+   * before the job don't keep their contents from one submission to the next. */
+  persistent_job end_persistent(gpu_buffer_ref parameters = invalid_graph_ref);
+
+
   /* SUBMIT() function(s). This submits a JOB which may have other JOB dependencies.
    * The GRAPH will make sure to schedule all the JOBs appropriately taking into
    * account dependencies. We provide helper overloads of the SUBMIT() function
    * for convenience sake. The final overload which takes pointers, is the most
-   * fundamental and is the one that the other ones call.*/
+   * fundamental and is the one that the other ones call.
+   *
+   * Dependencies on the jobs which last wrote (or read, if the job writes) the
+   * resources used by the job get inferred: the job waits on the queues those
+   * went to, and only from the stages which use the resources. Jobs on the
+   * same queue are ordered by the barriers. Explicit dependencies are only
+   * needed for the job of SURFACE::ACQUIRE_NEXT_SWAPCHAIN_IMAGE(), or for
+   * jobs which communicate through something the graph doesn't know about.
+   *
+   * The LATENCY_CLASS picks between the normal and the low priority queue of
+   * the family the jobs were recorded for (see LATENCY_CLASS). */
   template <typename ...T>
   inline pending_workload submit(job &job, T &&...dependencies);
   inline pending_workload submit(job &job);
-  pending_workload        submit(job *jobs, int count, job *dependencies, int dependency_count);
+  template <typename ...T>
+  inline pending_workload submit(latency_class cls, job &job, T &&...dependencies);
+  inline pending_workload submit(latency_class cls, job &job);
+  pending_workload        submit(job *jobs, int count, job *dependencies, int dependency_count,
+                                 latency_class cls = latency_class::interactive);
+
+  template <typename ...T>
+  inline pending_workload submit(persistent_job &pjob, T &&...dependencies);
+  inline pending_workload submit(persistent_job &pjob);
+  pending_workload        submit(persistent_job *pjob, job *dependencies, int dependency_count,
+                                 latency_class cls = latency_class::interactive);
   pending_workload        placeholder_workload();
 
 
+  /* SET_DEFERRED_SUBMISSION() function. When enabled, SUBMIT() only queues
+   * the jobs up and FLUSH() hands everything to the GPU with a single
+   * vkQueueSubmit per queue (one batch per SUBMIT() call, dependencies are
+   * kept). This saves the cost of a queue submission per job when lots of
+   * small jobs get submitted. The graph flushes by itself after
+   * MAX_DEFERRED_SUBMITS submissions, and before waiting on or presenting a
+   * job. Disabled by default. */
+  void set_deferred_submission(bool enabled);
+  void flush();
+
+
+  /* WAIT_ANY() / WAIT_ALL() functions. Block until at least one / all of the
+   * COUNT WORKLOADS finished, with a single vkWaitSemaphores call. WAIT_ANY()
+   * returns the index of a finished workload (-1 if TIMEOUT, in nanoseconds,
+   * ran out), WAIT_ALL() returns false if TIMEOUT ran out. Unlike
+   * PENDING_WORKLOAD::WAIT(), the workloads don't get released. */
+  s32  wait_any(const pending_workload *workloads, u32 count, u64 timeout = UINT64_MAX);
+  bool wait_all(const pending_workload *workloads, u32 count, u64 timeout = UINT64_MAX);
+
+
+  /* Coroutine support (C++20). A PENDING_WORKLOAD can be CO_AWAIT-ed on
+   * (e.g. CO_AWAIT GRAPH.SUBMIT(JOB)), and so can READBACK(), which resumes
+   * with the bytes of RNG (whole buffer if the size is 0) of the host visible
+   * buffer REF once the last submitted write to it finished (typically REF is
+   * the destination of ADD_BUFFER_COPY_TO_CPU(), created with
+   * MEMORY_USAGE::GPU_TO_CPU). Suspended coroutines get
+   * resumed by POLL(), which doesn't block and returns how many got resumed,
+   * or RUN(), which keeps going until no coroutine is suspended, sleeping in
+   * vkWaitSemaphores in between. This lets a single thread drive any number
+   * of pipelines. */
+  buffer_readback readback(gpu_buffer_ref ref, range rng = {});
+  u32 poll();
+  void run();
+
+
 public:
   render_graph();
 
@@ -97,38 +275,309 @@ private:
     void wait();
 
   private:
-    VkFence fence_;
+    // Done once the timeline of QUEUE_ reaches TIMELINE_VALUE_ (0 if the
+    // submission never went to a queue)
+    queue_type queue_;
+    u64 timeline_value_;
 
     uint32_t ref_count_;
 
-    // All the semaphores that will get freed up
+    // All the (binary) semaphores that will get freed up
     std::vector<VkSemaphore> semaphores_;
 
-    // All the command buffers that will get freed up
-    std::vector<VkCommandBuffer> cmdbufs_;
+    // All the command buffers that will get freed up (per QUEUE_TYPE of
+    // the pool they come from)
+    std::vector<VkCommandBuffer> cmdbufs_[queue_type_count];
+
+    // All the events used for split barriers by the command buffers
+    std::vector<VkEvent> events_;
+
+    // Secondary command buffers of jobs which were recorded in parallel
+    std::vector<worker_pool::secondary> secondaries_;
 
+    // Staging blocks which the jobs copied buffer updates from
+    std::vector<u32> staging_blocks_;
+
+    // ACTIVE_ is set while the slot is used. IN_FLIGHT_ is set until the GPU
+    // is done with the submission and its command buffers / events got
+    // recycled. The slot (and the semaphores) only gets freed once both the
+    // submission isn't in flight anymore and nothing references it.
     bool active_;
+    bool in_flight_;
 
     friend class render_graph;
     friend class job;
     friend class pending_workload;
   };
 
+  /* Everything END() figures out about a recorded frame. */
+  struct compiled_plan
+  {
+    struct stage_info
+    {
+      // Index into the events of the job which gets signaled after the
+      // stage for split barriers (-1 if there is none)
+      s32 event;
+      VkPipelineStageFlags event_stage;
+
+      // Compute passes only
+      u32 descriptor_offset;
+      u32 group_count[3];
+    };
+
+    // Tracked state of a used resource once the job was recorded
+    struct resource_state
+    {
+      VkImageLayout layout;
+      VkAccessFlags access;
+      VkPipelineStageFlags stage;
+      std::vector<gpu_buffer::range_state> ranges;
+
+      VkPipelineStageFlags job_stages;
+      bool job_writes;
+    };
+
+    // Stages in order of execution. Step I executes the stages in
+    // ORDER[STEP_OFFSETS[I] .. STEP_OFFSETS[I + 1]) after barrier batch I.
+    std::vector<graph_stage_ref> order;
+    std::vector<u32> step_offsets;
+    saved_barrier_batches barriers;
+
+    std::vector<stage_info> stages;
+    std::vector<VkDescriptorSet> descriptor_sets;
+
+    std::vector<graph_resource_ref> used_resources;
+    std::vector<resource_state> end_states;
+
+    u32 event_count;
+    u32 elided_barriers;
+
+    // What was hashed to find the plan, and when it was last used (in number
+    // of lookups) for evicting the least recently used plan
+    std::vector<u64> key;
+    u64 last_used;
+
+    void clear();
+  };
+
+  /* FIFO of the submissions which are in flight on a queue. Timelines get
+   * signaled in order, so the finished submissions are always at the front. */
+  struct submission_ring
+  {
+    std::vector<u32> slots;
+    u32 head = 0, count = 0;
+
+    void push(u32 idx);
+    inline u32 front() const { return slots[head]; }
+    inline void pop() { head = (head + 1) % slots.size(); --count; }
+  };
+
   /* All internal things that can be ignored! */
-  int add_submission_(const submission &sub);
+  u32 add_submission_();
+  void release_submission_(u32 idx);
+  void free_submission_(submission &sub, u32 idx);
   graph_resource_tracker get_resource_tracker();
   void recycle_submissions_();
-  submission *get_successful_submission_();
-  VkFence get_fence_();
   VkSemaphore get_semaphore_();
-  VkCommandBuffer get_command_buffer_();
+  VkCommandBuffer get_command_buffer_(s32 family);
+  s32 pick_queue_family_();
+  VkEvent get_event_();
+
+  VkCommandBuffer record_(VkPipelineStageFlags &last_stage,
+    VkCommandBuffer *release_cmdbufs, bool persistent);
+  void record_in_parallel_(compiled_plan &plan, bool is_cached,
+    const cmdbuf_info &info, VkPipelineStageFlags &last_stage);
+  void prepare_kernel_(compute_pass &cp);
+
+  /* Makes the tracked state of every used resource assume that anything may
+   * have happened to it. Returns the current layouts of the images. */
+  VkImageLayout *forget_resource_states_();
+  void restore_start_layouts_(const VkImageLayout *layouts, VkCommandBuffer cmdbuf);
+
+  /* What a recorded job does with a resource (see SUBMIT()). The history
+   * only gets looked up when the job gets submitted, since the resource may
+   * have been removed in the meantime. */
+  struct resource_use
+  {
+    graph_resource_ref rref;
+    VkPipelineStageFlags stages;
+    bool writes;
+  };
+
+  void collect_resource_uses_(VkCommandBuffer cmdbuf);
+  /* History of the resource, or of its transient slot if it shares memory.
+   * nullptr if the resource doesn't exist anymore. */
+  submission_history *get_history_(graph_resource_ref rref);
+
+  /* Jobs which were ended but not submitted yet get counted (per copy of the
+   * job, see JOB::RECORD_ID_). Once the last copy goes away, whatever the job
+   * held on to gets given back. */
+  void retain_unsubmitted_(u64 record_id);
+  void release_unsubmitted_(const job &j);
+  void drop_unsubmitted_job_(const job &j);
+
+  /* Memory shared by transient resources (see IMAGE_INFO::TRANSIENT) which
+   * are used at different times. HISTORY is shared by all of them, since
+   * they overwrite each other. */
+  struct transient_slot
+  {
+    gpu_allocation memory;
+    u32 resource_count;
+    submission_history history;
+  };
+
+  /* Transient resource which shares its memory, and the step of the job it is
+   * first used in. */
+  struct aliased_use
+  {
+    u32 step;
+    graph_resource_ref rref;
+  };
+
+  /* Handles of a transient resource which got moved to other memory, and the
+   * memory of its slot if nothing else was left in it. Destroyed once the
+   * submissions in HISTORY are done. */
+  struct retired_transient
+  {
+    graph_resource_ref rref;
+    gpu_allocation memory;
+    VkBuffer buffer;
+    VkImage image;
+    VkImageView view;
+    std::vector<VkDescriptorSet> descriptor_sets;
+    submission_history history;
+  };
+
+  /* Any use of memory shared with other resources may overwrite them. */
+  bool is_shared_transient_(s32 slot);
+  /* Binds the transient resources which were just created to memory, which
+   * they share with the others which were created for the job if they are
+   * used at different steps of the plan. Resources from earlier jobs which
+   * now get used at the same time as another one in their slot get moved to
+   * a slot of their own. */
+  void bind_transient_resources_(const compiled_plan &plan);
+  /* Recreates the resource's handle in memory of its own, and retires the old
+   * one (with the memory of its slot if it was the last one in there). */
+  void move_to_own_slot_(graph_resource_ref rref);
+  /* Whether a job which was ended but may still get submitted uses RREF. */
+  bool is_used_by_pending_job_(graph_resource_ref rref);
+  bool is_history_complete_(const submission_history &history);
+  void free_retired_transients_();
+  /* Makes the resources which get used for the first time at STEP forget
+   * about whatever used their memory before. */
+  void discard_aliased_(u32 step);
+
+  /* Host visible buffer which the data of buffer updates gets copied to when
+   * they get added. USED grows as data gets copied in, and JOB_COUNT is the
+   * number of jobs copying from the block which haven't finished yet. Once
+   * that gets back to 0, the block gets filled from the start again. */
+  struct staging_block
+  {
+    VkBuffer buffer;
+    gpu_allocation memory;
+    u32 size;
+    u32 used;
+    u32 job_count;
+  };
+
+  /* Copies SIZE bytes of DATA to a staging block. Returns the block, and the
+   * offset the data went to in OFFSET. */
+  u32 stage_upload_(const void *data, u32 size, u32 &offset);
+  u32 get_staging_block_(u32 size);
+  /* Called once the jobs which used the blocks are done with them. */
+  void release_staging_blocks_(const std::vector<u32> &blocks);
+
+  /* A wait on / signal of a semaphore (VALUE is ignored for binary ones). */
+  struct semaphore_op
+  {
+    VkSemaphore semaphore;
+    u64 value;
+    VkPipelineStageFlags stage;
+  };
+
+  /* Batches which were submitted to a queue but not flushed yet. */
+  struct deferred_submits
+  {
+    struct batch
+    {
+      u32 cmdbuf_offset, cmdbuf_count;
+      u32 wait_offset, wait_count;
+      u32 signal_offset, signal_count;
+    };
+
+    std::vector<batch> batches;
+    std::vector<VkCommandBuffer> cmdbufs;
+    std::vector<semaphore_op> waits;
+    std::vector<semaphore_op> signals;
+  };
+
+  void enqueue_submit_(queue_type queue, const VkCommandBuffer *cmdbufs, int count,
+    const semaphore_op *waits, int wait_count,
+    const semaphore_op *signals, int signal_count);
+  void flush_queue_(queue_type queue);
+
+  bool is_timeline_complete_(queue_type queue, u64 value);
+  void wait_timeline_(queue_type queue, u64 value);
+  // Flushes if VALUE wasn't handed to the queue yet
+  void ensure_flushed_(queue_type queue, u64 value);
+  // Waits until one of the timelines reaches its value (0 if not waited on)
+  bool wait_any_value_(const u64 *values, u64 timeout);
+
+  /* Coroutine which CO_AWAIT-ed on a timeline value. The graph doesn't need
+   * <coroutine>: RESUME gets instantiated by whoever suspended. */
+  struct suspended_coroutine
+  {
+    queue_type queue;
+    u64 value;
+    void *handle;
+    void (*resume)(void *handle);
+  };
+
+  void suspend_until_(queue_type queue, u64 value,
+    void *handle, void (*resume)(void *handle));
 
   void prepare_pass_graph_stage_(graph_stage_ref ref);
   void prepare_transfer_graph_stage_(transfer_operation &op);
 
+  void add_stage_barriers_(graph_stage_ref ref, barrier_batch &barriers);
+  void add_transfer_barriers_(transfer_operation &op, barrier_batch &barriers);
+
+  void build_dependency_waves_();
+  void add_buffer_dag_edges_(gpu_buffer &buf);
+  inline void add_dag_edge_(graph_stage_ref from, graph_stage_ref to)
+    { if (from != to) dag_edges_.push_back({ from, to }); }
+
+  /* Position of a stage in the command buffer. Stages which share a slot
+   * (same wave) are separated from the previous slot by a single barrier. */
+  inline u32 get_execution_slot_(graph_stage_ref stg)
+  {
+    return compile_mode_ == graph_compile_mode::dependency_waves ?
+      stage_waves_[stg] : stg;
+  }
+
+  void plan_split_barriers_(graph_stage_ref stg, compiled_plan &plan);
+
+  /* Hash of everything that was recorded since BEGIN(), including the state
+   * of the bound resources. The values which went into the hash are kept in
+   * FRAME_KEY_, so that hash collisions can be told apart. CACHEABLE is set
+   * if the plan can be reused. */
+  u64 hash_recorded_frame_(bool &cacheable);
+  void compile_frame_(compiled_plan &plan);
+  void compile_stage_(graph_stage_ref stg, compiled_plan &plan);
+  void save_resource_states_(compiled_plan &plan);
+  void restore_resource_states_(compiled_plan &plan);
+
+  /* Runs the prepare callbacks of the render passes of STEP. These record
+   * commands ahead of the barrier batch of the step. */
+  void prepare_step_(const compiled_plan &plan, u32 step, VkCommandBuffer cmdbuf);
+
   void execute_pass_graph_stage_(
     graph_stage_ref ref, VkPipelineStageFlags &last,
-    const cmdbuf_info &info);
+    const cmdbuf_info &info, compiled_plan &plan);
+
+  /* Ends the command buffer being recorded, and continues the job in a new
+   * one (see COMPUTE_PASS::SET_MAX_WORKGROUPS_PER_CHUNK()). */
+  VkCommandBuffer continue_command_buffer_();
 
   void execute_transfer_graph_stage_(
     transfer_operation &op, const cmdbuf_info &info);
@@ -159,13 +608,112 @@ private:
   std::vector<graph_pass> recorded_stages_;
   std::vector<graph_resource_ref> used_resources_;
 
-  std::vector<VkCommandBuffer> free_cmdbufs_;
+  std::vector<VkCommandBuffer> free_cmdbufs_[queue_type_count];
   std::vector<VkSemaphore> free_semaphores_;
-  std::set<VkFence> free_fences_;
+  std::vector<VkEvent> free_events_;
   std::vector<submission> submissions_;
+  std::vector<u32> free_submissions_;
+  submission_ring in_flight_[queue_type_count];
+
+  // One timeline semaphore per QUEUE_TYPE. Every submission to a queue
+  // signals the next value of its timeline, and COMPLETED_VALUES_ caches the
+  // last counter values read back from them.
+  VkSemaphore timelines_[queue_type_count];
+  u64 timeline_values_[queue_type_count];
+  u64 completed_values_[queue_type_count];
+
+  static constexpr uint32_t max_deferred_submits = 64;
+
+  bool is_submission_deferred_;
+  u32 deferred_count_;
+  deferred_submits deferred_[queue_type_count];
+  // Highest timeline values which were handed to the queues
+  u64 flushed_values_[queue_type_count];
+
+  completion_thread completions_;
+  std::vector<suspended_coroutine> suspended_;
   std::vector<compute_kernel_state> kernels_;
 
   VkCommandBuffer current_cmdbuf_;
+  VkCommandBufferUsageFlags current_usage_flags_;
+
+  barrier_stats barrier_stats_;
+
+  // Events signaled while recording the current job, and the events owned by
+  // jobs which were ended but haven't been submitted yet
+  std::vector<VkEvent> recorded_events_;
+  std::unordered_map<VkCommandBuffer, std::vector<VkEvent>> job_events_;
+  // Command buffers the jobs continue in after their first one (keyed by the
+  // first one), which get submitted in batches of their own
+  std::vector<VkCommandBuffer> recorded_continuations_;
+  std::unordered_map<VkCommandBuffer,
+    std::vector<VkCommandBuffer>> job_continuations_;
+  // Resources used by the jobs which were ended (kept around for persistent
+  // jobs since they get submitted again)
+  std::unordered_map<VkCommandBuffer, std::vector<resource_use>> job_uses_;
+  // Number of copies of the jobs which weren't submitted yet (by record ID)
+  std::unordered_map<u64, u32> unsubmitted_jobs_;
+  u64 next_record_id_;
+
+  // Deque since JOB_USES_ points into the slots
+  std::deque<transient_slot> transient_slots_;
+  std::vector<aliased_use> aliased_uses_;
+  std::vector<retired_transient> retired_transients_;
+
+  static constexpr u32 staging_block_size = 16 * 1024 * 1024;
+  static constexpr u32 staging_alignment = 16;
+
+  std::vector<staging_block> staging_blocks_;
+  // Block which uploads go to, -1 before the first one
+  s32 current_staging_block_;
+  // Same as RECORDED_EVENTS_ / JOB_EVENTS_ for the staging blocks (blocks
+  // which were copied to since the last END())
+  std::vector<u32> recorded_staging_;
+  std::unordered_map<VkCommandBuffer, std::vector<u32>> job_staging_;
+
+  static constexpr uint32_t min_parallel_stages = 256;
+  static constexpr uint32_t min_stages_per_chunk = 64;
+
+  worker_pool workers_;
+  // Same as JOB_EVENTS_ for the secondary command buffers of the jobs
+  std::unordered_map<VkCommandBuffer, 
+    std::vector<worker_pool::secondary>> job_secondaries_;
+
+  graph_compile_mode compile_mode_;
+
+  bool is_async_compute_enabled_;
+  bool is_async_transfer_enabled_;
+  // Queue family of the job being recorded, and the family the barriers
+  // track ownership for (-1 for persistent jobs)
+  s32 current_queue_family_;
+  s32 ownership_family_;
+  ownership_releases releases_;
+
+  static constexpr uint32_t max_cached_plans = 16;
+
+  std::unordered_map<u64, compiled_plan> plans_;
+  std::vector<u64> frame_key_;
+  // Used for frames which can't be cached
+  compiled_plan scratch_plan_;
+  plan_cache_stats plan_cache_stats_;
+
+  /* Only used with graph_compile_mode::dependency_waves. */
+  struct dag_edge { graph_stage_ref from, to; };
+
+  std::vector<dag_edge> dag_edges_;
+  std::vector<graph_stage_ref> dag_readers_;
+
+  struct dag_buffer_use
+  {
+    graph_stage_ref stage;
+    VkDeviceSize begin, end;
+    bool writes;
+  };
+
+  std::vector<dag_buffer_use> dag_buffer_uses_;
+  std::vector<u32> stage_waves_;
+  std::vector<graph_stage_ref> wave_order_;
+  std::vector<u32> wave_offsets_;
 
   friend class compute_pass;
   friend class render_pass;
@@ -174,8 +722,10 @@ private:
   friend class transfer_operation;
   friend class graph_resource_tracker;
   friend class job;
+  friend class persistent_job;
   friend class surface;
   friend class pending_workload;
+  friend class buffer_readback;
 };
 
 
@@ -191,6 +741,45 @@ inline pending_workload render_graph::submit(job &job)
   return submit(&job, 1, nullptr, 0);
 }
 
+template <typename ...T>
+inline pending_workload render_graph::submit(
+  latency_class cls, job &job, T &&...dependencies)
+{
+  class job deps[] = { std::forward<T>(dependencies)... };
+  return submit(&job, 1, deps, sizeof...(T), cls);
+}
+
+inline pending_workload render_graph::submit(latency_class cls, job &job)
+{
+  return submit(&job, 1, nullptr, 0, cls);
+}
+
+template <typename ...T>
+inline pending_workload render_graph::submit(persistent_job &pjob, T &&...dependencies)
+{
+  job deps[] = { std::forward<T>(dependencies)... };
+  return submit(&pjob, deps, sizeof...(T));
+}
+
+inline pending_workload render_graph::submit(persistent_job &pjob)
+{
+  return submit(&pjob, nullptr, 0);
+}
+
+template <typename Handle>
+void pending_workload::await_suspend(Handle handle)
+{
+  builder_->suspend_until_(queue_, timeline_value_, handle.address(),
+    [] (void *address) { Handle::from_address(address).resume(); });
+}
+
+template <typename Handle>
+void buffer_readback::await_suspend(Handle handle)
+{
+  builder_->suspend_until_(queue_, value_, handle.address(),
+    [] (void *address) { Handle::from_address(address).resume(); });
+}
+
 std::string make_shader_src_path(const char *path, VkShaderStageFlags stage);
 
 }
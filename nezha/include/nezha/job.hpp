@@ -1,6 +1,11 @@
 #pragma once
 
 #include <vulkan/vulkan.h>
+#include <nezha/types.hpp>
+#include <nezha/gpu_buffer.hpp>
+#include <nezha/queue_type.hpp>
+
+#include <functional>
 
 namespace nz
 {
@@ -26,6 +31,9 @@ public:
 
   void wait();
 
+  /* Doesn't block: whether the job was submitted and finished executing. */
+  bool is_complete();
+
 private:
   job(VkCommandBuffer cmdbuf, 
       VkPipelineStageFlags end_stage, 
@@ -33,16 +41,29 @@ private:
   
   void submit_();
 
+  /* Counts / uncounts this copy of the job, and releases the submission. */
+  void retain_();
+  void release_();
+
 private:
   /* All the recorded commands go in here! (as a result of the end() function
    * in render_graph). */
   VkCommandBuffer cmdbuf_;
 
-  /* This is the semaphore that will get signaled when this command buffer
-   * is finished. */
-  VkSemaphore finished_semaphore_;
+  /* Binary semaphore for the swapchain, which can't use timelines. It gets
+   * signaled by vkAcquireNextImageKHR for the job of
+   * SURFACE::ACQUIRE_NEXT_SWAPCHAIN_IMAGE(), and by the job itself if it
+   * contains a present ready stage (so that SURFACE::PRESENT() can wait on
+   * it). VK_NULL_HANDLE for every other job. */
+  VkSemaphore swapchain_semaphore_;
 
-  VkFence fence_;
+  /* The job is finished once the timeline of its queue reaches this value
+   * (0 until the job gets submitted). */
+  u64 timeline_value_;
+
+  /* Queue the job got submitted to (depends on its family and latency
+   * class). */
+  queue_type queue_;
 
   int submission_idx_;
 
@@ -51,6 +72,24 @@ private:
   /* Use here for recycling command buffers. */
   render_graph *builder_;
 
+  /* Set if the command buffer belongs to a PERSISTENT_JOB (it doesn't get
+   * recycled once the submission finished). */
+  bool persistent_;
+
+  /* Queue family the job was recorded for (compute-only jobs may go to the
+   * async compute queue, transfer-only jobs to the transfer queue). */
+  s32 queue_family_;
+
+  /* Release the resources the job takes over from other queue families (one
+   * per QUEUE_TYPE, VK_NULL_HANDLE if there is nothing to release). They get
+   * submitted to their queues right before the job. */
+  VkCommandBuffer release_cmdbufs_[queue_type_count];
+
+  /* Set from RENDER_GRAPH::END() until the job gets submitted (0 otherwise).
+   * If every copy of the job goes away before it gets submitted, the command
+   * buffers and whatever else it holds on to get recycled. */
+  u64 record_id_;
+
   friend class render_graph;
   friend class surface;
 };
@@ -75,13 +114,94 @@ public:
    * to finish execution. Warning, do not recommend using this. */
   void wait();
 
+  /* Doesn't block: whether the workload finished executing. */
+  bool is_complete();
+
+  /* PROC gets called from the completion thread of the RENDER_GRAPH once the
+   * workload finished executing (right away if it already has). It can't use
+   * the graph, since that isn't thread safe. With deferred submission, it
+   * only gets called once the workload got flushed. Workloads which never
+   * went to a queue call it right away, on the calling thread. */
+  void on_complete(std::function<void()> proc);
+
+  /* Makes the workload awaitable from C++20 coroutines (see
+   * RENDER_GRAPH::POLL() / RUN()). */
+  inline bool await_ready() { return is_complete(); }
+
+  template <typename Handle>
+  void await_suspend(Handle handle);
+
+  inline void await_resume() {}
+
 private:
-  VkFence fence_;
+  queue_type queue_;
+  u64 timeline_value_;
 
   int submission_idx_;
 
   render_graph *builder_;
 
+  friend class render_graph;
+  friend class persistent_job;
+};
+
+
+/* PERSISTENT_JOBs come from RENDER_GRAPH::END_PERSISTENT(). Unlike JOBs, the
+ * recorded command buffer is kept around and can be submitted as many times as
+ * needed, which only costs a vkQueueSubmit. Per-submission data goes through
+ * the parameter buffer given to END_PERSISTENT() (push constants are baked
+ * into the command buffer). */
+class persistent_job
+{
+public:
+  persistent_job();
+
+  persistent_job(const persistent_job &other) = delete;
+  persistent_job(persistent_job &&other);
+
+  persistent_job &operator=(const persistent_job &other) = delete;
+  persistent_job &operator=(persistent_job &&other);
+
+  /* Waits for all submissions to finish before releasing the command
+   * buffer. */
+  ~persistent_job();
+
+  /* Writes to the parameter buffer. If the job is still running from any
+   * submission, this waits for it to finish first. */
+  void set_parameters(const void *data, uint32_t size, uint32_t offset = 0);
+
+  template <typename T>
+  inline void set_parameters(const T &data) 
+    { set_parameters(&data, sizeof(T)); }
+
+  /* Waits for every submission of the job (it may be running on the queues
+   * of both latency classes at once). */
+  void wait();
+
+private:
+  persistent_job(VkCommandBuffer cmdbuf, 
+      VkPipelineStageFlags end_stage, 
+      gpu_buffer_ref parameters,
+      render_graph *builder);
+
+  void release_();
+
+private:
+  VkCommandBuffer cmdbuf_;
+
+  VkPipelineStageFlags end_stage_;
+
+  gpu_buffer_ref parameters_;
+
+  /* Keeps the last submission alive so that we can wait on it. */
+  pending_workload last_workload_;
+
+  /* Highest timeline value the job was submitted with, per QUEUE_TYPE (0 if
+   * it never went to that queue). */
+  u64 submitted_values_[queue_type_count];
+
+  render_graph *builder_;
+
   friend class render_graph;
 };
 
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <nezha/types.hpp>
+
+namespace nz
+{
+
+
+/* Queues jobs can get submitted to. If the GPU doesn't have a dedicated family
+ * for compute or transfers, those alias the family / queue / command pool of
+ * the graphics queue (compute) or the compute queue (transfer). The batch
+ * queues are lower priority queues of the same families, which alias the
+ * normal queues if the family only has one. Every queue type has its own
+ * timeline, even if it aliases the VkQueue of another one. */
+enum queue_type
+{
+  queue_graphics, queue_compute, queue_transfer,
+  queue_graphics_batch, queue_compute_batch, queue_transfer_batch,
+  queue_type_count
+};
+
+
+/* Which queues submitted jobs go to (see RENDER_GRAPH::SUBMIT()). Interactive
+ * jobs go to the normal queues, batch jobs to the low priority ones so that
+ * long running work doesn't hold up latency sensitive work. The GPU can only
+ * switch between queues in between command buffers (if at all), so long batch
+ * work should be split into several jobs. */
+enum class latency_class
+{
+  interactive, batch
+};
+
+
+inline queue_type get_queue_type(queue_type type, latency_class cls)
+{
+  return cls == latency_class::batch && type < queue_graphics_batch ?
+    (queue_type)(type + queue_graphics_batch) : type;
+}
+
+
+/* Last submissions which accessed a resource, as timeline values of the queues
+ * they went to (0 if there is none). Reads only get tracked since the last
+ * write. Used to infer the dependencies between jobs (see RENDER_GRAPH::SUBMIT()). */
+struct submission_history
+{
+  queue_type write_queue;
+  u64 write_value;
+  u64 read_values[queue_type_count];
+};
+
+
+}
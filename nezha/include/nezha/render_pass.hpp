@@ -8,6 +8,7 @@ namespace nz
 
 
 class render_graph;
+class barrier_batch;
 
 
 /* Encapsulates a render pass. Performs all synchronization for
@@ -58,6 +59,12 @@ public:
 private:
   void reset_();
 
+  /* Queues the barriers for all attachments. These need to be issued before
+   * ISSUE_COMMANDS_ gets called. */
+  void add_barriers_(barrier_batch &barriers);
+  /* Runs the PREPARE_COMMANDS_PROC. This goes before the barriers of the
+   * pass, so that they also cover whatever the callback recorded. */
+  void prepare_commands_(VkCommandBuffer cmdbuf);
   void issue_commands_(VkCommandBuffer cmdbuf);
 
   void draw_commands_(draw_commands_proc draw_proc, void *aux);
@@ -3,6 +3,8 @@
 #include <nezha/gpu_image.hpp>
 #include <nezha/gpu_buffer.hpp>
 
+#include <new>
+
 namespace nz
 {
 
@@ -20,22 +22,24 @@ public:
 
   ~graph_resource() 
   {
-    switch (type_) 
-    {
-    case graph_image: img_.~gpu_image(); break;
-    case graph_buffer: buf_.~gpu_buffer(); break;
-    default: break;
-    }
+    destroy_();
   };
 
+  // The union members are only alive for the current TYPE_, so they get
+  // constructed in place instead of assigned to
   graph_resource &operator=(graph_resource &&other) 
   {
+    if (this == &other)
+      return *this;
+
+    destroy_();
+
     type_ = other.type_;
     was_used_ = other.was_used_;
     switch (type_) 
     {
-    case graph_image: img_ = std::move(other.img_); break;
-    case graph_buffer: buf_ = std::move(other.buf_); break;
+    case graph_image: new (&img_) gpu_image(std::move(other.img_)); break;
+    case graph_buffer: new (&buf_) gpu_buffer(std::move(other.buf_)); break;
     default: break;
     }
 
@@ -48,8 +52,8 @@ public:
     was_used_ = other.was_used_;
     switch (type_) 
     {
-    case graph_image: img_ = std::move(other.img_); break;
-    case graph_buffer: buf_ = std::move(other.buf_); break;
+    case graph_image: new (&img_) gpu_image(std::move(other.img_)); break;
+    case graph_buffer: new (&buf_) gpu_buffer(std::move(other.buf_)); break;
     default: break;
     }
   }
@@ -69,6 +73,19 @@ public:
   inline gpu_buffer &get_buffer() { return buf_; }
   inline gpu_image &get_image() { return img_; }
 
+private:
+  inline void destroy_()
+  {
+    switch (type_) 
+    {
+    case graph_image: img_.~gpu_image(); break;
+    case graph_buffer: buf_.~gpu_buffer(); break;
+    default: break;
+    }
+
+    type_ = none;
+  }
+
 private:
   type type_;
   bool was_used_;
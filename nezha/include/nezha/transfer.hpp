@@ -11,13 +11,6 @@ namespace nz
 class render_graph;
 
 
-struct range
-{
-  uint32_t offset;
-  uint32_t size;
-};
-
-
 /* Encapsulates a transfer operation. For internal use. */
 class transfer_operation 
 {
@@ -31,7 +24,7 @@ public:
   transfer_operation(render_graph *builder, u32 idx);
 
   void init_as_buffer_update(
-    graph_resource_ref buf_ref, void *data, uint32_t offset, uint32_t size);
+    graph_resource_ref buf_ref, const void *data, uint32_t offset, uint32_t size);
 
   void init_as_buffer_copy_to_cpu(
     graph_resource_ref dst, graph_resource_ref src, uint32_t dst_base, const range &src_range);
@@ -66,7 +59,9 @@ private:
   {
     struct 
     {
-      void *data;
+      // Where the data got copied to in the staging blocks
+      uint32_t staging_block;
+      uint32_t staging_offset;
       uint32_t offset;
       uint32_t size;
     } buffer_update_state_;
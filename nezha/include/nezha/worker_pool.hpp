@@ -0,0 +1,90 @@
+#pragma once
+
+#include <nezha/types.hpp>
+#include <vulkan/vulkan.h>
+
+#include <mutex>
+#include <vector>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+namespace nz
+{
+
+
+/* WORKER_POOL keeps a few threads around so that the RENDER_GRAPH can record
+ * big jobs into secondary command buffers in parallel. Command pools can't be
+ * used from multiple threads at once, so every thread (including the one
+ * calling RUN(), which is thread 0) allocates from its own VkCommandPool. 
+ * Threads only get spawned the first time RUN() needs them. */
+class worker_pool
+{
+public:
+  struct secondary
+  {
+    u32 thread_idx;
+    s32 family;
+    VkCommandBuffer cmdbuf;
+  };
+
+  worker_pool();
+  ~worker_pool();
+
+  /* THREAD_COUNT includes the thread calling RUN(). */
+  void set_thread_count(u32 thread_count);
+
+  inline u32 get_thread_count() const
+    { return thread_count_; }
+
+  /* Calls PROC(THREAD_IDX) on every thread and returns once all of them have
+   * returned. */
+  void run(const std::function<void(u32)> &proc);
+
+  /* Secondary command buffer for queue family FAMILY from the pools of
+   * THREAD_IDX. Must be called from that thread when inside of RUN(). */
+  secondary get_secondary(u32 thread_idx, s32 family);
+
+  /* Gives back a secondary command buffer which finished executing. Can't be
+   * called while inside of RUN(). */
+  void free_secondary(const secondary &cmdbuf);
+
+private:
+  void spawn_threads_();
+  void join_threads_();
+  void worker_loop_(u32 thread_idx, u64 generation);
+
+private:
+  struct family_pool
+  {
+    s32 family;
+    VkCommandPool pool;
+    std::vector<VkCommandBuffer> free_cmdbufs;
+  };
+
+  struct thread_state
+  {
+    // One per queue family the thread recorded for
+    std::vector<family_pool> pools;
+  };
+
+  family_pool &get_pool_(u32 thread_idx, s32 family);
+
+  u32 thread_count_;
+
+  std::vector<thread_state> states_;
+  // THREADS_[I] is thread I + 1
+  std::vector<std::thread> threads_;
+
+  std::mutex mutex_;
+  std::condition_variable start_cv_;
+  std::condition_variable done_cv_;
+
+  const std::function<void(u32)> *proc_;
+  u64 generation_;
+  u32 busy_count_;
+  bool quit_;
+};
+
+
+}
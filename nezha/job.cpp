@@ -2,141 +2,202 @@
 #include <nezha/graph.hpp>
 #include <nezha/gpu_context.hpp>
 
+#include <cstring>
+#include <utility>
+
 namespace nz
 {
 
 job::job()
-  : submission_idx_(-1)
+  : swapchain_semaphore_(VK_NULL_HANDLE), timeline_value_(0),
+    queue_(queue_graphics), submission_idx_(-1), persistent_(false),
+    queue_family_(-1),
+    release_cmdbufs_{},
+    record_id_(0)
 {
 }
 
 job::job(const job &other)
 {
   cmdbuf_ = other.cmdbuf_;
-  finished_semaphore_ = other.finished_semaphore_;
+  swapchain_semaphore_ = other.swapchain_semaphore_;
+  timeline_value_ = other.timeline_value_;
+  queue_ = other.queue_;
   submission_idx_ = other.submission_idx_;
-  fence_ = other.fence_;
   end_stage_ = other.end_stage_;
   builder_ = other.builder_;
+  persistent_ = other.persistent_;
+  queue_family_ = other.queue_family_;
+  for (int i = 0; i < queue_type_count; ++i)
+    release_cmdbufs_[i] = other.release_cmdbufs_[i];
+  record_id_ = other.record_id_;
 
-  if (submission_idx_ != -1)
-  {
-    builder_->submissions_[submission_idx_].ref_count_++;
-  }
+  retain_();
 }
 
 job::job(job &&other)
 {
   cmdbuf_ = other.cmdbuf_;
-  finished_semaphore_ = other.finished_semaphore_;
+  swapchain_semaphore_ = other.swapchain_semaphore_;
+  timeline_value_ = other.timeline_value_;
+  queue_ = other.queue_;
   submission_idx_ = other.submission_idx_;
-  fence_ = other.fence_;
   end_stage_ = other.end_stage_;
   builder_ = other.builder_;
+  persistent_ = other.persistent_;
+  queue_family_ = other.queue_family_;
+  for (int i = 0; i < queue_type_count; ++i)
+    release_cmdbufs_[i] = other.release_cmdbufs_[i];
+  record_id_ = other.record_id_;
 
   other.submission_idx_ = -1;
+  other.record_id_ = 0;
 }
 
 job::job(VkCommandBuffer cmdbuf, VkPipelineStageFlags end_stage, render_graph *builder)
-: builder_(builder), cmdbuf_(cmdbuf), end_stage_(end_stage), submission_idx_(-1)
+: builder_(builder), cmdbuf_(cmdbuf), swapchain_semaphore_(VK_NULL_HANDLE),
+  timeline_value_(0), queue_(queue_graphics), end_stage_(end_stage),
+  submission_idx_(-1),
+  persistent_(false), queue_family_(gctx->graphics_family),
+  release_cmdbufs_{}, record_id_(0)
 {
-  finished_semaphore_ = builder_->get_semaphore_();
 }
 
 job::~job()
 {
-  if (submission_idx_ != -1)
-  {
-    assert(builder_->submissions_[submission_idx_].ref_count_ > 0);
-    builder_->submissions_[submission_idx_].ref_count_--;
-    submission_idx_ = -1;
-  }
+  release_();
 }
 
 job &job::operator=(const job &other)
 {
-  if (submission_idx_ != -1)
-  {
-    assert(builder_->submissions_[submission_idx_].ref_count_ > 0);
-    builder_->submissions_[submission_idx_].ref_count_--;
-    submission_idx_ = -1;
-  }
+  if (this == &other)
+    return *this;
+
+  release_();
 
   cmdbuf_ = other.cmdbuf_;
-  finished_semaphore_ = other.finished_semaphore_;
+  swapchain_semaphore_ = other.swapchain_semaphore_;
+  timeline_value_ = other.timeline_value_;
+  queue_ = other.queue_;
   submission_idx_ = other.submission_idx_;
-  fence_ = other.fence_;
   end_stage_ = other.end_stage_;
   builder_ = other.builder_;
+  persistent_ = other.persistent_;
+  queue_family_ = other.queue_family_;
+  for (int i = 0; i < queue_type_count; ++i)
+    release_cmdbufs_[i] = other.release_cmdbufs_[i];
+  record_id_ = other.record_id_;
 
-  if (submission_idx_ != -1)
-    builder_->submissions_[submission_idx_].ref_count_++;
+  retain_();
 
   return *this;
 }
 
 job &job::operator=(job &&other)
 {
+  if (this == &other)
+    return *this;
+
+  release_();
+
   cmdbuf_ = other.cmdbuf_;
-  finished_semaphore_ = other.finished_semaphore_;
+  swapchain_semaphore_ = other.swapchain_semaphore_;
+  timeline_value_ = other.timeline_value_;
+  queue_ = other.queue_;
   submission_idx_ = other.submission_idx_;
-  fence_ = other.fence_;
   end_stage_ = other.end_stage_;
   builder_ = other.builder_;
+  persistent_ = other.persistent_;
+  queue_family_ = other.queue_family_;
+  for (int i = 0; i < queue_type_count; ++i)
+    release_cmdbufs_[i] = other.release_cmdbufs_[i];
+  record_id_ = other.record_id_;
 
   other.submission_idx_ = -1;
+  other.record_id_ = 0;
 
   return *this;
 }
 
+void job::retain_()
+{
+  if (submission_idx_ != -1)
+    builder_->submissions_[submission_idx_].ref_count_++;
+
+  if (record_id_)
+    builder_->retain_unsubmitted_(record_id_);
+}
+
+void job::release_()
+{
+  if (submission_idx_ != -1)
+  {
+    builder_->release_submission_(submission_idx_);
+    submission_idx_ = -1;
+  }
+
+  if (record_id_)
+  {
+    builder_->release_unsubmitted_(*this);
+    record_id_ = 0;
+  }
+}
+
 void job::wait()
 {
-  vkWaitForFences(gctx->device, 1, &fence_, true, UINT64_MAX);
+  if (timeline_value_)
+    builder_->wait_timeline_(queue_, timeline_value_);
 
   if (submission_idx_ != -1)
   {
-    assert(builder_->submissions_[submission_idx_].ref_count_ > 0);
-    builder_->submissions_[submission_idx_].ref_count_--;
+    builder_->release_submission_(submission_idx_);
     submission_idx_ = -1;
   }
 }
 
+bool job::is_complete()
+{
+  // Placeholder jobs are complete right away, unsubmitted ones never are
+  if (!timeline_value_)
+    return submission_idx_ != -1;
+
+  builder_->ensure_flushed_(queue_, timeline_value_);
+
+  return builder_->is_timeline_complete_(queue_, timeline_value_);
+}
+
 pending_workload::pending_workload()
-  : submission_idx_(-1)
+  : queue_(queue_graphics), timeline_value_(0), submission_idx_(-1),
+    builder_(nullptr)
 {
 }
 
 pending_workload::pending_workload(const pending_workload &other)
-  : submission_idx_(other.submission_idx_), fence_(other.fence_), builder_(other.builder_)
+  : queue_(other.queue_), timeline_value_(other.timeline_value_),
+    submission_idx_(other.submission_idx_), builder_(other.builder_)
 {
   if (submission_idx_ != -1)
     builder_->submissions_[submission_idx_].ref_count_++;
 }
 
 pending_workload::pending_workload(pending_workload &&other)
-  : fence_(other.fence_), builder_(other.builder_)
+  : queue_(other.queue_), timeline_value_(other.timeline_value_),
+    submission_idx_(other.submission_idx_), builder_(other.builder_)
 {
-  if (submission_idx_ != -1)
-  {
-    assert(builder_->submissions_[submission_idx_].ref_count_ > 0);
-    builder_->submissions_[submission_idx_].ref_count_--;
-    submission_idx_ = -1;
-  }
-
-  submission_idx_ = other.submission_idx_;
+  other.submission_idx_ = -1;
 }
 
 pending_workload &pending_workload::operator=(const pending_workload &other)
 {
   if (submission_idx_ != -1)
   {
-    assert(builder_->submissions_[submission_idx_].ref_count_ > 0);
-    builder_->submissions_[submission_idx_].ref_count_--;
+    builder_->release_submission_(submission_idx_);
     submission_idx_ = -1;
   }
 
   submission_idx_ = other.submission_idx_;
-  fence_ = other.fence_; 
+  queue_ = other.queue_;
+  timeline_value_ = other.timeline_value_;
   builder_ = other.builder_;
 
   if (submission_idx_ != -1)
@@ -147,17 +208,18 @@ pending_workload &pending_workload::operator=(const pending_workload &other)
 
 pending_workload &pending_workload::operator=(pending_workload &&other)
 {
-  fence_ = other.fence_;
-  builder_ = other.builder_;
-
   if (submission_idx_ != -1)
   {
-    assert(builder_->submissions_[submission_idx_].ref_count_ > 0);
-    builder_->submissions_[submission_idx_].ref_count_--;
+    builder_->release_submission_(submission_idx_);
     submission_idx_ = -1;
   }
 
+  queue_ = other.queue_;
+  timeline_value_ = other.timeline_value_;
+  builder_ = other.builder_;
+
   submission_idx_ = other.submission_idx_;
+  other.submission_idx_ = -1;
 
   return *this;
 }
@@ -166,22 +228,174 @@ pending_workload::~pending_workload()
 {
   if (submission_idx_ != -1)
   {
-    assert(builder_->submissions_[submission_idx_].ref_count_ > 0);
-    builder_->submissions_[submission_idx_].ref_count_--;
+    builder_->release_submission_(submission_idx_);
   }
 }
 
 void pending_workload::wait()
 {
-  vkWaitForFences(gctx->device, 1, &fence_, VK_TRUE, UINT64_MAX);
+  if (timeline_value_)
+    builder_->wait_timeline_(queue_, timeline_value_);
 
   /* Make it so that WAIT() release the submission. */
   if (submission_idx_ != -1)
   {
-    assert(builder_->submissions_[submission_idx_].ref_count_ > 0);
-    builder_->submissions_[submission_idx_].ref_count_--;
+    builder_->release_submission_(submission_idx_);
     submission_idx_ = -1;
   }
 }
 
+bool pending_workload::is_complete()
+{
+  if (!timeline_value_)
+    return true;
+
+  builder_->ensure_flushed_(queue_, timeline_value_);
+
+  return builder_->is_timeline_complete_(queue_, timeline_value_);
+}
+
+void pending_workload::on_complete(std::function<void()> proc)
+{
+  // Never went to a queue (placeholder or default constructed)
+  if (!timeline_value_)
+  {
+    proc();
+    return;
+  }
+
+  builder_->completions_.add(builder_->timelines_[queue_],
+    timeline_value_, std::move(proc));
+}
+
+bool buffer_readback::await_ready()
+{
+  if (!value_)
+    return true;
+
+  builder_->ensure_flushed_(queue_, value_);
+
+  return builder_->is_timeline_complete_(queue_, value_);
+}
+
+std::vector<u8> buffer_readback::await_resume()
+{
+  gpu_buffer &buf = builder_->get_buffer(buffer_);
+  buf.invalidate(range_);
+
+  memory_mapping mapping = buf.map();
+
+  size_t size = (range_.size ? range_.size : mapping.size() - range_.offset);
+  u8 *data = (u8 *)mapping.data() + range_.offset;
+
+  return std::vector<u8>(data, data + size);
+}
+
+persistent_job::persistent_job()
+  : cmdbuf_(VK_NULL_HANDLE), end_stage_(0), parameters_(invalid_graph_ref),
+    builder_(nullptr), submitted_values_{}
+{
+}
+
+persistent_job::persistent_job(VkCommandBuffer cmdbuf, 
+  VkPipelineStageFlags end_stage, 
+  gpu_buffer_ref parameters,
+  render_graph *builder)
+: cmdbuf_(cmdbuf), end_stage_(end_stage), parameters_(parameters),
+  builder_(builder), submitted_values_{}
+{
+}
+
+persistent_job::persistent_job(persistent_job &&other)
+: cmdbuf_(other.cmdbuf_), end_stage_(other.end_stage_), 
+  parameters_(other.parameters_), 
+  last_workload_(std::move(other.last_workload_)),
+  builder_(other.builder_)
+{
+  for (u32 q = 0; q < queue_type_count; ++q)
+    submitted_values_[q] = other.submitted_values_[q];
+
+  other.cmdbuf_ = VK_NULL_HANDLE;
+}
+
+persistent_job &persistent_job::operator=(persistent_job &&other)
+{
+  release_();
+
+  cmdbuf_ = other.cmdbuf_;
+  end_stage_ = other.end_stage_;
+  parameters_ = other.parameters_;
+  last_workload_ = std::move(other.last_workload_);
+  builder_ = other.builder_;
+  for (u32 q = 0; q < queue_type_count; ++q)
+    submitted_values_[q] = other.submitted_values_[q];
+
+  other.cmdbuf_ = VK_NULL_HANDLE;
+
+  return *this;
+}
+
+persistent_job::~persistent_job()
+{
+  release_();
+}
+
+void persistent_job::release_()
+{
+  if (cmdbuf_ == VK_NULL_HANDLE)
+    return;
+
+  // The command buffer can't go back to the pool while the GPU still uses it
+  wait();
+
+  builder_->job_uses_.erase(cmdbuf_);
+
+  auto continuations = builder_->job_continuations_.find(cmdbuf_);
+  if (continuations != builder_->job_continuations_.end())
+  {
+    auto &free_cmdbufs = builder_->free_cmdbufs_[queue_graphics];
+    free_cmdbufs.insert(free_cmdbufs.end(),
+      continuations->second.begin(), continuations->second.end());
+    builder_->job_continuations_.erase(continuations);
+  }
+
+  auto staging = builder_->job_staging_.find(cmdbuf_);
+  if (staging != builder_->job_staging_.end())
+  {
+    builder_->release_staging_blocks_(staging->second);
+    builder_->job_staging_.erase(staging);
+  }
+
+  builder_->free_cmdbufs_[queue_graphics].push_back(cmdbuf_);
+  cmdbuf_ = VK_NULL_HANDLE;
+}
+
+void persistent_job::wait()
+{
+  // Submissions to other queues may still be running after the last one
+  for (u32 q = 0; q < queue_type_count; ++q)
+  {
+    if (submitted_values_[q])
+      builder_->wait_timeline_((queue_type)q, submitted_values_[q]);
+  }
+
+  if (last_workload_.submission_idx_ != -1)
+    last_workload_.wait();
+}
+
+void persistent_job::set_parameters(const void *data, uint32_t size, uint32_t offset)
+{
+  assert(parameters_ != invalid_graph_ref);
+
+  // The last submission may still be reading the parameters
+  wait();
+
+  gpu_buffer &buf = builder_->get_buffer(parameters_);
+
+  memory_mapping mapping = buf.map();
+  memcpy((uint8_t *)mapping.data() + offset, data, size);
+
+  buf.flush({ offset, size });
+}
+
 }
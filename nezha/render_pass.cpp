@@ -1,4 +1,5 @@
 #include <nezha/graph.hpp>
+#include <nezha/barrier.hpp>
 #include <nezha/bump_alloc.hpp>
 #include <nezha/render_pass.hpp>
 #include <nezha/gpu_context.hpp>
@@ -70,11 +71,31 @@ void render_pass::reset_()
   prepare_commands_proc_ = nullptr;
 }
 
-void render_pass::issue_commands_(VkCommandBuffer cmdbuf) 
+void render_pass::add_barriers_(barrier_batch &barriers)
+{
+  for (int b_idx = 0; b_idx < bindings_->size(); ++b_idx) 
+  {
+    binding &b = (*bindings_)[b_idx];
+
+    gpu_image &img = builder_->get_image_(b.rref);
+
+    VkPipelineStageFlags stage = (b_idx == depth_index_ ?
+      VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT :
+      VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+
+    // Queue memory barrier (also updates image data)
+    barriers.add_image(img, b.get_image_layout(), b.get_image_access(), stage);
+  }
+}
+
+void render_pass::prepare_commands_(VkCommandBuffer cmdbuf)
 {
   if (prepare_commands_proc_)
     prepare_commands_proc_({ cmdbuf, builder_, prepare_commands_aux_ });
+}
 
+void render_pass::issue_commands_(VkCommandBuffer cmdbuf) 
+{
   uint32_t color_attachment_count = (uint32_t)(bindings_->size() - 
     (depth_index_ == -1 ? 0 : 1));
 
@@ -83,8 +104,6 @@ void render_pass::issue_commands_(VkCommandBuffer cmdbuf)
   auto *depth_attachment = (depth_index_ == -1 ? 
     nullptr : bump_mem_alloc<VkRenderingAttachmentInfoKHR>());
 
-  auto *img_barriers = bump_mem_alloc<VkImageMemoryBarrier>(bindings_->size());
-
   for (int b_idx = 0, c_idx = 0; b_idx < bindings_->size(); ++b_idx) 
   {
     if (b_idx == depth_index_) 
@@ -103,32 +122,6 @@ void render_pass::issue_commands_(VkCommandBuffer cmdbuf)
       depth_attachment->loadOp = (b.clear.r < 0.0f ? 
         VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR);
       depth_attachment->storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-
-      // Issue memory barrier
-      VkImageMemoryBarrier barrier = 
-      {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .image = img.get_().image_,
-        .oldLayout = img.get_().current_layout_,
-        .newLayout = b.get_image_layout(),
-        .srcAccessMask = img.get_().current_access_,
-        .dstAccessMask = b.get_image_access(),
-        .subresourceRange.aspectMask = img.get_().aspect_,
-        // TODO: Support non-hardcoded values for this
-        .subresourceRange.baseArrayLayer = 0,
-        .subresourceRange.baseMipLevel = 0,
-        .subresourceRange.layerCount = 1,
-        .subresourceRange.levelCount = 1
-      };
-
-      vkCmdPipelineBarrier(cmdbuf, img.get_().last_used_,
-        VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT, 
-        0, 0, NULL, 0, NULL, 1, &barrier);
-
-      // Update image data
-      img.get_().current_layout_ = b.get_image_layout();
-      img.get_().current_access_ = b.get_image_access();
-      img.get_().last_used_ = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
     }
     else 
     {
@@ -152,32 +145,6 @@ void render_pass::issue_commands_(VkCommandBuffer cmdbuf)
          VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR);
       color_attachments[c_idx].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
 
-      // Issue memory barrier
-      VkImageMemoryBarrier barrier = 
-      {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .image = img.get_().image_,
-        .oldLayout = img.get_().current_layout_,
-        .newLayout = b.get_image_layout(),
-        .srcAccessMask = img.get_().current_access_,
-        .dstAccessMask = b.get_image_access(),
-        .subresourceRange.aspectMask = img.get_().aspect_,
-        // TODO: Support non-hardcoded values for this
-        .subresourceRange.baseArrayLayer = 0,
-        .subresourceRange.baseMipLevel = 0,
-        .subresourceRange.layerCount = 1,
-        .subresourceRange.levelCount = 1
-      };
-
-      vkCmdPipelineBarrier(cmdbuf, img.get_().last_used_,
-        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-        0, 0, NULL, 0, NULL, 1, &barrier);
-
-      // Update image data
-      img.get_().current_layout_ = b.get_image_layout();
-      img.get_().current_access_ = b.get_image_access();
-      img.get_().last_used_ = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-
       ++c_idx;
     }
   }
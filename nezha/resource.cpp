@@ -1,4 +1,5 @@
 #include <nezha/graph.hpp>
+#include <nezha/barrier.hpp>
 #include <nezha/resource.hpp>
 
 namespace nz
@@ -17,21 +18,10 @@ void graph_resource_tracker::prepare_buffer_for(
 
   binding b = { .utype = type };
 
-  VkBufferMemoryBarrier barrier = 
-  {
-    .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
-    .size = buf.size_,
-    .buffer = buf.buffer_,
-    .offset = 0,
-    .srcAccessMask = buf.current_access_,
-    .dstAccessMask = b.get_buffer_access(),
-  };
-
-  vkCmdPipelineBarrier(
-    cmdbuf_, buf.last_used_, stage, 0, 0, nullptr, 1, &barrier, 0, nullptr);
-
-  buf.current_access_ = b.get_buffer_access();
-  buf.last_used_ = stage;
+  barrier_batch barriers(0, 1, &builder_->barrier_stats_);
+  barriers.set_queue_family(builder_->ownership_family_, &builder_->releases_);
+  barriers.add_buffer(buf, b.get_buffer_access(), stage);
+  barriers.issue(cmdbuf_);
 }
 
 gpu_buffer &graph_resource_tracker::get_buffer(gpu_buffer_ref ref)
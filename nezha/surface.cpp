@@ -43,17 +43,23 @@ nz::job surface::acquire_next_swapchain_image(render_graph &graph, u32 &idx)
   nz::job ret = graph.placeholder_job();
 
   vkAcquireNextImageKHR(gctx->device, swapchain_, UINT64_MAX, 
-                        ret.finished_semaphore_, VK_NULL_HANDLE, &idx);
+                        ret.swapchain_semaphore_, VK_NULL_HANDLE, &idx);
 
   return ret;
 }
 
 void surface::present(const nz::job &render_job, u32 image_idx)
 {
+  // Only jobs with a present ready stage signal a binary semaphore
+  assert(render_job.swapchain_semaphore_ != VK_NULL_HANDLE);
+
+  // The semaphore needs to have its signal submitted before presenting
+  render_job.builder_->flush();
+
   VkPresentInfoKHR present_info = {};
   present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
   present_info.waitSemaphoreCount = 1;
-  present_info.pWaitSemaphores = &render_job.finished_semaphore_;
+  present_info.pWaitSemaphores = &render_job.swapchain_semaphore_;
   present_info.swapchainCount = 1;
   present_info.pSwapchains = &swapchain_;
   present_info.pImageIndices = &image_idx;
@@ -18,14 +18,14 @@ transfer_operation::transfer_operation(
 }
 
 void transfer_operation::init_as_buffer_update(
-  graph_resource_ref buf_ref, void *data, uint32_t offset, uint32_t size) 
+  graph_resource_ref buf_ref, const void *data, uint32_t offset, uint32_t size) 
 {
   type_ = type::buffer_update;
   binding b = { 0, binding::type::buffer_transfer_dst, buf_ref };
+  b.buffer_range = { offset, size };
 
   bindings_->push_back(b);
 
-  buffer_update_state_.data = data;
   buffer_update_state_.offset = offset;
   buffer_update_state_.size = size;
 
@@ -36,6 +36,10 @@ void transfer_operation::init_as_buffer_update(
   {
     buffer_update_state_.size = buf.size_;
   }
+
+  // The caller's memory doesn't need to outlive the call
+  buffer_update_state_.staging_block = builder_->stage_upload_(
+    data, buffer_update_state_.size, buffer_update_state_.staging_offset);
 }
 
 void transfer_operation::init_as_buffer_copy_to_cpu(
@@ -44,6 +48,8 @@ void transfer_operation::init_as_buffer_copy_to_cpu(
   type_ = type::buffer_copy_to_cpu;
   binding b0 = { 0, binding::type::buffer_transfer_dst, dst };
   binding b1 = { 1, binding::type::buffer_transfer_src, src };
+  b0.buffer_range = { dst_base, src_range.size };
+  b1.buffer_range = src_range;
 
   bindings_->push_back(b0);
   bindings_->push_back(b1);
@@ -69,6 +75,8 @@ void transfer_operation::init_as_buffer_copy(
   type_ = type::buffer_copy;
   binding b0 = { 0, binding::type::buffer_transfer_dst, dst };
   binding b1 = { 1, binding::type::buffer_transfer_src, src };
+  b0.buffer_range = { dst_base, src_range.size };
+  b1.buffer_range = src_range;
 
   bindings_->push_back(b0);
   bindings_->push_back(b1);
@@ -0,0 +1,159 @@
+#include <nezha/log.hpp>
+#include <nezha/worker_pool.hpp>
+#include <nezha/gpu_context.hpp>
+
+namespace nz
+{
+
+worker_pool::worker_pool()
+: thread_count_(1),
+  proc_(nullptr),
+  generation_(0),
+  busy_count_(0),
+  quit_(false)
+{
+  states_.resize(1);
+}
+
+worker_pool::~worker_pool()
+{
+  join_threads_();
+}
+
+void worker_pool::set_thread_count(u32 thread_count)
+{
+  join_threads_();
+
+  thread_count_ = (thread_count ? thread_count : 1);
+
+  // Command buffers of the pools may still be in flight: pools never go away
+  if (states_.size() < thread_count_)
+    states_.resize(thread_count_);
+}
+
+void worker_pool::run(const std::function<void(u32)> &proc)
+{
+  if (threads_.size() + 1 < thread_count_)
+    spawn_threads_();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    proc_ = &proc;
+    busy_count_ = threads_.size();
+    ++generation_;
+  }
+
+  start_cv_.notify_all();
+
+  proc(0);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this] { return busy_count_ == 0; });
+
+  proc_ = nullptr;
+}
+
+worker_pool::secondary worker_pool::get_secondary(u32 thread_idx, s32 family)
+{
+  family_pool &pool = get_pool_(thread_idx, family);
+
+  if (pool.free_cmdbufs.size())
+  {
+    VkCommandBuffer ret = pool.free_cmdbufs.back();
+    pool.free_cmdbufs.pop_back();
+    return { thread_idx, family, ret };
+  }
+
+  VkCommandBuffer command_buffer;
+  VkCommandBufferAllocateInfo command_buffer_info = {};
+  command_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  command_buffer_info.commandBufferCount = 1;
+  command_buffer_info.commandPool = pool.pool;
+  command_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+  vkAllocateCommandBuffers(
+    gctx->device, &command_buffer_info, &command_buffer);
+
+  nz::log_info("Created secondary command buffer");
+
+  return { thread_idx, family, command_buffer };
+}
+
+void worker_pool::free_secondary(const secondary &cmdbuf)
+{
+  get_pool_(cmdbuf.thread_idx, cmdbuf.family).free_cmdbufs.push_back(
+    cmdbuf.cmdbuf);
+}
+
+worker_pool::family_pool &worker_pool::get_pool_(u32 thread_idx, s32 family)
+{
+  thread_state &state = states_[thread_idx];
+
+  for (auto &pool : state.pools)
+    if (pool.family == family)
+      return pool;
+
+  family_pool pool = { family };
+
+  VkCommandPoolCreateInfo pool_info = {};
+  pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  pool_info.queueFamilyIndex = family;
+  pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  VK_CHECK(vkCreateCommandPool(
+    gctx->device, &pool_info, nullptr, &pool.pool));
+
+  state.pools.push_back(std::move(pool));
+  return state.pools.back();
+}
+
+void worker_pool::spawn_threads_()
+{
+  for (u32 i = threads_.size() + 1; i < thread_count_; ++i)
+    threads_.emplace_back(&worker_pool::worker_loop_, this, i, generation_);
+}
+
+void worker_pool::join_threads_()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+
+  start_cv_.notify_all();
+
+  for (auto &t : threads_)
+    t.join();
+
+  threads_.clear();
+  quit_ = false;
+}
+
+void worker_pool::worker_loop_(u32 thread_idx, u64 generation)
+{
+  for (;;)
+  {
+    const std::function<void(u32)> *proc;
+
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      start_cv_.wait(lock, 
+        [&] { return quit_ || generation_ != generation; });
+
+      if (quit_)
+        return;
+
+      generation = generation_;
+      proc = proc_;
+    }
+
+    (*proc)(thread_idx);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--busy_count_ == 0)
+        done_cv_.notify_one();
+    }
+  }
+}
+
+}